@@ -0,0 +1,177 @@
+/*
+ * fuzz.h - common driver for the usch fuzz targets
+ *
+ * Every fuzz_*.c defines LLVMFuzzerTestOneInput() for one group of usch
+ * functions. Built with -DUSCH_FUZZ_LIBFUZZER and -fsanitize=fuzzer that is
+ * all there is. Otherwise this header adds a main() that runs the target
+ * on each file named on the command line, or on the standard input, so the
+ * same source is an AFL driver (persistent with afl-clang-fast) and a way
+ * to replay a crash.
+ *
+ * A target checks its results against a simple oracle and calls fuzz_fail()
+ * when they differ, which aborts so that every fuzzer reports it.
+ */
+#ifndef USCH_FUZZ_H
+#define USCH_FUZZ_H
+
+#define USCH_IMPLEMENTATION
+#include "../usch.h"
+
+#include <stdint.h>
+
+int LLVMFuzzerTestOneInput(const uint8_t *p_data, size_t size);
+
+#define fuzz_assert(cond) do { if (!(cond)) fuzz_fail(__FILE__, __LINE__, #cond); } while (0)
+
+static void fuzz_fail(const char *p_file, int line, const char *p_cond)
+{
+    fprintf(stderr, "%s:%d: check failed: %s\n", p_file, line, p_cond);
+    abort();
+}
+
+/*
+ * Copy the input into a NUL terminated buffer and split it at NUL bytes
+ * into num strings, so one input can feed e.g. a string and a delimiter
+ * set. Missing strings are "". Returns the buffer to free().
+ */
+static char *fuzz_strings(const uint8_t *p_data, size_t size, const char **pp_strs, int num)
+{
+    char *p_buf = (char*)malloc(size + 1);
+    size_t pos = 0;
+    int i;
+
+    if (p_buf == NULL)
+        abort();
+    memcpy(p_buf, p_data, size);
+    p_buf[size] = '\0';
+
+    for (i = 0; i < num; i++)
+    {
+        if (pos <= size)
+        {
+            pp_strs[i] = &p_buf[pos];
+            pos += strlen(&p_buf[pos]) + 1;
+        }
+        else
+        {
+            pp_strs[i] = "";
+        }
+    }
+    return p_buf;
+}
+
+/*
+ * Split a string at newlines into a vector on the heap, for the targets
+ * that take a vector. The strings point into p_str, which is modified.
+ */
+static char **fuzz_lines(char *p_str)
+{
+    char **pp_strv;
+    size_t num = 1;
+    size_t i;
+    char *p_pos;
+
+    for (p_pos = p_str; *p_pos != '\0'; p_pos++)
+        num += *p_pos == '\n';
+    pp_strv = (char**)calloc(num + 1, sizeof(char*));
+    if (pp_strv == NULL)
+        abort();
+    for (i = 0, p_pos = p_str; i < num; i++)
+    {
+        pp_strv[i] = p_pos;
+        p_pos += strcspn(p_pos, "\n");
+        if (*p_pos == '\n')
+            *p_pos++ = '\0';
+    }
+    return pp_strv;
+}
+
+/*
+ * uclear() must give back everything a target allocated.
+ */
+static void fuzz_clear(ustash *p_ustash)
+{
+    uclear(p_ustash);
+    fuzz_assert(p_ustash->p_list == NULL);
+    fuzz_assert(p_ustash->num_bytes == 0);
+}
+
+#ifndef USCH_FUZZ_LIBFUZZER
+static int fuzz_readfd(int fd, uint8_t **pp_data, size_t *p_size)
+{
+    uint8_t *p_data = NULL;
+    size_t size = 0;
+    size_t cap = 0;
+    ssize_t n;
+
+    for (;;)
+    {
+        if (size == cap)
+        {
+            uint8_t *p_new;
+            cap = cap ? cap * 2 : 4096;
+            p_new = (uint8_t*)realloc(p_data, cap);
+            if (p_new == NULL)
+            {
+                free(p_data);
+                return -1;
+            }
+            p_data = p_new;
+        }
+        n = read(fd, p_data + size, cap - size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+        {
+            free(p_data);
+            return -1;
+        }
+        if (n == 0)
+            break;
+        size += (size_t)n;
+    }
+    *pp_data = p_data;
+    *p_size = size;
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    uint8_t *p_data;
+    size_t size;
+    int i;
+
+    if (argc > 1)
+    {
+        for (i = 1; i < argc; i++)
+        {
+            int fd = open(argv[i], O_RDONLY | O_CLOEXEC);
+            if (fd < 0 || fuzz_readfd(fd, &p_data, &size) != 0)
+            {
+                fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+                return 1;
+            }
+            close(fd);
+            LLVMFuzzerTestOneInput(p_data, size);
+            free(p_data);
+        }
+        return 0;
+    }
+
+#ifdef __AFL_LOOP
+    while (__AFL_LOOP(10000))
+#endif
+    {
+        if (fuzz_readfd(STDIN_FILENO, &p_data, &size) != 0)
+        {
+            perror("stdin");
+            return 1;
+        }
+        LLVMFuzzerTestOneInput(p_data, size);
+        free(p_data);
+    }
+    return 0;
+}
+#endif // USCH_FUZZ_LIBFUZZER
+
+#endif // USCH_FUZZ_H
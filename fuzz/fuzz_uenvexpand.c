@@ -0,0 +1,105 @@
+/*
+ * uenvexpand(), which runs priv_usch_envexpand(): input is
+ * "name\0value\0string". FUZZ_<name> is set for the expansion, so the
+ * environment snapshot is rebuilt as the fuzzer changes it.
+ */
+#include "fuzz.h"
+
+/*
+ * Expand one character at a time with getenv().
+ */
+static char *fuzz_expand(const char *p_str)
+{
+    size_t cap = strlen(p_str) + 1;
+    size_t out_len = 0;
+    char *p_out = (char*)malloc(cap);
+
+    while (p_out != NULL && *p_str != '\0')
+    {
+        const char *p_add = p_str;
+        size_t add_len = 1;
+        size_t skip = 1;
+
+        if (p_str[0] == '\\' && p_str[1] == '$')
+        {
+            p_add = "$";
+            skip = 2;
+        }
+        else if (p_str[0] == '$')
+        {
+            int braced = p_str[1] == '{';
+            const char *p_name = p_str + (braced ? 2 : 1);
+            size_t name_len = 0;
+
+            if (isalpha((unsigned char)p_name[0]) || p_name[0] == '_')
+            {
+                while (isalnum((unsigned char)p_name[name_len]) || p_name[name_len] == '_')
+                    name_len++;
+            }
+            if (name_len > 0 && (!braced || p_name[name_len] == '}'))
+            {
+                char *p_name_copy = strndup(p_name, name_len);
+                const char *p_value = p_name_copy ? getenv(p_name_copy) : NULL;
+                free(p_name_copy);
+                if (p_value != NULL)
+                {
+                    p_add = p_value;
+                    add_len = strlen(p_value);
+                    skip = (size_t)(p_name - p_str) + name_len + (braced ? 1 : 0);
+                }
+            }
+        }
+        if (out_len + add_len + 1 > cap)
+        {
+            char *p_new;
+            cap = 2 * (out_len + add_len + 1);
+            p_new = (char*)realloc(p_out, cap);
+            if (p_new == NULL)
+                free(p_out);
+            p_out = p_new;
+            if (p_out == NULL)
+                break;
+        }
+        memcpy(&p_out[out_len], p_add, add_len);
+        out_len += add_len;
+        p_str += skip;
+    }
+    if (p_out == NULL)
+        abort();
+    p_out[out_len] = '\0';
+    return p_out;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *p_data, size_t size)
+{
+    ustash s = {0};
+    const char *pp_in[3];
+    char *p_buf = fuzz_strings(p_data, size, pp_in, 3);
+    char *p_name;
+    USCH_BOOL was_set;
+    char *p_expanded;
+    char *p_expected;
+
+    // the input may have unset them last time
+    uenvset("FUZZ_A", "a");
+    uenvset("FUZZ_EMPTY", "");
+    uenvset("FUZZ_DOLLAR", "$FUZZ_A\\$");
+
+    // leave PATH and friends alone
+    p_name = ustrjoin(&s, "FUZZ_", pp_in[0]);
+    was_set = uenvset(p_name, pp_in[1]) == 0;
+    p_expanded = uenvexpand(&s, pp_in[2]);
+    p_expected = fuzz_expand(pp_in[2]);
+    fuzz_assert(ustreq(p_expanded, p_expected));
+    free(p_expected);
+    if (was_set)
+    {
+        fuzz_assert(ustreq(uenvget(p_name), pp_in[1]));
+        uenvunset(p_name);
+        fuzz_assert(uenvget(p_name) == NULL);
+    }
+
+    fuzz_clear(&s);
+    free(p_buf);
+    return 0;
+}
@@ -0,0 +1,109 @@
+/*
+ * ufields(), ufieldat() and ucut(): input is "flags\0delimiters\0text",
+ * the low bits of the first byte are the UFIELDS_* flags.
+ */
+#include "fuzz.h"
+
+/*
+ * Check the rows of a table made without flags against splitting each
+ * line at every delimiter.
+ */
+static void fuzz_check_plain(const ufieldtab *p_tab, const char *p_in, const char *p_delims)
+{
+    const char *p_line = p_in;
+    size_t row = 0;
+
+    while (*p_line != '\0')
+    {
+        size_t line_len = strcspn(p_line, "\n");
+        const char *p_field = p_line;
+        size_t col = 0;
+
+        if (p_line[line_len] == '\n' && (line_len == 0 || (line_len == 1 && p_line[0] == '\r')))
+        {
+            fuzz_assert(ufieldat(p_tab, row, 0).p_str == NULL);
+        }
+        else
+        {
+            for (;;)
+            {
+                size_t len = strcspn(p_field, p_delims);
+                ufield field = ufieldat(p_tab, row, col);
+
+                if (p_field + len > p_line + line_len)
+                    len = (size_t)(p_line + line_len - p_field);
+                fuzz_assert(field.p_str == p_field);
+                if (p_field + len == p_line + line_len && len > 0 && p_field[len - 1] == '\r')
+                    len--;
+                fuzz_assert(field.len == len);
+                col++;
+                p_field += strcspn(p_field, p_delims);
+                if (p_field >= p_line + line_len)
+                    break;
+                p_field++;
+            }
+            fuzz_assert(ufieldat(p_tab, row, col).p_str == NULL);
+        }
+        row++;
+        p_line += line_len;
+        if (*p_line == '\n')
+            p_line++;
+    }
+    fuzz_assert(row == p_tab->num_rows);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *p_data, size_t size)
+{
+    ustash s = {0};
+    const char *pp_in[3];
+    char *p_buf = fuzz_strings(p_data, size, pp_in, 3);
+    const char *p_end = pp_in[2] + strlen(pp_in[2]);
+    int flags = (unsigned char)pp_in[0][0] & (UFIELDS_COLLAPSE | UFIELDS_QUOTED);
+    ufieldtab *p_tab;
+    size_t row;
+    size_t col;
+
+    p_tab = ufields(&s, pp_in[2], pp_in[1], flags);
+    fuzz_assert(p_tab != NULL);
+    fuzz_assert(p_tab->p_row_start[0] == 0);
+
+    for (row = 0; row < p_tab->num_rows; row++)
+    {
+        size_t num = p_tab->p_row_start[row + 1] - p_tab->p_row_start[row];
+        fuzz_assert(p_tab->p_row_start[row + 1] >= p_tab->p_row_start[row]);
+        fuzz_assert(num <= p_tab->num_cols);
+        for (col = 0; col < num; col++)
+        {
+            ufield field = ufieldat(p_tab, row, col);
+            fuzz_assert(field.p_str >= pp_in[2] && field.p_str + field.len <= p_end);
+            if (!(flags & UFIELDS_QUOTED))
+            {
+                fuzz_assert(memchr(field.p_str, '\n', field.len) == NULL);
+                fuzz_assert(strcspn(field.p_str, pp_in[1]) >= field.len);
+            }
+        }
+        fuzz_assert(ufieldat(p_tab, row, num).p_str == NULL);
+    }
+    fuzz_assert(ufieldat(p_tab, p_tab->num_rows, 0).p_str == NULL);
+
+    if (flags == 0 && strpbrk(pp_in[1], "\r\n") == NULL)
+        fuzz_check_plain(p_tab, pp_in[2], pp_in[1]);
+
+    // ucut() copies the same fields, one string per row
+    for (col = 0; col <= p_tab->num_cols; col++)
+    {
+        char **pp_col = ucut(&s, p_tab, col);
+        for (row = 0; row < p_tab->num_rows; row++)
+        {
+            ufield field = ufieldat(p_tab, row, col);
+            fuzz_assert(pp_col[row] != NULL);
+            fuzz_assert(strlen(pp_col[row]) == field.len);
+            fuzz_assert(field.len == 0 || memcmp(pp_col[row], field.p_str, field.len) == 0);
+        }
+        fuzz_assert(pp_col[row] == NULL);
+    }
+
+    fuzz_clear(&s);
+    free(p_buf);
+    return 0;
+}
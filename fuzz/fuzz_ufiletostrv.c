@@ -0,0 +1,52 @@
+/*
+ * ufiletostrv() and fixed string ugrepfile(), on a memfd: input is
+ * "pattern\0text".
+ */
+#include "fuzz.h"
+
+#include <sys/mman.h>
+
+int LLVMFuzzerTestOneInput(const uint8_t *p_data, size_t size)
+{
+    ustash s = {0};
+    const char *pp_in[2];
+    char *p_buf = fuzz_strings(p_data, size, pp_in, 2);
+    size_t len = strlen(pp_in[1]);
+    char *p_text = strdup(pp_in[1]);
+    char path[64];
+    char **pp_lines;
+    char **pp_strv;
+    char **pp_grep;
+    size_t i;
+    int fd;
+
+    fd = memfd_create("fuzz", MFD_CLOEXEC);
+    if (fd < 0 || p_text == NULL || write(fd, pp_in[1], len) != (ssize_t)len)
+        abort();
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+
+    // no empty last line for a newline at the end, and none in an empty file
+    if (len > 0 && p_text[len - 1] == '\n')
+        p_text[len - 1] = '\0';
+    pp_lines = len > 0 ? fuzz_lines(p_text) : (char**)calloc(1, sizeof(char*));
+    if (pp_lines == NULL)
+        abort();
+
+    pp_strv = ufiletostrv(&s, path, "\n");
+    for (i = 0; pp_lines[i] != NULL; i++)
+        fuzz_assert(ustreq(pp_strv[i], pp_lines[i]));
+    fuzz_assert(pp_strv[i] == NULL);
+
+    pp_grep = ugrepfile(&s, path, pp_in[0], UGREP_FIXED);
+    pp_strv = ugrep(&s, pp_strv, pp_in[0], UGREP_FIXED);
+    for (i = 0; pp_strv[i] != NULL; i++)
+        fuzz_assert(ustreq(pp_grep[i], pp_strv[i]));
+    fuzz_assert(pp_grep[i] == NULL);
+
+    fuzz_clear(&s);
+    close(fd);
+    free(pp_lines);
+    free(p_text);
+    free(p_buf);
+    return 0;
+}
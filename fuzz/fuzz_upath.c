@@ -0,0 +1,83 @@
+/*
+ * upathnorm(), udirname(), ubasename(), uext(), upathjoin() and their
+ * vector versions: input is "path\0path".
+ */
+#include "fuzz.h"
+
+/*
+ * A normalized path has no empty or "." components, and ".." only at
+ * the start of a relative path.
+ */
+static void fuzz_check_norm(const char *p_path)
+{
+    const char *p_pos = p_path;
+    USCH_BOOL leading = USCH_TRUE;
+
+    fuzz_assert(p_path[0] != '\0');
+    if (ustreq(p_path, ".") || ustreq(p_path, "/"))
+        return;
+    if (p_pos[0] == '/')
+        p_pos++;
+    for (;;)
+    {
+        size_t len = strcspn(p_pos, "/");
+
+        fuzz_assert(len > 0);
+        fuzz_assert(!(len == 1 && p_pos[0] == '.'));
+        if (len == 2 && p_pos[0] == '.' && p_pos[1] == '.')
+            fuzz_assert(leading && p_path[0] != '/');
+        else
+            leading = USCH_FALSE;
+        if (p_pos[len] == '\0')
+            break;
+        p_pos += len + 1;
+    }
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *p_data, size_t size)
+{
+    ustash s = {0};
+    const char *pp_in[2];
+    char *p_buf = fuzz_strings(p_data, size, pp_in, 2);
+    char *pp_paths[3] = {(char*)pp_in[0], (char*)pp_in[1], NULL};
+    char **pp_norm = upathnormv(&s, pp_paths);
+    char **pp_dir = udirnamev(&s, pp_paths);
+    char **pp_base = ubasenamev(&s, pp_paths);
+    int i;
+
+    for (i = 0; i < 2; i++)
+    {
+        const char *p_path = pp_in[i];
+        char *p_norm = upathnorm(&s, p_path);
+        char *p_dir = udirname(&s, p_path);
+        char *p_base = ubasename(&s, p_path);
+        const char *p_ext = uext(p_path);
+
+        fuzz_check_norm(p_norm);
+        fuzz_assert(upathnorm(&s, p_norm) == p_norm);
+        fuzz_assert(ustreq(pp_norm[i], p_norm));
+        fuzz_assert(ustreq(pp_dir[i], p_dir));
+        fuzz_assert(ustreq(pp_base[i], p_base));
+
+        fuzz_assert(p_ext >= p_path && p_ext <= p_path + strlen(p_path));
+        fuzz_assert(p_ext[0] == '\0' || (p_ext[0] == '.' && strchr(p_ext, '/') == NULL));
+        fuzz_assert(strchr(p_base, '/') == NULL || ustreq(p_base, "/"));
+
+        // the directory and the base name make the path again
+        if (p_path[0] != '\0')
+        {
+            fuzz_assert(ustreq(upathnorm(&s, upathjoin(&s, p_dir, p_base)), p_norm));
+        }
+    }
+    fuzz_assert(pp_norm[2] == NULL && pp_dir[2] == NULL && pp_base[2] == NULL);
+
+    if (pp_in[0][0] != '\0' && pp_in[1][0] != '\0')
+    {
+        char *p_joined = upathjoin(&s, pp_in[0], pp_in[1]);
+        fuzz_assert(ustreq(upathnorm(&s, p_joined), upathnorm(&s, ustrjoin(&s, pp_in[0], "/", pp_in[1]))));
+    }
+
+    fuzz_clear(&s);
+    free(p_buf);
+    return 0;
+}
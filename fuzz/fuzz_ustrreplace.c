@@ -0,0 +1,64 @@
+/*
+ * ustrreplace() and ustrjoin(): input is "string\0old\0new".
+ */
+#include "fuzz.h"
+
+/*
+ * Straightforward replace, one strncmp() per position.
+ */
+static char *fuzz_replace(const char *p_str, const char *p_old, const char *p_new)
+{
+    size_t old_len = strlen(p_old);
+    size_t new_len = strlen(p_new);
+    size_t max_len = strlen(p_str) * (new_len > old_len ? new_len : 1) + 1;
+    char *p_out = (char*)malloc(max_len);
+    size_t out_len = 0;
+
+    if (p_out == NULL)
+        abort();
+    while (*p_str != '\0')
+    {
+        if (strncmp(p_str, p_old, old_len) == 0)
+        {
+            memcpy(&p_out[out_len], p_new, new_len);
+            out_len += new_len;
+            p_str += old_len;
+        }
+        else
+        {
+            p_out[out_len++] = *p_str++;
+        }
+    }
+    p_out[out_len] = '\0';
+    return p_out;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *p_data, size_t size)
+{
+    ustash s = {0};
+    const char *pp_in[3];
+    char *p_buf = fuzz_strings(p_data, size, pp_in, 3);
+    char *p_replaced;
+    char *p_expected;
+
+    p_replaced = ustrreplace(&s, pp_in[0], pp_in[1], pp_in[2]);
+    fuzz_assert(p_replaced != NULL);
+    if (pp_in[1][0] == '\0')
+    {
+        fuzz_assert(p_replaced[0] == '\0');
+    }
+    else
+    {
+        p_expected = fuzz_replace(pp_in[0], pp_in[1], pp_in[2]);
+        fuzz_assert(ustreq(p_replaced, p_expected));
+        free(p_expected);
+    }
+
+    p_replaced = ustrjoin(&s, pp_in[0], pp_in[1], pp_in[2]);
+    fuzz_assert(strlen(p_replaced) == strlen(pp_in[0]) + strlen(pp_in[1]) + strlen(pp_in[2]));
+    fuzz_assert(strncmp(p_replaced, pp_in[0], strlen(pp_in[0])) == 0);
+
+    fuzz_clear(&s);
+    free(p_buf);
+    return 0;
+}
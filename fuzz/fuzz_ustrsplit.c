@@ -0,0 +1,37 @@
+/*
+ * ustrsplit(): input is "string\0delimiters".
+ */
+#include "fuzz.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *p_data, size_t size)
+{
+    ustash s = {0};
+    const char *pp_in[2];
+    char *p_buf = fuzz_strings(p_data, size, pp_in, 2);
+    const char *p_pos = pp_in[0];
+    char **pp_out;
+    size_t i;
+
+    pp_out = ustrsplit(&s, pp_in[0], pp_in[1]);
+    fuzz_assert(pp_out != NULL);
+
+    // the pieces and the delimiters between them give back the input
+    for (i = 0; pp_out[i] != NULL; i++)
+    {
+        size_t len = strlen(pp_out[i]);
+        fuzz_assert(strncmp(p_pos, pp_out[i], len) == 0);
+        fuzz_assert(strcspn(pp_out[i], pp_in[1]) == len);
+        p_pos += len;
+        if (pp_out[i + 1] != NULL)
+        {
+            fuzz_assert(*p_pos != '\0' && strchr(pp_in[1], *p_pos) != NULL);
+            p_pos++;
+        }
+    }
+    fuzz_assert(i > 0);
+    fuzz_assert(*p_pos == '\0');
+
+    fuzz_clear(&s);
+    free(p_buf);
+    return 0;
+}
@@ -0,0 +1,28 @@
+/*
+ * ustrtrim(): input is the string to trim.
+ */
+#include "fuzz.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *p_data, size_t size)
+{
+    ustash s = {0};
+    const char *p_in;
+    char *p_buf = fuzz_strings(p_data, size, &p_in, 1);
+    size_t start = strspn(p_in, " ");
+    size_t len = strlen(p_in);
+    char *p_trim;
+
+    while (len > start && p_in[len - 1] == ' ')
+        len--;
+
+    p_trim = ustrtrim(&s, p_in);
+    fuzz_assert(p_trim != NULL);
+    fuzz_assert(strlen(p_trim) == len - start);
+    fuzz_assert(memcmp(p_trim, &p_in[start], len - start) == 0);
+    // trimming twice changes nothing
+    fuzz_assert(ustreq(ustrtrim(&s, p_trim), p_trim));
+
+    fuzz_clear(&s);
+    free(p_buf);
+    return 0;
+}
@@ -0,0 +1,121 @@
+/*
+ * usort(), uuniq(), ustrvdedup(), ustrvdiff(), ustrvisect(), ustrset
+ * and fixed string ugrep(): input is "lines\0lines\0pattern".
+ */
+#include "fuzz.h"
+
+static int fuzz_strcmp(const void *p_a, const void *p_b)
+{
+    return strcmp(*(char* const*)p_a, *(char* const*)p_b);
+}
+
+static USCH_BOOL fuzz_contains(char **pp_strv, const char *p_str)
+{
+    size_t i;
+
+    for (i = 0; pp_strv[i] != NULL; i++)
+    {
+        if (ustreq(pp_strv[i], p_str))
+            return USCH_TRUE;
+    }
+    return USCH_FALSE;
+}
+
+static size_t fuzz_len(char **pp_strv)
+{
+    size_t num = 0;
+
+    while (pp_strv[num] != NULL)
+        num++;
+    return num;
+}
+
+/*
+ * pp_out must be the strings of pp_in selected by keep(), in order.
+ */
+#define fuzz_check_filter(pp_out, pp_in, keep) \
+    do { \
+        size_t k_ = 0, j_; \
+        for (j_ = 0; (pp_in)[j_] != NULL; j_++) \
+        { \
+            const char *p_str = (pp_in)[j_]; \
+            if (keep) \
+                fuzz_assert((pp_out)[k_++] == p_str); \
+        } \
+        fuzz_assert((pp_out)[k_] == NULL); \
+    } while (0)
+
+int LLVMFuzzerTestOneInput(const uint8_t *p_data, size_t size)
+{
+    ustash s = {0};
+    const char *pp_in[3];
+    char *p_buf = fuzz_strings(p_data, size, pp_in, 3);
+    char *p_a = strdup(pp_in[0]);
+    char *p_b = strdup(pp_in[1]);
+    char **pp_a;
+    char **pp_b;
+    char **pp_sorted;
+    char **pp_out;
+    ustrset *p_set;
+    size_t num;
+    size_t i;
+
+    if (p_a == NULL || p_b == NULL)
+        abort();
+    pp_a = fuzz_lines(p_a);
+    pp_b = fuzz_lines(p_b);
+    num = fuzz_len(pp_a);
+
+    pp_out = ustrvdedup(&s, pp_a);
+    {
+        size_t k = 0;
+        for (i = 0; i < num; i++)
+        {
+            size_t j;
+            for (j = 0; j < i && !ustreq(pp_a[j], pp_a[i]); j++)
+                ;
+            if (j == i)
+                fuzz_assert(pp_out[k++] == pp_a[i]);
+        }
+        fuzz_assert(pp_out[k] == NULL);
+    }
+    pp_out = ustrvdiff(&s, pp_a, pp_b);
+    fuzz_check_filter(pp_out, pp_a, !fuzz_contains(pp_b, p_str));
+    pp_out = ustrvisect(&s, pp_a, pp_b);
+    fuzz_check_filter(pp_out, pp_a, fuzz_contains(pp_b, p_str));
+    pp_out = ugrep(&s, pp_a, pp_in[2], UGREP_FIXED);
+    fuzz_check_filter(pp_out, pp_a, strstr(p_str, pp_in[2]) != NULL);
+    pp_out = ugrep(&s, pp_a, pp_in[2], UGREP_FIXED | UGREP_INVERT);
+    fuzz_check_filter(pp_out, pp_a, strstr(p_str, pp_in[2]) == NULL);
+
+    p_set = ustrsetv(&s, pp_b);
+    fuzz_assert(p_set != NULL);
+    for (i = 0; i < num; i++)
+        fuzz_assert(ustrsethas(p_set, pp_a[i]) == fuzz_contains(pp_b, pp_a[i]));
+    fuzz_assert(ustrsetsize(p_set) == fuzz_len(ustrvdedup(&s, pp_b)));
+
+    // usort() must agree with qsort() on the same strings
+    pp_sorted = (char**)calloc(num + 1, sizeof(char*));
+    if (pp_sorted == NULL)
+        abort();
+    memcpy(pp_sorted, pp_a, num * sizeof(char*));
+    qsort(pp_sorted, num, sizeof(char*), fuzz_strcmp);
+    fuzz_assert(usort(pp_a) == pp_a);
+    for (i = 0; i < num; i++)
+        fuzz_assert(ustreq(pp_a[i], pp_sorted[i]));
+    fuzz_assert(pp_a[num] == NULL);
+
+    uuniq(pp_a);
+    for (i = 0; pp_a[i] != NULL; i++)
+        fuzz_assert(i == 0 || strcmp(pp_a[i - 1], pp_a[i]) < 0);
+    fuzz_assert(i == fuzz_len(ustrvdedup(&s, pp_sorted)));
+
+    fuzz_clear(&s);
+    free(pp_sorted);
+    free(pp_a);
+    free(pp_b);
+    free(p_a);
+    free(p_b);
+    free(p_buf);
+    return 0;
+}
@@ -0,0 +1,246 @@
+/*
+ * stress_pipeline.c - run pipelines from many threads and look for leaks
+ *
+ *   ./stress_pipeline [threads [rounds]]
+ *
+ * Every thread runs a mix of pipelines: plain, with empty stages, failing
+ * to start, killed at a timeout, and ujobstartio() jobs drained by poll().
+ * This runs once forking from the threads and once through the fork
+ * server. After each run:
+ *
+ *  - /proc/self/fd must list the same descriptors as before,
+ *  - waitpid(-1, WNOHANG) must find no child at all, neither a zombie nor
+ *    a command still running. This process is a child subreaper, so the
+ *    orphaned commands of the fork server count as well,
+ *  - num_bytes of every ustash must be 0 after uclear().
+ *
+ * Exits with 1 and a message for each problem found.
+ */
+#define USCH_IMPLEMENTATION
+#include "../usch.h"
+
+#include <sys/prctl.h>
+
+struct stress_thread
+{
+    pthread_t thread;
+    int rounds;
+    int failures;
+};
+
+static ustash stress_shared;
+
+#define stress_check(p_thread, cond) \
+    do { \
+        if (!(cond)) \
+        { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            (p_thread)->failures++; \
+        } \
+    } while (0)
+
+static int stress_numfds(void)
+{
+    struct dirent *p_entry;
+    DIR *p_dir = opendir("/proc/self/fd");
+    int num = 0;
+
+    if (p_dir == NULL)
+        return -1;
+    while ((p_entry = readdir(p_dir)) != NULL)
+        num += p_entry->d_name[0] != '.';
+    closedir(p_dir);
+    // the descriptor of p_dir itself
+    return num - 1;
+}
+
+/*
+ * Drain a ujobstartio() job with poll() like an event loop would.
+ * Returns the number of bytes read from its standard output.
+ */
+static size_t stress_drain(ustash *p_ustash, ujob *p_job, int *p_status)
+{
+    size_t total = 0;
+    int finished = 0;
+
+    for (;;)
+    {
+        struct pollfd fds[3];
+        int num_fds = 0;
+        int which;
+        int i;
+
+        for (which = UJOB_STDOUT; which <= UJOB_STDERR; which++)
+        {
+            if (ujobfd(p_job, which) >= 0)
+            {
+                fds[num_fds].fd = ujobfd(p_job, which);
+                fds[num_fds].events = POLLIN;
+                num_fds++;
+            }
+        }
+        if (!finished && ujobpidfd(p_job) >= 0)
+        {
+            fds[num_fds].fd = ujobpidfd(p_job);
+            fds[num_fds].events = POLLIN;
+            num_fds++;
+        }
+        if (num_fds == 0)
+            break;
+        if (poll(fds, (nfds_t)num_fds, ujobdeadline(p_job)) < 0 && errno != EINTR)
+            break;
+
+        for (i = 0; i < num_fds; i++)
+        {
+            size_t len = 0;
+            if (!(fds[i].revents & (POLLIN | POLLHUP)))
+                continue;
+            if (fds[i].fd == ujobfd(p_job, UJOB_STDOUT))
+            {
+                if (ujobread(p_ustash, p_job, UJOB_STDOUT, &len) != NULL)
+                    total += len;
+            }
+            else if (fds[i].fd == ujobfd(p_job, UJOB_STDERR))
+            {
+                ujobread(p_ustash, p_job, UJOB_STDERR, NULL);
+            }
+        }
+        if (!finished)
+            finished = ujobtrywait(p_job, p_status) != 0;
+    }
+    *p_status = ujobwait(p_job);
+    return total;
+}
+
+static void *stress_run(void *p_arg)
+{
+    struct stress_thread *p_thread = (struct stress_thread*)p_arg;
+    ucmdopts timeout = {0};
+    ustash s = {0};
+    int round;
+
+    timeout.timeout_ms = 20;
+    timeout.kill_grace_ms = 20;
+
+    for (round = 0; round < p_thread->rounds; round++)
+    {
+        ujob *p_job;
+        char *p_out;
+        int status = 0;
+
+        p_out = ustrout(&s, "printf", "a\\nb\\nc\\n", "|", "sort", "-r", "|", "head", "-n", "1");
+        stress_check(p_thread, strncmp(p_out, "c", 1) == 0);
+        stress_check(p_thread, ucmd("true", "|", "false") == 1);
+        ucmd("true", "|", "|", "true");
+        ucmd("|");
+        // once per thread, each one prints an error
+        if (round == 0)
+            stress_check(p_thread, ucmd("true", "|", "stress-pipeline-no-such-command") != 0);
+
+        errno = 0;
+        stress_check(p_thread, ucmdopt(&timeout, "sleep", "5", "|", "cat") == -1 && errno == ETIMEDOUT);
+
+        p_job = ujobstartio(&s, NULL, "yes", "|", "head", "-c", "100000");
+        stress_check(p_thread, p_job != NULL);
+        if (p_job != NULL)
+        {
+            stress_check(p_thread, stress_drain(&s, p_job, &status) == 100000);
+            stress_check(p_thread, status == 0);
+        }
+
+        p_job = ujobstartio(&s, &timeout, "sleep", "5", "|", "cat");
+        stress_check(p_thread, p_job != NULL);
+        if (p_job != NULL)
+        {
+            stress_drain(&s, p_job, &status);
+            stress_check(p_thread, status == -1);
+        }
+
+        ustrfmt(&stress_shared, "%d", round);
+        uclear(&s);
+        stress_check(p_thread, s.num_bytes == 0);
+    }
+    return NULL;
+}
+
+/*
+ * Run the threads and report what they left behind.
+ */
+static int stress_phase(const char *p_name, int num_threads, int rounds, int base_fds)
+{
+    struct stress_thread *p_threads = (struct stress_thread*)calloc((size_t)num_threads, sizeof(*p_threads));
+    int failures = 0;
+    int status;
+    pid_t pid;
+    int i;
+
+    if (p_threads == NULL)
+        return 1;
+    for (i = 0; i < num_threads; i++)
+    {
+        p_threads[i].rounds = rounds;
+        if (pthread_create(&p_threads[i].thread, NULL, stress_run, &p_threads[i]) != 0)
+        {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (i = 0; i < num_threads; i++)
+    {
+        pthread_join(p_threads[i].thread, NULL);
+        failures += p_threads[i].failures;
+    }
+    free(p_threads);
+
+    uforkserverstop();
+    uclear(&stress_shared);
+    if (stress_shared.num_bytes != 0)
+    {
+        fprintf(stderr, "%s: %zu bytes left in the shared ustash\n", p_name, stress_shared.num_bytes);
+        failures++;
+    }
+    if (stress_numfds() != base_fds)
+    {
+        fprintf(stderr, "%s: %d descriptors open, %d before\n", p_name, stress_numfds(), base_fds);
+        ucmd("ls", "-l", ustrfmt(&stress_shared, "/proc/%d/fd/", (int)getpid()));
+        uclear(&stress_shared);
+        failures++;
+    }
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+    {
+        fprintf(stderr, "%s: reaped a zombie, pid %d\n", p_name, (int)pid);
+        failures++;
+    }
+    if (pid == 0)
+    {
+        fprintf(stderr, "%s: commands are still running\n", p_name);
+        ucmd("ps", "-o", "pid,ppid,stat,args", "--ppid", ustrfmt(&stress_shared, "%d", (int)getpid()));
+        uclear(&stress_shared);
+        failures++;
+    }
+    printf("%s: %d threads, %d rounds, %d failures\n", p_name, num_threads, rounds, failures);
+    return failures;
+}
+
+int main(int argc, char **argv)
+{
+    int num_threads = argc > 1 ? atoi(argv[1]) : 8;
+    int rounds = argc > 2 ? atoi(argv[2]) : 50;
+    int base_fds;
+    int failures = 0;
+
+    // adopt the commands orphaned by a dying fork server
+    if (prctl(PR_SET_CHILD_SUBREAPER, 1) != 0)
+        perror("prctl");
+    base_fds = stress_numfds();
+
+    failures += stress_phase("fork", num_threads, rounds, base_fds);
+    if (uforkserver() != 0)
+    {
+        fprintf(stderr, "uforkserver failed\n");
+        return 1;
+    }
+    failures += stress_phase("forkserver", num_threads, rounds, base_fds);
+
+    return failures > 0 ? 1 : 0;
+}
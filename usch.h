@@ -29,16 +29,79 @@ extern "C" {
 }
 #endif // NEED_VIM_WORKAROUND
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE   // for splice, copy_file_range
+#endif // __linux__
+
+/*
+ * By default every function is static inline, so a program only needs to
+ * include usch.h. Programs built from many files can instead compile the
+ * functions once:
+ *
+ *   #define USCH_IMPLEMENTATION     in exactly one .c file, before the include
+ *   #define USCH_DECLARATIONS_ONLY  in all other .c files, before the include
+ *
+ * In that mode usch.h is only declarations for all but one file, which
+ * makes it cheap to parse and to precompile, and static state like the
+ * fork server is shared by the whole program. Only the public functions
+ * and the priv_*_impl functions behind the macros are exported.
+ */
+#if defined(USCH_IMPLEMENTATION)
+#define USCH_API
+#elif defined(USCH_DECLARATIONS_ONLY)
+#define USCH_API extern
+#else
+#define USCH_API static inline
+#endif // USCH_IMPLEMENTATION
+
+/*
+ * Helpers that no public macro expands to are USCH_PRIV, so that they stay
+ * private to the file holding the definitions.
+ */
+#if defined(USCH_IMPLEMENTATION)
+#define USCH_PRIV static
+#else
+#define USCH_PRIV static inline
+#endif // USCH_IMPLEMENTATION
+
+#include <ctype.h>    // for tolower, toupper
+#include <dirent.h>   // for DT_DIR, DT_REG, fdopendir, etc
+#include <errno.h>    // for errno, EINTR, EINVAL, etc
+#include <fcntl.h>    // for splice, SPLICE_F_MOVE, etc
 #include <glob.h>     // for glob_t, glob, globfree, etc
+#include <poll.h>     // for poll, POLLIN
+#include <pthread.h>  // for pthread_mutex_t, pthread_mutex_lock, etc
+#include <regex.h>    // for regcomp, regexec, regfree
+#include <sched.h>    // for unshare, CLONE_FS
+#include <signal.h>   // for sigaction, SIGINT, SIGQUIT, etc
+#include <stdarg.h>   // for va_list, va_start, va_end
 #include <stddef.h>   // for size_t
+#include <stdint.h>   // for uint64_t
 #include <stdio.h>    // for NULL, fprintf, stderr, etc
 #include <stdlib.h>   // for calloc, free, malloc, etc
 #include <string.h>   // for strlen, memcpy, strcmp, etc
+#include <sys/mman.h> // for mmap, munmap
+#include <sys/resource.h> // for setrlimit, RLIMIT_AS, RLIMIT_CPU
+#include <sys/socket.h> // for socketpair, sendmsg, SCM_RIGHTS, etc
 #include <sys/stat.h> // for stat
+#include <sys/syscall.h> // for SYS_pidfd_open
+#include <sys/uio.h>  // for writev, struct iovec
 #include <sys/wait.h> // for WCONTINUED, WIFCONTINUED, etc
+#include <time.h>     // for clock_gettime, CLOCK_MONOTONIC
 #include <unistd.h>   // for dup2, close, chdir, etc
 #include <limits.h>
 
+#if defined(__linux__) && defined(SPLICE_F_MOVE)
+#define USCH_HAVE_SPLICE 1
+#endif // __linux__ && SPLICE_F_MOVE
+#if defined(__linux__) && defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27)) && defined(_GNU_SOURCE)
+#define USCH_HAVE_COPY_FILE_RANGE 1
+#endif // __GLIBC__ >= 2.27
+
+#if defined(__linux__)
+#include <malloc.h>   // for malloc_usable_size
+#define USCH_HAVE_MALLOC_USABLE_SIZE 1
+#endif // __linux__
 
 /**************************** public declarations ***************************/
 
@@ -53,10 +116,29 @@ struct priv_usch_stash_item;
  *  Returned allocated memory by usch functions should not be explicitly free'd.
  *
  *  Instead the uclear() function should be called.
+ *
+ *  Thread safety: usch functions lock what little static state they keep
+ *  and may be called from any number of threads. Either give each thread its own
+ *  ustash, or share one; allocations are pushed to a shared ustash
+ *  without locking. uclear() detaches the list atomically, but the
+ *  caller must make sure no thread still uses memory from the stash.
+ *
+ *  Accounting: num_bytes is the size of the allocations currently held,
+ *  as sized by malloc (0 where that is unknown).
+ *  num_bytes only grows between uclear() calls, max_bytes is the largest
+ *  num_bytes any uclear() has freed. The high-water mark is the larger
+ *  of the two. They are read only, see also ustashreport().
+ *
+ *  Debugging: define USCH_DEBUG_STASH before including usch.h to also
+ *  record the usch function behind every allocation, and to get a report
+ *  on stderr at exit of the allocations no uclear() has freed. With more
+ *  than one file, define it everywhere and use USCH_IMPLEMENTATION.
  *   */
 typedef struct ustash
 {
     struct priv_usch_stash_item *p_list;
+    size_t num_bytes;
+    size_t max_bytes;
 } ustash;
 
 typedef enum
@@ -86,7 +168,48 @@ typedef enum
  *   
  * @param Pointer to an ustash (preferably on the stack)
  */
-static inline void uclear(ustash *p_ustash);
+USCH_API void uclear(ustash *p_ustash);
+
+/**
+ * @brief print the memory accounting of a stash
+ *
+ * Print the live allocations, live bytes and high-water mark of the
+ * stash. The allocations are counted by walking the stash. With USCH_DEBUG_STASH the live bytes are also broken down by
+ * the usch function that allocated them, largest first.
+ * Must not be called while another thread calls uclear() on the stash.
+ *
+ * @param p_ustash stash to report on.
+ * @param p_file where to print, e.g. stderr.
+ */
+USCH_API void ustashreport(const ustash *p_ustash, FILE *p_file);
+
+/**
+ * @brief Per-call options for ucmdopt() and ustroutopt()
+ *
+ * Zero initialize and set the fields that are needed.
+ */
+typedef struct ucmdopts
+{
+    /** working directory of the command, NULL to inherit the current one */
+    const char *p_cwd;
+    /**
+     * Kill the pipe-sequence if it has not finished after timeout_ms
+     * milliseconds, 0 to wait forever. When set, all commands run in a
+     * new process group which first gets SIGTERM and kill_grace_ms later
+     * SIGKILL. The call then returns -1 with errno set to ETIMEDOUT.
+     * If the first command reads a terminal on the standard input of the
+     * caller, the commands stay in the caller's process group so that they
+     * can read it, and are signalled one by one; processes they started
+     * themselves are then not signalled.
+     */
+    long timeout_ms;
+    /** time between SIGTERM and SIGKILL, 0 for 1000 ms */
+    long kill_grace_ms;
+    /** RLIMIT_AS (address space) in bytes for each command, 0 to inherit */
+    unsigned long long rlimit_as;
+    /** RLIMIT_CPU (cpu time) in seconds for each command, 0 to inherit */
+    unsigned long long rlimit_cpu;
+} ucmdopts;
 
 /**
  * @brief splits a string
@@ -100,7 +223,7 @@ static inline void uclear(ustash *p_ustash);
  * @remarks returns 1 element NUL terminated vector upon error.
  * @remarks return value must not be freed.
  */
-static inline char **ustrsplit(ustash *p_ustash, const char* p_in, const char* p_delims);
+USCH_API char **ustrsplit(ustash *p_ustash, const char* p_in, const char* p_delims);
 
 /* @brief command stdout to buffer
  *
@@ -115,14 +238,18 @@ static inline char **ustrsplit(ustash *p_ustash, const char* p_in, const char* p
 
 /* @brief expand multiple strings with globbing to vector
  *
- * Perform globbing on 1-n string arguments.
+ * Perform globbing on 1-n string arguments, after replacing $NAME and
+ * ${NAME} like ucmd() does, see uenvexpand(): ustrexp(&s, "$HOME/src")
+ * gives the path in the home directory, ustrexp(&s, "\\$HOME") a literal
+ * "$HOME". Strings after a "--" string are returned as they are, without
+ * the "--".
  * Return strings as NULL terminated vector.
  *
  * @param  p_ustash pointer to ustash structure.
  * @param  arguments to perform globbing on 
  * @return pp_exp vector of expanded arguments. Never returns NULL.
  */
-static inline char **ustrexpv(ustash *p_ustash, const char **pp_strings);
+USCH_API char **ustrexpv(ustash *p_ustash, const char **pp_strings);
 #define ustrexp(p_stash, ...) priv_ustrexp_impl((p_stash), sizeof((const char*[]){NULL, ##__VA_ARGS__})/sizeof(const char*), (const char*[]){NULL, ##__VA_ARGS__})
 
 /* @brief Create a new string by concatenating 0-n strings
@@ -133,12 +260,88 @@ static inline char **ustrexpv(ustash *p_ustash, const char **pp_strings);
  * @param  arguments to join into one string
  * @return p_joinedstr a combined string. Returns empty string on error.
  */
-static inline char *ustrjoinv(ustash *p_ustash, const char **pp_strings);
+USCH_API char *ustrjoinv(ustash *p_ustash, const char **pp_strings);
 #define ustrjoin(p_stash, ...) priv_ustrjoin_impl((p_stash), sizeof((const char*[]){NULL, ##__VA_ARGS__})/sizeof(const char*), (const char*[]){NULL, ##__VA_ARGS__})
 
+/* @brief Create a new string with all occurrences of a substring replaced
+ *
+ * The size of the result is computed before copying, so the string is
+ * built in a single allocation.
+ *
+ * @param  p_ustash pointer to ustash structure.
+ * @param  p_str string to search.
+ * @param  p_old substring to replace, must not be empty.
+ * @param  p_new replacement.
+ * @return p_replaced new string. Returns empty string on error.
+ */
+USCH_API char *ustrreplace(ustash *p_ustash, const char *p_str, const char *p_old, const char *p_new);
+
+/* @brief Create a new string from a printf format
+ *
+ * Format directly into a single stash allocation, e.g.
+ * ustrfmt(&s, "%s/%s.%d", p_dir, p_name, i).
+ *
+ * @param  p_ustash pointer to ustash structure.
+ * @param  p_fmt printf format.
+ * @param  arguments for the format.
+ * @return p_formatted new string. Returns empty string on error.
+ */
+#if defined(__GNUC__)
+__attribute__((format(printf, 2, 3)))
+#endif
+USCH_API char *ustrfmt(ustash *p_ustash, const char *p_fmt, ...);
+
+/* @brief Create a new string from a printf format and a va_list
+ *
+ * Like ustrfmt(), for use in variadic functions.
+ *
+ * @param  p_ustash pointer to ustash structure.
+ * @param  p_fmt printf format.
+ * @param  args arguments for the format.
+ * @return p_formatted new string. Returns empty string on error.
+ */
+USCH_API char *ustrvfmt(ustash *p_ustash, const char *p_fmt, va_list args);
+
+/* @brief Create a new string without leading and trailing spaces
+ *
+ * @param  p_ustash pointer to ustash structure.
+ * @param  p_str string to trim.
+ * @return p_trim new string. Returns empty string on error.
+ */
+USCH_API char *ustrtrim(ustash *p_ustash, const char *p_str);
+
+/* @brief read a file into a vector of strings
+ *
+ * Read the whole file and split it at any of the delimiting characters,
+ * e.g. "\n" for lines. A delimiter at the end of the file does not give
+ * an empty last string, and an empty file gives an empty vector.
+ *
+ * @param  p_ustash pointer to ustash structure.
+ * @param  p_filename file to read.
+ * @param  p_delims delimiting characters.
+ * @return NULL terminated vector. Never returns NULL.
+ */
+USCH_API char **ufiletostrv(ustash *p_ustash, const char *p_filename, char *p_delims);
+
+/* @brief write a vector of strings to a file
+ *
+ * Truncate the file and write each string followed by p_delim.
+ *
+ * @param  pp_strv NULL terminated vector.
+ * @param  p_filename file to write.
+ * @param  p_delim written after every string.
+ * @return 0 on success, -1 on error.
+ */
+USCH_API int ustrvtofile(const char **pp_strv, const char *p_filename, const char *p_delim);
+
 /* @brief run a command with 0-n arguments
  *
  * Run a command with 0-n arguments, expand globbing on arguments.
+ * $NAME and ${NAME} in arguments are replaced first, see uenvexpand():
+ * ucmd("sh", "-c", "echo \\$HOME") passes a literal "$HOME" to the shell.
+ * Arguments after a "--" argument are passed as they are, without the "--".
+ * "cd" is a builtin that changes the working directory of the calling
+ * thread, and of the threads it creates afterwards, but of no other thread.
  *
  * @param  p_cmd command to run.
  * @param  arguments 0-n arguments to the function.
@@ -146,976 +349,6694 @@ static inline char *ustrjoinv(ustash *p_ustash, const char **pp_strings);
  */
 #define ucmd(...) priv_ucmd_impl(sizeof((const char*[]){NULL, ##__VA_ARGS__})/sizeof(const char*), (const char*[]){NULL, ##__VA_ARGS__})
 
-/*** private APIs below, may change without notice  ***/
+/* @brief run a command with 0-n arguments and per-call options
+ *
+ * Like ucmd(), but applies p_opts to every command in the pipe-sequence.
+ * p_opts->p_cwd is entered by the child only, so unlike the "cd" builtin
+ * the working directory of the calling thread is left untouched.
+ *
+ * @param  p_opts pointer to ucmdopts, or NULL.
+ * @param  arguments 0-n arguments to the function.
+ * @return status 0-255 where 0 means success, or 1-255 specific command error.
+ */
+#define ucmdopt(p_opts, ...) priv_ucmdopt_impl((p_opts), sizeof((const char*[]){NULL, ##__VA_ARGS__})/sizeof(const char*), (const char*[]){NULL, ##__VA_ARGS__})
 
-struct priv_usch_glob_list;
+/* @brief command stdout to buffer, with per-call options
+ *
+ * Like ustrout(), but applies p_opts to every command in the pipe-sequence.
+ *
+ * @param  p_ustash pointer to ustash structure.
+ * @param  p_opts pointer to ucmdopts, or NULL.
+ * @param  cmd command to run
+ * @return stdout contents as char**
+ */
+#define ustroutopt(p_ustash, p_opts, ...) priv_ustroutopt_impl((p_ustash), (p_opts), sizeof((const char*[]){NULL, ##__VA_ARGS__})/sizeof(const char*), (const char*[]){NULL, ##__VA_ARGS__})
 
-static inline int priv_usch_stash(ustash *p_ustash, struct priv_usch_stash_item *p_stashitem);
-static inline const char **priv_usch_globexpand(const char **pp_orig_argv, size_t num_args, /* out */ struct priv_usch_glob_list **pp_glob_list);
-static inline void   priv_usch_free_globlist(struct priv_usch_glob_list *p_glob_list);
+/**
+ * Placeholder for a variable argument of a prepared command.
+ */
+#define USLOT "\001USLOT\001"
 
-/* @brief  test if two strings are equal
+/**
+ * Forward declaration for private prepared command struct.
+ */
+typedef struct ucmdprep ucmdprep;
+
+/* @brief prepare a command for repeated invocation
  *
- * Test if two strings are equal
+ * Parse a command once: expand globbing on the constant arguments, split
+ * the pipe-sequence and look up each command in PATH. Arguments given as
+ * USLOT are filled in by every ucmdexec() or ustroutexec() call.
  *
- * @param p_a pointer to first string
- * @param p_a pointer to second string
- * @return 1 if equal, 0 if not equal or if any parameter is NULL
+ *   ucmdprep *p_convert = ucmdprepare(&stash, "convert", "-resize", "50%", USLOT, USLOT);
+ *   for (i = 0; pp_files[i] != NULL; i++)
+ *       ucmdexec(p_convert, pp_files[i], pp_thumbs[i]);
+ *
+ * @param  p_ustash pointer to ustash structure, holding the prepared command.
+ * @param  arguments 0-n constant arguments or USLOT.
+ * @return prepared command, or NULL on error.
  */
-static inline USCH_BOOL ustreq(const char *p_a, const char *p_b);
+#define ucmdprepare(p_ustash, ...) priv_ucmdprepare_impl((p_ustash), sizeof((const char*[]){NULL, ##__VA_ARGS__})/sizeof(const char*), (const char*[]){NULL, ##__VA_ARGS__})
 
-/* @brief  test if two strings are equal
+/* @brief run a prepared command
  *
- * Test if two strings are equal up to "len" characters
+ * Run a command prepared by ucmdprepare(), substituting one argument for
+ * each USLOT. The substituted arguments are used as is, no globbing is
+ * performed on them.
  *
- * @param p_a pointer to first string
- * @param p_a pointer to second string
- * @param len number of characters to test for equality
- * @return 1 if equal, 0 if not equal or if any parameter is NULL or len is 0
+ * @param  p_prep prepared command.
+ * @param  arguments one argument for each USLOT.
+ * @return status 0-255 where 0 means success, 1-255 specific command error,
+ *         or -1 if the number of arguments does not match.
  */
-static inline USCH_BOOL ustrneq(const char *p_a, const char *p_b, size_t len);
+#define ucmdexec(p_prep, ...) priv_ucmdexec_impl(NULL, (p_prep), sizeof((const char*[]){NULL, ##__VA_ARGS__})/sizeof(const char*), (const char*[]){NULL, ##__VA_ARGS__}, NULL)
 
-static inline int    priv_usch_cmd_arr(struct priv_usch_stash_item **pp_in, 
-        struct priv_usch_stash_item **pp_out,
-        struct priv_usch_stash_item **pp_err,
-        size_t num_args,
-        const char **pp_orig_argv);
-static inline int priv_usch_cached_whereis(char** pp_cached_path, int path_items, char* p_search_item, char** pp_dest);
+/* @brief run a prepared command and return its standard output
+ *
+ * Like ucmdexec(), but returns the standard output like ustrout().
+ *
+ * @param  p_ustash pointer to ustash structure.
+ * @param  p_prep prepared command.
+ * @param  arguments one argument for each USLOT.
+ * @return stdout contents as char*
+ */
+#define ustroutexec(p_ustash, p_prep, ...) priv_ustroutexec_impl((p_ustash), (p_prep), sizeof((const char*[]){NULL, ##__VA_ARGS__})/sizeof(const char*), (const char*[]){NULL, ##__VA_ARGS__})
 
-struct priv_usch_glob_list
-{
-    struct priv_usch_glob_list *p_next;
-    glob_t glob_data;
-} priv_usch_glob_list;
+/* @brief run a command with its standard output sent to a file descriptor
+ *
+ * Run a command with 0-n arguments, expand globbing on arguments.
+ * The output of the last command in the pipe-sequence is moved to out_fd
+ * with ufdcopy(), so it does not pass through a userspace buffer when the
+ * kernel supports splice(2).
+ *
+ * @param  out_fd destination file descriptor, not closed.
+ * @param  arguments 0-n arguments to the function.
+ * @return status 0-255 where 0 means success, or 1-255 specific command error.
+ */
+#define ucmdtofd(out_fd, ...) priv_ucmdfd_impl(-1, (out_fd), sizeof((const char*[]){NULL, ##__VA_ARGS__})/sizeof(const char*), (const char*[]){NULL, ##__VA_ARGS__})
 
-struct priv_usch_stash_item
-{
-    struct priv_usch_stash_item *p_next;
-    unsigned char error;
-    char str[];
-};
+/* @brief run a command with its standard input read from a file descriptor
+ *
+ * Run a command with 0-n arguments, expand globbing on arguments.
+ * The first command in the pipe-sequence reads in_fd directly as its
+ * standard input, no data is copied by the calling process.
+ *
+ * @param  in_fd source file descriptor, not closed.
+ * @param  arguments 0-n arguments to the function.
+ * @return status 0-255 where 0 means success, or 1-255 specific command error.
+ */
+#define ufdtocmd(in_fd, ...) priv_ucmdfd_impl((in_fd), -1, sizeof((const char*[]){NULL, ##__VA_ARGS__})/sizeof(const char*), (const char*[]){NULL, ##__VA_ARGS__})
 
-static int priv_usch_run(const char **pp_argv,
-                         int input,
-                         int first,
-                         int last,
-                         int *p_child_pid,
-                         struct priv_usch_stash_item **pp_out,
-                         int *p_num_calls);
-static int priv_usch_command(const char **pp_argv, int input, int first, int last, int *p_child_pid, struct priv_usch_stash_item **pp_out);
+/* @brief copy all data from one file descriptor to another
+ *
+ * Copy from in_fd until end of file. splice(2) is used when either
+ * descriptor is a pipe and copy_file_range(2) between regular files,
+ * falling back to a read/write loop where neither is available.
+ *
+ * @param  in_fd source file descriptor.
+ * @param  out_fd destination file descriptor.
+ * @return number of bytes copied, or -1 on error.
+ */
+USCH_API long long ufdcopy(int in_fd, int out_fd);
 
-static int priv_usch_waitforall(int n);
+/**
+ * Forward declaration for private job struct.
+ */
+typedef struct ujob ujob;
 
-#define USCH_FD_READ  0
-#define USCH_FD_WRITE 1
+/* @brief start a pipe-sequence in the background
+ *
+ * Start the commands like ucmd() does, but return without waiting.
+ * All commands of the pipe-sequence are put in a new process group, so
+ * the whole job can be signalled with ujobkill(). Terminal signals like
+ * ^C no longer reach the job directly, see ujobforward(). Like a shell's
+ * background job, the job never gets the terminal: when standard input
+ * is a terminal the first command reads /dev/null instead, and a command
+ * that opens the terminal itself gets EIO instead of stopping.
+ * Every started job must be waited for with ujobwait().
+ *
+ *   ujob *p_job = ujobstart(&stash, "make", "-j8", "|", "tee", "build.log");
+ *   ujobforward(p_job);
+ *   status = ujobwait(p_job);
+ *
+ * @param  p_ustash pointer to ustash structure, holding the job.
+ * @param  arguments 0-n arguments, like ucmd().
+ * @return job, or NULL if no command could be started.
+ */
+#define ujobstart(p_ustash, ...) priv_ujobstart_impl((p_ustash), NULL, USCH_FALSE, sizeof((const char*[]){NULL, ##__VA_ARGS__})/sizeof(const char*), (const char*[]){NULL, ##__VA_ARGS__})
 
-/**************************** implementations ******************************/
+/* @brief start a pipe-sequence in the background, with per-call options
+ *
+ * Like ujobstart(), with p_opts applied to every command. A timeout_ms
+ * deadline is counted from the start and enforced by ujobwait(), or by
+ * ujobtrywait() when called after ujobdeadline().
+ *
+ * @param  p_ustash pointer to ustash structure, holding the job.
+ * @param  p_opts pointer to ucmdopts, or NULL.
+ * @param  arguments 0-n arguments, like ucmd().
+ * @return job, or NULL if no command could be started.
+ */
+#define ujobstartopt(p_ustash, p_opts, ...) priv_ujobstart_impl((p_ustash), (p_opts), USCH_FALSE, sizeof((const char*[]){NULL, ##__VA_ARGS__})/sizeof(const char*), (const char*[]){NULL, ##__VA_ARGS__})
 
-static inline int priv_usch_stash(ustash *p_ustash, struct priv_usch_stash_item *p_stashitem)
-{
-    int status = 0;
+/* @brief start a pipe-sequence for an event loop
+ *
+ * Like ujobstartopt(), but the standard output of the last command and
+ * the standard error of all commands go to pipes. Their read ends, from
+ * ujobfd(), are non-blocking and close-on-exec, to be polled together
+ * with ujobpidfd() by epoll or poll and drained with ujobread().
+ * Nothing in between blocks. With timeout_ms, no descriptor becomes
+ * readable at the deadline, wait at most ujobdeadline() milliseconds:
+ *
+ *   ujob *p_job = ujobstartio(&stash, NULL, "git", "log", "|", "wc", "-l");
+ *   poll(fds, num_fds, ujobdeadline(p_job));
+ *   // when ujobfd(p_job, UJOB_STDOUT) is readable
+ *   p_chunk = ujobread(&stash, p_job, UJOB_STDOUT, &len);
+ *   // when ujobpidfd(p_job) is readable, or ujobdeadline() has passed
+ *   if (ujobtrywait(p_job, &status) == 0)
+ *       ... poll the new ujobpidfd(p_job)
+ *
+ * @param  p_ustash pointer to ustash structure, holding the job.
+ * @param  p_opts pointer to ucmdopts, or NULL.
+ * @param  arguments 0-n arguments, like ucmd().
+ * @return job, or NULL if no command could be started.
+ */
+#define ujobstartio(p_ustash, p_opts, ...) priv_ujobstart_impl((p_ustash), (p_opts), USCH_TRUE, sizeof((const char*[]){NULL, ##__VA_ARGS__})/sizeof(const char*), (const char*[]){NULL, ##__VA_ARGS__})
 
-    if (p_ustash == NULL || p_stashitem == NULL)
-        return -1;
+/* standard output of the last command of a ujobstartio() job */
+#define UJOB_STDOUT 1
+/* standard error of all commands of a ujobstartio() job */
+#define UJOB_STDERR 2
 
-    p_stashitem->p_next = p_ustash->p_list;
-    p_ustash->p_list = p_stashitem;
+/* @brief output descriptor of a job
+ *
+ * @param  p_job job from ujobstartio().
+ * @param  which UJOB_STDOUT or UJOB_STDERR.
+ * @return non-blocking read end, or -1 if not captured or already at
+ *         end of file. The job owns the descriptor.
+ */
+USCH_API int ujobfd(const ujob *p_job, int which);
 
-    return status;
-}
-static inline int priv_ucmd_impl(int num, const char **pp_args)
-{
-    int i;
-    int status;
-    for (i=0; i < (num - 1); i++)
-    {
-        pp_args[i] = pp_args[i+1]; 
-    }
-    pp_args[num-1] = NULL;
+/* @brief read the output of a job without blocking
+ *
+ * Read everything that is available on an output descriptor of the job.
+ * At end of file the descriptor is closed, remove it from the event loop
+ * before, or rely on epoll dropping closed descriptors.
+ *
+ * @param  p_ustash pointer to ustash structure, for the data.
+ * @param  p_job job from ujobstartio().
+ * @param  which UJOB_STDOUT or UJOB_STDERR.
+ * @param  p_len set to the number of bytes read, may be NULL.
+ * @return NUL terminated data, "" if nothing is available yet, or NULL at
+ *         end of file.
+ */
+USCH_API char *ujobread(ustash *p_ustash, ujob *p_job, int which, size_t *p_len);
 
-    status = priv_usch_cmd_arr(NULL, NULL, NULL, num - 1, pp_args);
-    return status;
-}
+/* @brief descriptor that is readable when a command of a job exits
+ *
+ * A pidfd of the first command of the job that is still running.
+ * Ask again after ujobtrywait() returned 0.
+ *
+ * @param  p_job job from ujobstart().
+ * @return pidfd owned by the job, or -1 if the job has been waited for or
+ *         the kernel has no pidfd_open() (before Linux 5.3).
+ */
+USCH_API int ujobpidfd(const ujob *p_job);
 
-static inline char* priv_ustrout_impl(ustash *p_ustash, int num, const char **pp_args)
-{
-    int i;
-    static char emptystr[] = "";
-    char *p_strout = emptystr;
-    struct priv_usch_stash_item *p_out = NULL;
+/* @brief wait for a job to finish, without blocking
+ *
+ * Like ujobwait() once all commands have exited, otherwise return at
+ * once. The output descriptors are left open, read them to the end.
+ * Without pidfd_open() this blocks like ujobwait().
+ * timeout_ms is enforced here, only when called: a job past its deadline
+ * gets SIGTERM, and SIGKILL on a call after kill_grace_ms more.
+ *
+ * @param  p_job job from ujobstart().
+ * @param  p_status set to the status ujobwait() returns, may be NULL.
+ * @return 1 if the job has finished, 0 if it still runs, -1 on error.
+ */
+USCH_API int ujobtrywait(ujob *p_job, int *p_status);
 
-    for (i=0; i < (num - 1); i++)
-    {
-        pp_args[i] = pp_args[i+1]; 
-    }
-    pp_args[num-1] = NULL;
+/* @brief time until ujobtrywait() must enforce the deadline of a job
+ *
+ * An event loop waits at most this long, e.g. as the timeout of poll()
+ * or epoll_wait(), and then calls ujobtrywait(). After SIGTERM the
+ * time left is the one until SIGKILL.
+ *
+ * @param  p_job job from ujobstartopt() or ujobstartio().
+ * @return milliseconds left, 0 if the deadline has passed, or -1 if the
+ *         job has no timeout_ms or has been waited for.
+ */
+USCH_API int ujobdeadline(const ujob *p_job);
 
-    (void)priv_usch_cmd_arr(NULL, &p_out, NULL, num - 1, pp_args);
-    if (priv_usch_stash(p_ustash, p_out) != 0)
-    {
-        fprintf(stderr, "stash failed, ohnoes!\n");
-        goto end;
-    }
-end:
-    p_strout = p_out->str;
-    p_out = NULL;
+/* @brief process group of a job
+ *
+ * @param  p_job job from ujobstart().
+ * @return process group id, the pid of the first command.
+ */
+USCH_API pid_t ujobpgid(const ujob *p_job);
 
-    return p_strout;
-}
+/* @brief send a signal to every command of a job
+ *
+ * Unless sig is SIGKILL or stops the job, SIGCONT follows, so that a
+ * stopped job acts on it at once.
+ *
+ * @param  p_job job from ujobstart().
+ * @param  sig signal to send.
+ * @return 0 on success, -1 with errno set on error.
+ */
+USCH_API int ujobkill(ujob *p_job, int sig);
 
-static inline char* priv_ustrjoin_impl(ustash *p_stash,
-                                       int num,
-                                       const char **pp_args)
-{
-    int i;
-    char *p_str;
-    char **pp_nonconst_args = (char **)pp_args;
-    for (i=0; i < (num - 1); i++)
-    {
-        pp_nonconst_args[i] = pp_nonconst_args [i+1]; 
-    }
-    pp_nonconst_args[num-1] = NULL;
+/* @brief forward terminal signals to a job
+ *
+ * Until ujobwait() returns, SIGHUP, SIGINT, SIGQUIT and SIGTERM received
+ * by this process are sent to the job instead, like a shell does with
+ * its foreground job. The previous signal handlers are restored when
+ * the last forwarded job has been waited for.
+ *
+ * @param  p_job job from ujobstart().
+ * @return 0 on success, -1 if too many jobs are forwarded at once.
+ */
+USCH_API int ujobforward(ujob *p_job);
 
-    p_str = ustrjoinv(p_stash, (const char **)pp_nonconst_args);
-    return p_str;
-}
+/* @brief wait for a job to finish
+ *
+ * Wait for every command of the job, so none is left as a zombie, and
+ * stop forwarding signals to it. Output descriptors still open are
+ * closed first, a command writing to them then gets SIGPIPE. Can be
+ * called again, then it returns the same status at once.
+ *
+ * @param  p_job job from ujobstart().
+ * @return exit status 0-255 of the last command, or -1 if it was killed
+ *         by a signal, could not be started or, with errno ETIMEDOUT,
+ *         ran past timeout_ms.
+ */
+USCH_API int ujobwait(ujob *p_job);
 
-static inline char** priv_ustrexp_impl(ustash *p_stash,
-                                       int num,
-                                       const char **pp_args)
-{
-    int i;
-    char **pp_strings;
-    char **pp_nonconst_args = (char **)pp_args;
-    for (i=0; i < (num - 1); i++)
-    {
-        pp_nonconst_args[i] = pp_nonconst_args [i+1]; 
-    }
-    pp_nonconst_args[num-1] = NULL;
+/* @brief start a fork server
+ *
+ * Fork a small helper process that performs fork/exec on behalf of
+ * ucmd(), ustrout() and friends. Forking a process with a large heap or
+ * many threads is slow, the helper keeps the cost of spawning a command
+ * independent of the size of the calling process.
+ *
+ * Call early, before the heap grows and before any threads are created.
+ * Commands are transparently run by the calling process again if the
+ * fork server dies.
+ *
+ * @return 0 on success, -1 on error.
+ */
+USCH_API int uforkserver(void);
 
-    pp_strings = ustrexpv(p_stash, (const char **)pp_nonconst_args);
-    return pp_strings;
-}
+/* @brief stop the fork server
+ *
+ * Stop the fork server started by uforkserver(), if any.
+ */
+USCH_API void uforkserverstop(void);
 
-static inline void uclear(ustash *p_ustash)
-{
-    struct priv_usch_stash_item *p_current = NULL;
-    if (p_ustash == NULL)
-        return;
-    if (p_ustash->p_list == NULL)
-        return;
+/**
+ * Forward declaration for private string hash map struct.
+ * A ustrset is a ustrmap where only the keys are used.
+ */
+typedef struct ustrmap ustrmap;
+typedef struct ustrmap ustrset;
 
-    p_current = p_ustash->p_list;
+/* @brief create an empty string set
+ *
+ * Create an open addressing hash set of strings in the stash.
+ * The set stores pointers, the strings must live as long as the set.
+ *
+ * @param  p_ustash pointer to ustash structure.
+ * @param  hint expected number of strings, the set grows beyond it.
+ * @return set, or NULL on allocation failure.
+ */
+USCH_API ustrset *ustrsetnew(ustash *p_ustash, size_t hint);
 
-    while (p_current != NULL)
-    {
-        struct priv_usch_stash_item *p_prev = p_current;
-        p_current = p_current->p_next;
-        free(p_prev);
-    }
-    p_ustash->p_list = NULL;
-}
+/* @brief create a string set from a vector
+ *
+ * Create a set holding all strings of a NULL terminated vector,
+ * e.g. the result of ustrexpv(), ustrsplit() or ufiletostrv().
+ *
+ * @param  p_ustash pointer to ustash structure.
+ * @param  pp_strv NULL terminated vector of strings.
+ * @return set, or NULL on allocation failure.
+ */
+USCH_API ustrset *ustrsetv(ustash *p_ustash, char **pp_strv);
 
-static inline char **ustrsplit(ustash *p_ustash, const char* p_in, const char* p_delims)
-{
-    struct priv_usch_stash_item *p_stashitem = NULL;
-    char** pp_out = NULL;
-    char* p_out = NULL;
+/* @brief add a string to a set
+ *
+ * @param  p_set set to add to.
+ * @param  p_str string to add, not copied.
+ * @return 1 if added, 0 if already present, -1 on error.
+ */
+USCH_API int ustrsetadd(ustrset *p_set, const char *p_str);
+
+/* @brief test if a set holds a string
+ *
+ * @param  p_set set to test, may be NULL.
+ * @param  p_str string to look for.
+ * @return 1 if present, 0 if not present or if any parameter is NULL.
+ */
+USCH_API USCH_BOOL ustrsethas(const ustrset *p_set, const char *p_str);
+
+/* @brief number of strings in a set or map
+ *
+ * @param  p_map set or map, may be NULL.
+ * @return number of keys.
+ */
+USCH_API size_t ustrsetsize(const ustrset *p_map);
+
+/* @brief create an empty string to string map
+ *
+ * Like ustrsetnew(), but each key has a value. Keys and values are not
+ * copied.
+ *
+ * @param  p_ustash pointer to ustash structure.
+ * @param  hint expected number of keys, the map grows beyond it.
+ * @return map, or NULL on allocation failure.
+ */
+USCH_API ustrmap *ustrmapnew(ustash *p_ustash, size_t hint);
+
+/* @brief set the value of a key
+ *
+ * @param  p_map map to modify.
+ * @param  p_key key, not copied.
+ * @param  p_value value, not copied.
+ * @return 1 if the key was added, 0 if its value was replaced, -1 on error.
+ */
+USCH_API int ustrmapset(ustrmap *p_map, const char *p_key, const char *p_value);
+
+/* @brief get the value of a key
+ *
+ * @param  p_map map to search, may be NULL.
+ * @param  p_key key.
+ * @return the value, or NULL if the key is not present.
+ */
+USCH_API char *ustrmapget(const ustrmap *p_map, const char *p_key);
+
+/* @brief strings of one vector that are not in another
+ *
+ * Linear time difference of two NULL terminated vectors, the order of
+ * pp_a is kept. The result points to the strings of pp_a.
+ *
+ * @param  p_ustash pointer to ustash structure.
+ * @param  pp_a vector to filter, NULL is an empty vector.
+ * @param  pp_b vector of strings to remove, NULL is an empty vector, so
+ *         the result is a copy of pp_a.
+ * @return NULL terminated vector. Never returns NULL.
+ */
+USCH_API char **ustrvdiff(ustash *p_ustash, char **pp_a, char **pp_b);
+
+/* @brief strings present in both of two vectors
+ *
+ * Like ustrvdiff(), but keeps the strings of pp_a that are also in pp_b.
+ *
+ * @param  p_ustash pointer to ustash structure.
+ * @param  pp_a vector to filter, NULL is an empty vector.
+ * @param  pp_b vector of strings to keep, NULL is an empty vector, so
+ *         the result is empty.
+ * @return NULL terminated vector. Never returns NULL.
+ */
+USCH_API char **ustrvisect(ustash *p_ustash, char **pp_a, char **pp_b);
+
+/* @brief remove duplicate strings from a vector
+ *
+ * Keep the first occurrence of each string, in the original order.
+ * The result points to the strings of pp_strv.
+ *
+ * @param  p_ustash pointer to ustash structure.
+ * @param  pp_strv vector to deduplicate.
+ * @return NULL terminated vector. Never returns NULL.
+ */
+USCH_API char **ustrvdedup(ustash *p_ustash, char **pp_strv);
+
+/* @brief sort a vector of strings
+ *
+ * Sort a NULL terminated vector in place in byte order, like
+ * LC_ALL=C sort. Only the pointers are moved, no string is copied.
+ * Uses an MSD radix sort, large vectors are sorted by several threads.
+ *
+ * @param  pp_strv NULL terminated vector, e.g. from ufiletostrv().
+ * @return pp_strv.
+ */
+USCH_API char **usort(char **pp_strv);
+
+/* @brief remove adjacent duplicates from a vector of strings
+ *
+ * Remove repeated adjacent strings in place, like uniq. Call usort()
+ * first to remove all duplicates.
+ *
+ * @param  pp_strv NULL terminated vector.
+ * @return pp_strv, NULL terminated after the last unique string.
+ */
+USCH_API char **uuniq(char **pp_strv);
+
+/* pattern is a fixed string, not a regular expression */
+#define UGREP_FIXED  0x1
+/* ignore case */
+#define UGREP_ICASE  0x2
+/* select the strings that do not match */
+#define UGREP_INVERT 0x4
+
+/* @brief select the strings matching a pattern
+ *
+ * Filter a vector like grep. The pattern is a POSIX extended regular
+ * expression, or a plain substring with UGREP_FIXED. The regular
+ * expression is compiled once for the whole vector.
+ *
+ * @param  p_ustash pointer to ustash structure.
+ * @param  pp_strv NULL terminated vector, e.g. from ufiletostrv().
+ * @param  p_pattern pattern to search for.
+ * @param  flags UGREP_FIXED, UGREP_ICASE and UGREP_INVERT or'ed together.
+ * @return NULL terminated vector pointing to the strings of pp_strv.
+ *         Never returns NULL, an invalid pattern gives an empty vector.
+ */
+USCH_API char **ugrep(ustash *p_ustash, char **pp_strv, const char *p_pattern, int flags);
+
+/* @brief select the lines of a file matching a pattern
+ *
+ * Like ugrep(), but scans the mapped file directly. Only the matching
+ * lines are copied to the stash, without their newline.
+ *
+ * @param  p_ustash pointer to ustash structure.
+ * @param  p_filename file to search.
+ * @param  p_pattern pattern to search for.
+ * @param  flags UGREP_FIXED, UGREP_ICASE and UGREP_INVERT or'ed together.
+ * @return NULL terminated vector of matching lines. Never returns NULL.
+ */
+USCH_API char **ugrepfile(ustash *p_ustash, const char *p_filename, const char *p_pattern, int flags);
+
+/**
+ * A field of a ufieldtab, pointing into the split buffer.
+ * The field is not NUL terminated.
+ */
+typedef struct ufield
+{
+    const char *p_str;
+    size_t len;
+} ufield;
+
+/**
+ * Table of fields made by ufields(). Row r holds the fields
+ * p_fields[p_row_start[r]] up to p_fields[p_row_start[r + 1]].
+ */
+typedef struct ufieldtab
+{
+    size_t num_rows;
+    size_t num_cols;      // most fields in any row
+    size_t *p_row_start;  // num_rows + 1 entries
+    ufield *p_fields;
+} ufieldtab;
+
+/* runs of delimiters separate two fields, leading delimiters are skipped, like awk */
+#define UFIELDS_COLLAPSE 0x1
+/* fields may be "quoted" to contain delimiters and newlines, "" is a literal quote */
+#define UFIELDS_QUOTED   0x2
+
+/* @brief split a buffer into rows and fields
+ *
+ * Split lines into fields in a single pass over p_in, e.g. the output
+ * of ustrout("ps", "aux") or a CSV file. Fields point into p_in, which
+ * must live as long as the table. A trailing carriage return is not
+ * part of the last field. Empty lines give rows without fields. Quotes
+ * of a quoted field are not part of the field, but "" is not unescaped.
+ *
+ * @param  p_ustash pointer to ustash structure.
+ * @param  p_in NUL terminated buffer to split.
+ * @param  p_delims field delimiters, e.g. " \t" or ",".
+ * @param  flags UFIELDS_COLLAPSE and UFIELDS_QUOTED or'ed together.
+ * @return table in the stash, or NULL on error.
+ */
+USCH_API ufieldtab *ufields(ustash *p_ustash, const char *p_in, const char *p_delims, int flags);
+
+/* @brief get a field of a table
+ *
+ * @param  p_tab table from ufields().
+ * @param  row row index.
+ * @param  col column index.
+ * @return the field, or a field with p_str NULL if it does not exist.
+ */
+USCH_API ufield ufieldat(const ufieldtab *p_tab, size_t row, size_t col);
+
+/* @brief extract a column of a table
+ *
+ * Copy column col of every row to the stash, like cut -f. Rows
+ * without that column give an empty string, so index i is row i.
+ *
+ * @param  p_ustash pointer to ustash structure.
+ * @param  p_tab table from ufields().
+ * @param  col column index, starting at 0.
+ * @return NULL terminated vector. Never returns NULL.
+ */
+USCH_API char **ucut(ustash *p_ustash, const ufieldtab *p_tab, size_t col);
+
+/* @brief directory part of a path
+ *
+ * Like dirname(1): "/a/b/" gives "/a", "a" gives "." and "/" gives "/".
+ *
+ * @param  p_ustash pointer to ustash structure.
+ * @param  p_str path.
+ * @return p_dirname new string. Returns empty string for an empty path.
+ */
+USCH_API char *udirname(ustash *p_ustash, const char *p_str);
+
+/* @brief last component of a path
+ *
+ * Like basename(1): "/a/b.c" gives "b.c", "/a/b/" gives "b" and "/"
+ * gives "/". The result points into p_path unless p_path has trailing
+ * slashes, then it is copied to the stash. Like strchr(), the result is
+ * not const, but must not be written to when it points into p_path.
+ *
+ * @param  p_ustash pointer to ustash structure.
+ * @param  p_path path.
+ * @return p_basename the last component. Returns empty string for an empty path.
+ */
+USCH_API char *ubasename(ustash *p_ustash, const char *p_path);
+
+/* @brief extension of a path
+ *
+ * Find the extension of the last component, including the dot:
+ * "dir.d/file.tar.gz" gives ".gz". Leading dots do not start an
+ * extension, so ".bashrc" has none.
+ *
+ * @param  p_path path.
+ * @return p_ext pointer into p_path, pointing to its NUL if there is no extension.
+ */
+USCH_API const char *uext(const char *p_path);
+
+/* @brief join path components
+ *
+ * Join 0-n components with exactly one '/' between them. Empty
+ * components are skipped. A leading '/' of the first component is kept.
+ *
+ * @param  p_ustash pointer to ustash structure.
+ * @param  pp_parts NULL terminated vector of components.
+ * @return p_path new string. Returns empty string on error.
+ */
+USCH_API char *upathjoinv(ustash *p_ustash, const char **pp_parts);
+#define upathjoin(p_stash, ...) priv_upathjoin_impl((p_stash), sizeof((const char*[]){NULL, ##__VA_ARGS__})/sizeof(const char*), (const char*[]){NULL, ##__VA_ARGS__})
+
+/* @brief normalize a path lexically
+ *
+ * Remove repeated slashes, "." components, trailing slashes and ".."
+ * components that follow a directory name, without touching the file
+ * system: "a//b/./../c/" gives "a/c". Note that this differs from
+ * urealpath() when a directory is a symbolic link.
+ *
+ * @param  p_ustash pointer to ustash structure.
+ * @param  p_path path.
+ * @return p_norm p_path itself if already normal, else a new string.
+ *         Returns "." for an empty path. Like ubasename(), not const
+ *         even when it is p_path.
+ */
+USCH_API char *upathnorm(ustash *p_ustash, const char *p_path);
+
+/* @brief canonical absolute path
+ *
+ * Resolve symbolic links, "." and ".." like realpath(3).
+ *
+ * @param  p_ustash pointer to ustash structure.
+ * @param  p_path existing path.
+ * @return p_real new string. Returns empty string and sets errno on error.
+ */
+USCH_API char *urealpath(ustash *p_ustash, const char *p_path);
+
+/* @brief batch versions of the path functions
+ *
+ * Apply udirname(), ubasename(), upathnorm() or urealpath() to every
+ * path of a vector, e.g. a ustrexp() result. The result vector and all
+ * strings that must be copied share a single stash allocation. Strings
+ * that need no copy point into pp_paths. urealpathv() gives "" for
+ * every path that can not be resolved, so the vector keeps its length.
+ *
+ * @param  p_ustash pointer to ustash structure.
+ * @param  pp_paths NULL terminated vector of paths.
+ * @return NULL terminated vector of the same length. Never returns NULL.
+ */
+USCH_API char **udirnamev(ustash *p_ustash, char **pp_paths);
+USCH_API char **ubasenamev(ustash *p_ustash, char **pp_paths);
+USCH_API char **upathnormv(ustash *p_ustash, char **pp_paths);
+USCH_API char **urealpathv(ustash *p_ustash, char **pp_paths);
+
+/* @brief get an environment variable
+ *
+ * Like getenv(), but looks the name up in a hashed snapshot of environ
+ * instead of comparing every entry. Checking that the snapshot is current
+ * takes constant time. It sees uenvset() and uenvunset(), and setenv(),
+ * putenv() or unsetenv() adding or removing a variable. Values point
+ * into the strings of environ, so a value written to in place is seen,
+ * only a name written to in place is not. Replacing an existing variable
+ * with setenv() or putenv() is not seen until uenvrefresh() is called.
+ * uenvset() and uenvunset() also lock against other threads using the
+ * snapshot.
+ *
+ * @param  p_name variable name.
+ * @return p_value value, or NULL if not set.
+ */
+USCH_API const char *uenvget(const char *p_name);
+
+/* @brief set an environment variable
+ *
+ * @param  p_name variable name.
+ * @param  p_value new value.
+ * @return 0 on success, -1 on error with errno set.
+ */
+USCH_API int uenvset(const char *p_name, const char *p_value);
+
+/* @brief remove an environment variable
+ *
+ * @param  p_name variable name.
+ * @return 0 on success, -1 on error with errno set.
+ */
+USCH_API int uenvunset(const char *p_name);
+
+/* @brief notice changes made to environ without uenvset()
+ *
+ * Call after setenv() or putenv() replaced a variable that was already
+ * set, so that uenvget() and $VAR expansion see the new value.
+ */
+USCH_API void uenvrefresh(void);
+
+/* @brief expand environment variables in a string
+ *
+ * Replace $NAME and ${NAME} with the value of the variable. References
+ * to unset variables are left as they are, "\$" gives a literal '$'
+ * (written "\\$" in C). Command arguments are expanded the same way
+ * before globbing.
+ *
+ * @param  p_ustash pointer to ustash structure.
+ * @param  p_str string to expand.
+ * @return p_expanded new string. Returns empty string on error.
+ */
+USCH_API char *uenvexpand(ustash *p_ustash, const char *p_str);
+
+/**
+ * A directory entry returned by ulsdir() and ufind().
+ * size, mtime and mode are only filled with ULS_STAT.
+ */
+typedef struct uentry
+{
+    const char *p_name;       // name, or path below the directory for ufind()
+    unsigned char type;       // DT_REG, DT_DIR, DT_LNK, ...
+    unsigned int mode;
+    unsigned long long size;
+    long long mtime;          // seconds since the epoch
+} uentry;
+
+/* fill size, mtime and mode */
+#define ULS_STAT   0x1
+/* include names starting with '.' */
+#define ULS_HIDDEN 0x2
+
+/* type bits of ulsfilter */
+#define ULS_FILE  0x1
+#define ULS_DIR   0x2
+#define ULS_LINK  0x4
+#define ULS_OTHER 0x8
+
+/**
+ * Entries to return from ulsdir() and ufind(). Zero fields do not filter.
+ * ufind() descends into directories whether or not they match.
+ */
+typedef struct ulsfilter
+{
+    unsigned int types;             // ULS_FILE, ULS_DIR, ... or'ed together
+    unsigned long long min_size;
+    unsigned long long max_size;
+    long long min_mtime;
+    long long max_mtime;
+} ulsfilter;
+
+/* @brief list a directory
+ *
+ * Read a directory with getdents64() and fstatat() relative to the
+ * directory fd, without globbing or resolving each path. Symbolic links
+ * are not followed. "." and ".." are never listed.
+ *
+ * @param  p_ustash pointer to ustash structure.
+ * @param  p_dir directory to list.
+ * @param  flags ULS_STAT and ULS_HIDDEN or'ed together.
+ * @param  p_filter entries to keep, or NULL for all.
+ * @param  p_num set to the number of entries, may be NULL.
+ * @return array of entries ending with p_name NULL, or NULL with errno set
+ *         if p_dir can not be opened. errno is 0 when the array is
+ *         complete, otherwise it is the first error, e.g. EACCES from
+ *         fstatat(), and the entries that failed are missing.
+ */
+USCH_API uentry *ulsdir(ustash *p_ustash, const char *p_dir, int flags, const ulsfilter *p_filter, size_t *p_num);
+
+/* @brief list a directory tree
+ *
+ * Like ulsdir(), but descends into subdirectories, like find(1).
+ * Names are paths relative to p_dir, e.g. "src/usch.h". A subdirectory
+ * that can not be read, e.g. EACCES or EMFILE from openat(), or whose path
+ * would be longer than PATH_MAX (ENAMETOOLONG), is listed but not
+ * descended into. The walk goes on, and errno reports the first error.
+ *
+ * @param  p_ustash pointer to ustash structure.
+ * @param  p_dir directory to walk.
+ * @param  flags ULS_STAT and ULS_HIDDEN or'ed together.
+ * @param  p_filter entries to keep, or NULL for all.
+ * @param  p_num set to the number of entries, may be NULL.
+ * @return array of entries ending with p_name NULL, or NULL with errno set
+ *         if p_dir can not be opened. errno is 0 when the array is
+ *         complete, otherwise the first error.
+ */
+USCH_API uentry *ufind(ustash *p_ustash, const char *p_dir, int flags, const ulsfilter *p_filter, size_t *p_num);
+
+/* fast 64 bit non-cryptographic hash, 16 hex digits */
+#define UHASH_FAST   0
+/* SHA-256, 64 hex digits, same as sha256sum */
+#define UHASH_SHA256 1
+
+/* @brief hash the contents of a file
+ *
+ * Hash a file in process instead of running sha256sum. Regular files
+ * are mapped, not read. UHASH_FAST is much faster than UHASH_SHA256,
+ * use it when the digest only has to detect changes.
+ *
+ * @param  p_ustash pointer to ustash structure.
+ * @param  p_filename file to hash.
+ * @param  algo UHASH_FAST or UHASH_SHA256.
+ * @return p_digest lower case hex digest. Returns empty string on error.
+ */
+USCH_API char *uhashfile(ustash *p_ustash, const char *p_filename, int algo);
+
+/* @brief hash the contents of many files
+ *
+ * Like uhashfile() for every path of a vector, using one thread per CPU.
+ *
+ * @param  p_ustash pointer to ustash structure.
+ * @param  pp_paths NULL terminated vector of paths.
+ * @param  algo UHASH_FAST or UHASH_SHA256.
+ * @return NULL terminated vector of hex digests, in the order of pp_paths,
+ *         with empty strings for files that could not be read. Never returns NULL.
+ */
+USCH_API char **uhashfiles(ustash *p_ustash, char **pp_paths, int algo);
+
+/* @brief compare the contents of two files
+ *
+ * Like cmp -s. Files of different size are not read.
+ *
+ * @param  p_a first file.
+ * @param  p_b second file.
+ * @return 1 if equal, 0 if different, -1 on error.
+ */
+USCH_API int ufilesequal(const char *p_a, const char *p_b);
+
+/**
+ * @brief Options for ustrcached()
+ *
+ * Zero initialize and set the fields that are needed. The command line,
+ * working directory and everything listed here make up the cache key.
+ */
+typedef struct ucacheopts
+{
+    /** NULL terminated names of environment variables the output depends on */
+    const char **pp_env;
+    /** NULL terminated files the output depends on, keyed by size and mtime */
+    const char **pp_files;
+    /** key pp_files by their contents (UHASH_FAST) instead of size and mtime */
+    int hash_files;
+    /** run the command again if the entry is older than max_age_s seconds, 0 to keep forever */
+    long max_age_s;
+    /** cache directory, NULL for $XDG_CACHE_HOME/usch or ~/.cache/usch */
+    const char *p_dir;
+    /** options for running the command, or NULL */
+    const ucmdopts *p_opts;
+} ucacheopts;
+
+/* @brief memoized command stdout to buffer
+ *
+ * Like ustrout(), but the output of a successful run is stored in a
+ * cache directory and returned by later calls with the same key, also
+ * from other processes, without running anything. Only use it for
+ * commands whose output is determined by the key, e.g.
+ * ustrcached(&s, NULL, "pkg-config", "--cflags", "gtk+-3.0").
+ * The arguments are part of the key after $VAR and glob expansion, so a
+ * new file matching "*.c" gives a new key but a changed one does not,
+ * list files whose contents matter in p_copts->pp_files.
+ *
+ * @param  p_ustash pointer to ustash structure.
+ * @param  p_copts pointer to ucacheopts, or NULL.
+ * @param  cmd command to run
+ * @return stdout contents as char*
+ */
+#define ustrcached(p_ustash, p_copts, ...) priv_ustrcached_impl((p_ustash), (p_copts), sizeof((const char*[]){NULL, ##__VA_ARGS__})/sizeof(const char*), (const char*[]){NULL, ##__VA_ARGS__})
+
+/* @brief  test if two strings are equal
+ *
+ * Test if two strings are equal
+ *
+ * @param p_a pointer to first string
+ * @param p_a pointer to second string
+ * @return 1 if equal, 0 if not equal or if any parameter is NULL
+ */
+USCH_API USCH_BOOL ustreq(const char *p_a, const char *p_b);
+
+/* @brief  test if two strings are equal
+ *
+ * Test if two strings are equal up to "len" characters
+ *
+ * @param p_a pointer to first string
+ * @param p_a pointer to second string
+ * @param len number of characters to test for equality
+ * @return 1 if equal, 0 if not equal or if any parameter is NULL or len is 0
+ */
+USCH_API USCH_BOOL ustrneq(const char *p_a, const char *p_b, size_t len);
+
+/*** private APIs below, may change without notice  ***/
+
+USCH_API ujob *priv_ujobstart_impl(ustash *p_ustash, const ucmdopts *p_opts, USCH_BOOL capture, int num, const char **pp_args);
+USCH_API int priv_ucmdopt_impl(const ucmdopts *p_opts, int num, const char **pp_args);
+USCH_API int priv_ucmdfd_impl(int in_fd, int out_fd, int num, const char **pp_args);
+USCH_API ucmdprep *priv_ucmdprepare_impl(ustash *p_ustash, int num, const char **pp_args);
+USCH_API int priv_ucmdexec_impl(ustash *p_ustash, ucmdprep *p_prep, int num, const char **pp_args, char **pp_strout);
+USCH_API char *priv_ustroutexec_impl(ustash *p_ustash, ucmdprep *p_prep, int num, const char **pp_args);
+USCH_API char* priv_ustroutopt_impl(ustash *p_ustash, const ucmdopts *p_opts, int num, const char **pp_args);
+USCH_API int priv_ucmd_impl(int num, const char **pp_args);
+USCH_API char* priv_ustrout_impl(ustash *p_ustash, int num, const char **pp_args);
+USCH_API char* priv_ustrjoin_impl(ustash *p_stash, int num, const char **pp_args);
+USCH_API char* priv_upathjoin_impl(ustash *p_stash, int num, const char **pp_args);
+USCH_API char** priv_ustrexp_impl(ustash *p_stash, int num, const char **pp_args);
+USCH_API char* priv_ustrcached_impl(ustash *p_ustash, const ucacheopts *p_copts, int num, const char **pp_args);
+
+/*
+ * The helpers below are USCH_PRIV, only the file holding the definitions
+ * sees them.
+ */
+#if !defined(USCH_DECLARATIONS_ONLY) || defined(USCH_IMPLEMENTATION)
+
+struct priv_usch_glob_list;
+
+USCH_PRIV int priv_usch_stashfrom(ustash *p_ustash, struct priv_usch_stash_item *p_stashitem, const char *p_func);
+#define priv_usch_stash(p_ustash, p_stashitem) priv_usch_stashfrom((p_ustash), (p_stashitem), __func__)
+USCH_PRIV size_t priv_usch_stash_itemsize(struct priv_usch_stash_item *p_stashitem);
+USCH_PRIV const char **priv_usch_globexpand(const char **pp_orig_argv, size_t num_args, /* out */ struct priv_usch_glob_list **pp_glob_list);
+USCH_PRIV void   priv_usch_free_globlist(struct priv_usch_glob_list *p_glob_list);
+
+
+USCH_PRIV int    priv_usch_cmd_arr(struct priv_usch_stash_item **pp_in,
+        struct priv_usch_stash_item **pp_out,
+        struct priv_usch_stash_item **pp_err,
+        int in_fd,
+        int out_fd,
+        const ucmdopts *p_opts,
+        size_t num_args,
+        const char **pp_orig_argv);
+USCH_PRIV int priv_usch_cached_whereis(char** pp_cached_path, int path_items, char* p_search_item, char** pp_dest);
+
+struct priv_usch_glob_list
+{
+    struct priv_usch_glob_list *p_next;
+    glob_t glob_data;
+};
+
+struct priv_usch_stash_item
+{
+    struct priv_usch_stash_item *p_next;
+    unsigned char error;
+#if defined(USCH_DEBUG_STASH)
+    const char *p_func;
+#endif // USCH_DEBUG_STASH
+    // pointer aligned, several functions keep a char* array in str
+    char str[] __attribute__((aligned(sizeof(char*))));
+};
+
+struct priv_usch_strmap_slot
+{
+    uint64_t hash;
+    const char *p_key;
+    const char *p_value;
+};
+
+/*
+ * Open addressing hash map with linear probing, p_key == NULL marks an
+ * empty slot. Slot tables replaced when growing stay in the stash until
+ * uclear(), so pushing to a shared stash stays lock-free.
+ */
+struct ustrmap
+{
+    ustash *p_ustash;
+    size_t count;
+    size_t mask;
+    struct priv_usch_strmap_slot *p_slots;
+};
+
+USCH_PRIV uint64_t priv_usch_hash(const void *p_key, size_t len, uint64_t seed);
+USCH_PRIV char **priv_usch_strvfilter(ustash *p_ustash, char **pp_a, char **pp_b, USCH_BOOL keep);
+
+/* a compiled ugrep() pattern */
+struct priv_usch_grep
+{
+    int flags;
+    const char *p_needle;
+    size_t needle_len;
+    unsigned char lower;
+    unsigned char upper;
+    regex_t regex;
+};
+
+USCH_PRIV int priv_usch_grep_init(struct priv_usch_grep *p_grep, const char *p_pattern, int flags);
+USCH_PRIV USCH_BOOL priv_usch_grep_match(struct priv_usch_grep *p_grep, const char *p_str, size_t len);
+
+/* path operations of priv_usch_pathv() */
+enum priv_usch_pathop
+{
+    USCH_PATH_DIRNAME,
+    USCH_PATH_BASENAME,
+    USCH_PATH_NORM
+};
+
+/*
+ * State of a ulsdir() or ufind() walk. Entries are collected with name
+ * offsets into p_names, and packed into one stash blob at the end.
+ */
+struct priv_usch_walk
+{
+    int flags;
+    const ulsfilter *p_filter;
+    USCH_BOOL recurse;
+    USCH_BOOL need_stat;
+    uentry *p_entries;
+    size_t num_entries;
+    size_t max_entries;
+    char *p_names;
+    size_t names_len;
+    size_t names_size;
+    char path[PATH_MAX];
+    size_t path_len;
+    int err;                  // first error below the top directory, or 0
+};
+
+USCH_PRIV int priv_usch_walk_dir(struct priv_usch_walk *p_walk, int dir_fd);
+USCH_PRIV void priv_usch_walk_error(struct priv_usch_walk *p_walk, int err);
+
+struct priv_usch_sha256
+{
+    uint32_t state[8];
+    uint64_t num_bytes;
+    unsigned char block[64];
+    size_t block_len;
+};
+
+/* shared state of a multi-threaded uhashfiles() */
+struct priv_usch_hash_job
+{
+    char **pp_paths;
+    char **pp_digests;
+    size_t num;
+    size_t next;
+    int algo;
+};
+
+/*
+ * A ustrcached() entry is one file named after the 128 bit hash of the
+ * key: this header, the key and the output.
+ */
+#define USCH_CACHE_MAGIC "uschc001"
+struct priv_usch_cache_header
+{
+    char magic[8];
+    uint64_t key_len;
+    uint64_t out_len;
+    int64_t created;
+};
+
+/* a growing malloc'ed buffer */
+struct priv_usch_buf
+{
+    char *p_data;
+    size_t len;
+    size_t size;
+};
+
+/* character classes of the ufields() scanner */
+#define USCH_FIELD_TEXT    0
+#define USCH_FIELD_DELIM   1
+#define USCH_FIELD_NEWLINE 2
+
+USCH_PRIV void priv_usch_fieldscan(const char *p_in, size_t len, const unsigned char *p_class, int flags,
+        ufieldtab *p_tab, size_t *p_num_fields);
+
+/* vectors shorter than this are sorted by a single thread */
+#define USCH_SORT_PARALLEL_MIN (1 << 16)
+/* buckets shorter than this are insertion sorted */
+#define USCH_SORT_INSERTION_MAX 24
+
+/*
+ * Shared state of a multi-threaded usort(): the buckets of the first
+ * distributing pass are handed out to the worker threads.
+ */
+struct priv_usch_sort_job
+{
+    char **pp_strv;
+    char **pp_tmp;
+    unsigned char *p_oracle;
+    size_t depth;
+    size_t bucket_start[257];
+    int next_bucket;
+};
+
+USCH_PRIV void priv_usch_radixsort(char **pp_strv, char **pp_tmp, unsigned char *p_oracle, size_t num, size_t depth);
+
+USCH_PRIV int priv_usch_strcmp_qsort(const void *p_a, const void *p_b);
+
+/*
+ * Prepared pipe-sequence, stored in a single stash item.
+ * pp_argv holds all commands with NULL between them, like
+ * priv_usch_cmd_arr() produces, pp_slots the indexes of USLOT arguments.
+ */
+struct ucmdprep
+{
+    int argc;
+    const char **pp_argv;
+    size_t num_slots;
+    size_t *p_slots;
+};
+
+/*
+ * Deadline of a pipe-sequence started with ucmdopts.timeout_ms.
+ * pgid is 0 until the first command has been started. When p_pids is set
+ * the commands stay in the caller's process group, pgid is -1, and the
+ * num_pids commands not yet reaped are signalled one by one instead.
+ */
+struct priv_usch_timeout
+{
+    long long deadline_ms;
+    long grace_ms;
+    pid_t pgid;
+    int num_signals;
+    pid_t *p_pids;
+    int num_pids;
+};
+
+USCH_PRIV int priv_usch_run(const char **pp_argv,
+                         int input,
+                         int first,
+                         int last,
+                         int *p_child_pid,
+                         struct priv_usch_stash_item **pp_out,
+                         int in_fd,
+                         int out_fd,
+                         const ucmdopts *p_opts,
+                         struct priv_usch_timeout *p_timeout,
+                         int *p_num_calls);
+USCH_PRIV int priv_usch_command(const char **pp_argv, int input, int first, int last, int *p_child_pid, struct priv_usch_stash_item **pp_out, int in_fd, int out_fd, const ucmdopts *p_opts, struct priv_usch_timeout *p_timeout);
+
+USCH_PRIV int priv_usch_waitforall(int n, struct priv_usch_timeout *p_timeout);
+USCH_PRIV USCH_BOOL priv_usch_nextcmd(const char **pp_argv, int argc, int *p_start, int *p_end, int *p_last);
+USCH_PRIV void priv_usch_fwd_handler(int sig);
+USCH_PRIV void priv_usch_fwd_remove(ujob *p_job);
+USCH_PRIV void priv_usch_jobreap(ujob *p_job);
+USCH_PRIV void priv_usch_timeout_expire(struct priv_usch_timeout *p_timeout);
+USCH_PRIV void priv_usch_timeout_kill(struct priv_usch_timeout *p_timeout, int sig);
+
+/*
+ * A pipe-sequence started by ujobstart(), stored in a single stash item
+ * together with p_pids and p_pidfds, -1 where pidfd_open() failed.
+ * out_fd and err_fd are the read ends of ujobstartio(), or -1. forward_slot is the index in
+ * priv_usch_fwd_pgids while signals are forwarded, otherwise -1.
+ * started_all is USCH_FALSE if a command could not be started, the last
+ * pid is then not the one of the last command.
+ */
+struct ujob
+{
+    pid_t pgid;
+    int num_pids;
+    pid_t *p_pids;
+    int *p_pidfds;
+    int out_fd;
+    int err_fd;
+    struct priv_usch_timeout timeout;
+    int forward_slot;
+    USCH_BOOL started_all;
+    USCH_BOOL waited;
+    int status;
+};
+USCH_PRIV int priv_usch_waitpid(int child_pid, int *p_status);
+USCH_PRIV int priv_usch_cd(const char *p_dir);
+USCH_PRIV void priv_usch_pipe(int *p_pipettes);
+USCH_PRIV pid_t priv_usch_spawn(const char **pp_argv, int child_in, int child_out, int child_err, pid_t pgid, const ucmdopts *p_opts);
+USCH_PRIV void priv_usch_exec_child(const char **pp_argv, int child_in, int child_out, int child_err, pid_t pgid, const ucmdopts *p_opts);
+USCH_PRIV pid_t priv_usch_forksrv_spawn(const char **pp_argv, int child_in, int child_out, int child_err, pid_t pgid, const ucmdopts *p_opts);
+USCH_PRIV int priv_usch_forksrv_wait(pid_t pid, struct priv_usch_timeout *p_timeout, int *p_status);
+USCH_PRIV long long priv_usch_now_ms(void);
+USCH_PRIV void priv_usch_timeout_init(struct priv_usch_timeout *p_timeout, const ucmdopts *p_opts);
+USCH_PRIV int priv_usch_timeout_poll(struct priv_usch_timeout *p_timeout, int fd);
+USCH_PRIV int priv_usch_timeout_waitpid(struct priv_usch_timeout *p_timeout, pid_t pid, int *p_status);
+USCH_PRIV long long priv_usch_fdcopy(int in_fd, int out_fd, struct priv_usch_timeout *p_timeout);
+USCH_PRIV void priv_usch_forksrv_loop(int sock);
+USCH_PRIV void priv_usch_forksrv_stop_locked(void);
+USCH_PRIV int priv_usch_pidfd_open(pid_t pid);
+USCH_PRIV int priv_usch_pipeline(const char **pp_argv,
+        int argc,
+        struct priv_usch_stash_item **pp_out,
+        int in_fd,
+        int out_fd,
+        const ucmdopts *p_opts);
+
+#define USCH_FORKSRV_SPAWN 1
+#define USCH_FORKSRV_WAIT  2
+
+#define USCH_FORKSRV_HAS_IN  0x1
+#define USCH_FORKSRV_HAS_OUT 0x2
+#define USCH_FORKSRV_HAS_ERR 0x4
+
+/*
+ * Fork server request, sent with the stdin/stdout file descriptors of the
+ * child attached as SCM_RIGHTS and followed by payload_len bytes of
+ * NUL terminated argv strings, the working directory and environ strings.
+ */
+struct priv_usch_forksrv_msg
+{
+    int type;
+    int pid;
+    int pgid;
+    int fd_mask;
+    int argc;
+    int envc;
+    unsigned long long rlimit_as;
+    unsigned long long rlimit_cpu;
+    size_t payload_len;
+};
+
+/* pid is 0 for a WAIT request on a child that is still running */
+struct priv_usch_forksrv_reply
+{
+    int pid;
+    int status;
+    int err;
+};
+
+
+static int priv_usch_forksrv_fd = -1;
+static pid_t priv_usch_forksrv_pid = -1;
+static pthread_mutex_t priv_usch_forksrv_lock = PTHREAD_MUTEX_INITIALIZER;
+#if defined(__linux__) && defined(CLONE_FS)
+/* USCH_TRUE once "cd" has given the calling thread its own working directory */
+static __thread USCH_BOOL priv_usch_cwd_unshared = USCH_FALSE;
+#endif // __linux__ && CLONE_FS
+
+/*
+ * Hashed snapshot of environ for uenvget() and $VAR expansion. It is
+ * rebuilt when priv_usch_env_generation has moved since
+ * priv_usch_env_built, or when priv_usch_env_changed() sees environ
+ * grow, shrink or move.
+ */
+static ustash priv_usch_env_stash = {NULL};
+static ustrmap *priv_usch_env_map = NULL;
+static uint64_t priv_usch_env_generation = 1;
+static uint64_t priv_usch_env_built = 0;
+static char **priv_usch_env_built_environ = NULL;
+static size_t priv_usch_env_built_num = 0;
+static char *priv_usch_env_built_last = NULL;
+static pthread_mutex_t priv_usch_env_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Process groups of the jobs that ujobforward() sends signals to. Read
+ * by priv_usch_fwd_handler(), so the slots are only accessed atomically.
+ */
+#define USCH_FWD_MAX 64
+static pid_t priv_usch_fwd_pgids[USCH_FWD_MAX];
+static int priv_usch_fwd_count = 0;
+static const int priv_usch_fwd_signals[] = {SIGHUP, SIGINT, SIGQUIT, SIGTERM};
+static struct sigaction priv_usch_fwd_old[sizeof(priv_usch_fwd_signals)/sizeof(int)];
+static pthread_mutex_t priv_usch_fwd_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#if defined(USCH_DEBUG_STASH)
+/*
+ * Allocations not yet freed by uclear(), by the function behind them,
+ * over all stashes. Reported at exit.
+ */
+struct priv_usch_stash_func
+{
+    const char *p_func;
+    size_t num_items;
+    size_t num_bytes;
+};
+#define USCH_DEBUG_STASH_FUNCS 256
+static struct priv_usch_stash_func priv_usch_stash_funcs[USCH_DEBUG_STASH_FUNCS];
+static pthread_mutex_t priv_usch_stash_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t priv_usch_stash_once = PTHREAD_ONCE_INIT;
+#endif // USCH_DEBUG_STASH
+
+#define USCH_FD_READ  0
+#define USCH_FD_WRITE 1
+
+/**************************** implementations ******************************/
+
+USCH_PRIV size_t priv_usch_stash_itemsize(struct priv_usch_stash_item *p_stashitem)
+{
+#if defined(USCH_HAVE_MALLOC_USABLE_SIZE)
+    return malloc_usable_size(p_stashitem);
+#else
+    (void)p_stashitem;
+    return 0;
+#endif // USCH_HAVE_MALLOC_USABLE_SIZE
+}
+
+#if defined(USCH_DEBUG_STASH)
+/*
+ * Count an allocation of p_func in or out of priv_usch_stash_funcs.
+ * Functions are compared by name, every file has its own __func__.
+ */
+USCH_PRIV void priv_usch_stash_count(const char *p_func, size_t size, int add)
+{
+    size_t i;
+
+    pthread_mutex_lock(&priv_usch_stash_lock);
+    for (i = 0; i < USCH_DEBUG_STASH_FUNCS; i++)
+    {
+        struct priv_usch_stash_func *p_entry = &priv_usch_stash_funcs[i];
+
+        if (p_entry->p_func == NULL)
+        {
+            if (!add)
+                break;
+            p_entry->p_func = p_func;
+        }
+        if (strcmp(p_entry->p_func, p_func) != 0)
+            continue;
+        if (add)
+        {
+            p_entry->num_items++;
+            p_entry->num_bytes += size;
+        }
+        else if (p_entry->num_items > 0)
+        {
+            p_entry->num_items--;
+            p_entry->num_bytes -= size < p_entry->num_bytes ? size : p_entry->num_bytes;
+        }
+        break;
+    }
+    pthread_mutex_unlock(&priv_usch_stash_lock);
+}
+
+USCH_PRIV void priv_usch_stash_atexit(void)
+{
+    size_t num_items = 0;
+    size_t num_bytes = 0;
+    size_t i;
+
+    // the environment snapshot is kept on purpose, it is not a leak
+    pthread_mutex_lock(&priv_usch_env_lock);
+    uclear(&priv_usch_env_stash);
+    priv_usch_env_map = NULL;
+    pthread_mutex_unlock(&priv_usch_env_lock);
+
+    pthread_mutex_lock(&priv_usch_stash_lock);
+    for (i = 0; i < USCH_DEBUG_STASH_FUNCS && priv_usch_stash_funcs[i].p_func != NULL; i++)
+    {
+        num_items += priv_usch_stash_funcs[i].num_items;
+        num_bytes += priv_usch_stash_funcs[i].num_bytes;
+    }
+    if (num_items > 0)
+    {
+        fprintf(stderr, "usch: %zu allocations, %zu bytes never freed by uclear()\n", num_items, num_bytes);
+        for (i = 0; i < USCH_DEBUG_STASH_FUNCS && priv_usch_stash_funcs[i].p_func != NULL; i++)
+        {
+            if (priv_usch_stash_funcs[i].num_items == 0)
+                continue;
+            fprintf(stderr, "usch:   %zu allocations, %zu bytes in %s()\n",
+                    priv_usch_stash_funcs[i].num_items,
+                    priv_usch_stash_funcs[i].num_bytes,
+                    priv_usch_stash_funcs[i].p_func);
+        }
+    }
+    pthread_mutex_unlock(&priv_usch_stash_lock);
+}
+
+USCH_PRIV void priv_usch_stash_register(void)
+{
+    atexit(priv_usch_stash_atexit);
+}
+#endif // USCH_DEBUG_STASH
+
+USCH_PRIV int priv_usch_stashfrom(ustash *p_ustash, struct priv_usch_stash_item *p_stashitem, const char *p_func)
+{
+    int status = 0;
+    size_t size;
+
+    if (p_ustash == NULL || p_stashitem == NULL)
+        return -1;
+
+    size = priv_usch_stash_itemsize(p_stashitem);
+#if defined(USCH_DEBUG_STASH)
+    pthread_once(&priv_usch_stash_once, priv_usch_stash_register);
+    p_stashitem->p_func = p_func;
+    priv_usch_stash_count(p_func, size, 1);
+#else
+    (void)p_func;
+#endif // USCH_DEBUG_STASH
+    // num_bytes only grows until uclear(), which updates max_bytes
+    __atomic_add_fetch(&p_ustash->num_bytes, size, __ATOMIC_RELAXED);
+
+    p_stashitem->p_next = __atomic_load_n(&p_ustash->p_list, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&p_ustash->p_list, &p_stashitem->p_next, p_stashitem,
+                                        1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+
+    return status;
+}
+USCH_API int priv_ucmd_impl(int num, const char **pp_args)
+{
+    return priv_ucmdopt_impl(NULL, num, pp_args);
+}
+
+USCH_API int priv_ucmdopt_impl(const ucmdopts *p_opts, int num, const char **pp_args)
+{
+    int i;
+    int status;
+    for (i=0; i < (num - 1); i++)
+    {
+        pp_args[i] = pp_args[i+1]; 
+    }
+    pp_args[num-1] = NULL;
+
+    status = priv_usch_cmd_arr(NULL, NULL, NULL, -1, -1, p_opts, num - 1, pp_args);
+    return status;
+}
+
+USCH_API int priv_ucmdfd_impl(int in_fd, int out_fd, int num, const char **pp_args)
+{
+    int i;
+    int status;
+    for (i=0; i < (num - 1); i++)
+    {
+        pp_args[i] = pp_args[i+1]; 
+    }
+    pp_args[num-1] = NULL;
+
+    status = priv_usch_cmd_arr(NULL, NULL, NULL, in_fd, out_fd, NULL, num - 1, pp_args);
+    return status;
+}
+
+USCH_API char* priv_ustrout_impl(ustash *p_ustash, int num, const char **pp_args)
+{
+    return priv_ustroutopt_impl(p_ustash, NULL, num, pp_args);
+}
+
+USCH_API char* priv_ustroutopt_impl(ustash *p_ustash, const ucmdopts *p_opts, int num, const char **pp_args)
+{
+    int i;
+    static char emptystr[] = "";
+    char *p_strout = emptystr;
+    struct priv_usch_stash_item *p_out = NULL;
+
+    for (i=0; i < (num - 1); i++)
+    {
+        pp_args[i] = pp_args[i+1]; 
+    }
+    pp_args[num-1] = NULL;
+
+    (void)priv_usch_cmd_arr(NULL, &p_out, NULL, -1, -1, p_opts, num - 1, pp_args);
+    // no output item for "cd" or when the command could not be started
+    if (p_out == NULL)
+        goto end;
+    if (priv_usch_stash(p_ustash, p_out) != 0)
+    {
+        fprintf(stderr, "stash failed, ohnoes!\n");
+        goto end;
+    }
+    p_strout = p_out->str;
+    p_out = NULL;
+end:
+    free(p_out);
+    return p_strout;
+}
+
+USCH_API char* priv_ustrjoin_impl(ustash *p_stash,
+                                       int num,
+                                       const char **pp_args)
+{
+    int i;
+    char *p_str;
+    char **pp_nonconst_args = (char **)pp_args;
+    for (i=0; i < (num - 1); i++)
+    {
+        pp_nonconst_args[i] = pp_nonconst_args [i+1]; 
+    }
+    pp_nonconst_args[num-1] = NULL;
+
+    p_str = ustrjoinv(p_stash, (const char **)pp_nonconst_args);
+    return p_str;
+}
+
+USCH_API char* priv_upathjoin_impl(ustash *p_stash,
+                                        int num,
+                                        const char **pp_args)
+{
+    int i;
+    char **pp_nonconst_args = (char **)pp_args;
+    for (i=0; i < (num - 1); i++)
+    {
+        pp_nonconst_args[i] = pp_nonconst_args [i+1];
+    }
+    pp_nonconst_args[num-1] = NULL;
+
+    return upathjoinv(p_stash, (const char **)pp_nonconst_args);
+}
+
+USCH_API char** priv_ustrexp_impl(ustash *p_stash,
+                                       int num,
+                                       const char **pp_args)
+{
+    int i;
+    char **pp_strings;
+    char **pp_nonconst_args = (char **)pp_args;
+    for (i=0; i < (num - 1); i++)
+    {
+        pp_nonconst_args[i] = pp_nonconst_args [i+1]; 
+    }
+    pp_nonconst_args[num-1] = NULL;
+
+    pp_strings = ustrexpv(p_stash, (const char **)pp_nonconst_args);
+    return pp_strings;
+}
+
+USCH_API void uclear(ustash *p_ustash)
+{
+    struct priv_usch_stash_item *p_current = NULL;
+    size_t num_bytes = 0;
+    size_t max_bytes;
+    if (p_ustash == NULL)
+        return;
+    if (p_ustash->p_list == NULL)
+        return;
+
+    max_bytes = __atomic_load_n(&p_ustash->max_bytes, __ATOMIC_RELAXED);
+    num_bytes = __atomic_load_n(&p_ustash->num_bytes, __ATOMIC_RELAXED);
+    while (num_bytes > max_bytes &&
+           !__atomic_compare_exchange_n(&p_ustash->max_bytes, &max_bytes, num_bytes,
+                                        1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+
+    p_current = __atomic_exchange_n(&p_ustash->p_list, NULL, __ATOMIC_ACQUIRE);
+
+    num_bytes = 0;
+    while (p_current != NULL)
+    {
+        struct priv_usch_stash_item *p_prev = p_current;
+        size_t size = priv_usch_stash_itemsize(p_prev);
+
+#if defined(USCH_DEBUG_STASH)
+        priv_usch_stash_count(p_prev->p_func, size, 0);
+#endif // USCH_DEBUG_STASH
+        num_bytes += size;
+        p_current = p_current->p_next;
+        free(p_prev);
+    }
+    __atomic_sub_fetch(&p_ustash->num_bytes, num_bytes, __ATOMIC_RELAXED);
+}
+
+USCH_API void ustashreport(const ustash *p_ustash, FILE *p_file)
+{
+    struct priv_usch_stash_item *p_current;
+    size_t num_items = 0;
+    size_t num_bytes;
+    size_t max_bytes;
+#if defined(USCH_DEBUG_STASH)
+    struct priv_usch_stash_func *p_funcs = NULL;
+    size_t num_funcs = 0;
+    size_t max_funcs = 0;
+    size_t i, j;
+#endif // USCH_DEBUG_STASH
+
+    if (p_ustash == NULL || p_file == NULL)
+        return;
+
+    num_bytes = __atomic_load_n(&p_ustash->num_bytes, __ATOMIC_RELAXED);
+    max_bytes = __atomic_load_n(&p_ustash->max_bytes, __ATOMIC_RELAXED);
+    p_current = __atomic_load_n(&p_ustash->p_list, __ATOMIC_ACQUIRE);
+    for (; p_current != NULL; p_current = p_current->p_next)
+    {
+        num_items++;
+#if defined(USCH_DEBUG_STASH)
+        for (i = 0; i < num_funcs; i++)
+        {
+            if (strcmp(p_funcs[i].p_func, p_current->p_func) == 0)
+                break;
+        }
+        if (i == num_funcs)
+        {
+            if (num_funcs == max_funcs)
+            {
+                struct priv_usch_stash_func *p_tmp;
+                max_funcs = max_funcs ? 2 * max_funcs : 16;
+                p_tmp = (struct priv_usch_stash_func*)realloc(p_funcs, max_funcs * sizeof(*p_funcs));
+                if (p_tmp == NULL)
+                    continue;
+                p_funcs = p_tmp;
+            }
+            p_funcs[num_funcs].p_func = p_current->p_func;
+            p_funcs[num_funcs].num_items = 0;
+            p_funcs[num_funcs].num_bytes = 0;
+            num_funcs++;
+        }
+        p_funcs[i].num_items++;
+        p_funcs[i].num_bytes += priv_usch_stash_itemsize(p_current);
+#endif // USCH_DEBUG_STASH
+    }
+    fprintf(p_file, "ustash: %zu allocations, %zu bytes, high-water mark %zu bytes\n",
+            num_items, num_bytes, num_bytes > max_bytes ? num_bytes : max_bytes);
+#if defined(USCH_DEBUG_STASH)
+    // few functions, sort by selection
+    for (i = 0; i < num_funcs; i++)
+    {
+        struct priv_usch_stash_func tmp;
+        size_t max = i;
+        for (j = i + 1; j < num_funcs; j++)
+        {
+            if (p_funcs[j].num_bytes > p_funcs[max].num_bytes)
+                max = j;
+        }
+        tmp = p_funcs[i];
+        p_funcs[i] = p_funcs[max];
+        p_funcs[max] = tmp;
+        fprintf(p_file, "ustash:   %zu allocations, %zu bytes in %s()\n",
+                p_funcs[i].num_items, p_funcs[i].num_bytes, p_funcs[i].p_func);
+    }
+    free(p_funcs);
+#endif // USCH_DEBUG_STASH
+}
+
+USCH_API char **ustrsplit(ustash *p_ustash, const char* p_in, const char* p_delims)
+{
+    static char* emptyarr[1];
+    struct priv_usch_stash_item *p_stashitem = NULL;
+    char** pp_out = emptyarr;
+    char* p_out = NULL;
     size_t len_in;
     size_t len_delims;
     size_t i, j;
-    size_t num_str = 0;
-    size_t size = 0;
-    int out_pos = 0;
+    size_t num_str = 0;
+    size_t size = 0;
+    int out_pos = 0;
+
+    if (p_ustash == NULL || p_in == NULL || p_delims == NULL)
+        goto end;
+
+    len_in = strlen(p_in);
+    len_delims = strlen(p_delims);
+    num_str = 1;
+    for (i = 0; i < len_in; i++)
+    {
+        for (j = 0; j < len_delims; j++)
+        {
+            if (p_in[i] == p_delims[j])
+            {
+                num_str++;
+            }
+        }
+    }
+
+    size = sizeof(struct priv_usch_stash_item)
+                  + (len_in + 1)  * sizeof(char)
+                  + (num_str + 1) * sizeof(char*);
+    
+    p_stashitem = (struct priv_usch_stash_item*)calloc(size, 1);
+    if (p_stashitem == NULL)
+        goto end;
+
+    pp_out = (char**)p_stashitem->str;
+    p_out = (char*)(pp_out + num_str + 1);
+    memcpy(p_out, p_in, len_in + 1);
+
+    pp_out[out_pos++] = p_out;
+
+    for (i = 0; i < len_in; i++)
+    {
+        for (j = 0; j < len_delims; j++)
+        {
+            if (p_out[i] == p_delims[j])
+            {
+                p_out[i] = '\0';
+                pp_out[out_pos++] = &p_out[i+1];
+            }
+        }
+    }
+
+    if (priv_usch_stash(p_ustash, p_stashitem) != 0)
+    {
+        fprintf(stderr, "stash failed, ohnoes!\n");
+        pp_out = emptyarr;
+        goto end;
+    }
+    p_stashitem = NULL;
+end:
+    free(p_stashitem);
+    return pp_out;
+}
+
+USCH_API char **ustrexpv(ustash *p_ustash, const char **pp_strings)
+{
+    char **pp_strexp = NULL;
+    size_t i;
+    struct priv_usch_stash_item *p_blob = NULL;
+    static char* emptyarr[1];
+    struct priv_usch_glob_list *p_glob_list = NULL;
+    size_t total_len = 0;
+    char **pp_strexp_copy = NULL;
+    const char **pp_strexp_extmem = NULL;
+    size_t pos = 0;
+    size_t num_globbed_args = 0;
+    char *p_strexp_data = NULL;
+    int num_args = 0;
+
+    for (i = 0; pp_strings[i] != NULL; i++)
+    {
+       num_args++; 
+    }
+
+    pp_strexp = emptyarr;
+
+    if (pp_strings == NULL)
+    {
+        goto end;
+    }
+
+    pp_strexp_extmem = priv_usch_globexpand(pp_strings,
+                                            num_args,
+                                            &p_glob_list);
+    if (pp_strexp_extmem == NULL)
+        goto end;
+
+    for (i = 0; pp_strexp_extmem[i] != NULL; i++)
+        total_len += strlen(pp_strexp_extmem[i]) + 1;
+
+    num_globbed_args = i;
+
+    p_blob = (struct priv_usch_stash_item*)calloc(sizeof(struct priv_usch_stash_item)
+                    + (num_globbed_args + 1) * sizeof(char*) + total_len, 1);
+    if (p_blob == NULL)
+        goto end;
+
+    pp_strexp_copy = (char**)p_blob->str;
+    pp_strexp_copy[num_globbed_args] = NULL;
+    p_strexp_data = (char*)&pp_strexp_copy[num_globbed_args+1];
+    // TODO: debug
+    memset(p_strexp_data, 0x0, total_len);
+    for (i = 0; pp_strexp_extmem[i] != NULL; i++)
+    {
+        size_t len = strlen(pp_strexp_extmem[i]);
+
+        pp_strexp_copy[i] = &p_strexp_data[pos];
+        pos += len + 1;
+        memcpy(pp_strexp_copy[i], pp_strexp_extmem[i], len);
+    }
+    if (priv_usch_stash(p_ustash, p_blob) != 0)
+    {
+        fprintf(stderr, "stash failed, ohnoes!\n");
+        goto end;
+    }
+
+    pp_strexp = pp_strexp_copy;
+end:
+    pp_strexp_copy = NULL;
+    priv_usch_free_globlist(p_glob_list);
+    free(pp_strexp_extmem);
+    return pp_strexp;
+}
+
+/*
+ * Find the last component of p_path as p_path[*p_start] up to
+ * p_path[*p_start + *p_len], ignoring trailing slashes.
+ */
+USCH_PRIV void priv_usch_basename_span(const char *p_path, size_t *p_start, size_t *p_len)
+{
+    size_t end = strlen(p_path);
+    size_t start;
+
+    while (end > 1 && p_path[end - 1] == '/')
+        end--;
+    start = end;
+    while (start > 0 && p_path[start - 1] != '/')
+        start--;
+    // "/" and "//" are their own basename
+    if (start == end && end > 0)
+        start = end - 1;
+    *p_start = start;
+    *p_len = end - start;
+}
+
+/*
+ * Length of the directory part of p_path, which is a prefix of p_path
+ * except for "." which is returned in *pp_static.
+ */
+USCH_PRIV size_t priv_usch_dirname_span(const char *p_path, const char **pp_static)
+{
+    size_t start;
+    size_t len;
+
+    *pp_static = NULL;
+    priv_usch_basename_span(p_path, &start, &len);
+    if (start == 0)
+    {
+        if (len > 0 && p_path[0] == '/')
+            return 1;
+        *pp_static = ".";
+        return 1;
+    }
+    // drop the slashes between the directory and the last component
+    len = start;
+    while (len > 1 && p_path[len - 1] == '/')
+        len--;
+    return len;
+}
+
+/*
+ * Test if upathnorm() would leave p_path unchanged.
+ */
+USCH_PRIV USCH_BOOL priv_usch_path_isnorm(const char *p_path)
+{
+    const char *p_pos = p_path;
+    USCH_BOOL absolute = p_path[0] == '/';
+    size_t num_names = 0;
+
+    if (p_path[0] == '\0')
+        return USCH_FALSE;
+    if (absolute)
+        p_pos++;
+    if (ustreq(p_path, ".") || ustreq(p_path, "/"))
+        return USCH_TRUE;
+
+    while (*p_pos != '\0')
+    {
+        const char *p_slash = strchr(p_pos, '/');
+        size_t len = p_slash ? (size_t)(p_slash - p_pos) : strlen(p_pos);
+
+        if (len == 0 || (len == 1 && p_pos[0] == '.'))
+            return USCH_FALSE;
+        if (len == 2 && p_pos[0] == '.' && p_pos[1] == '.')
+        {
+            if (num_names > 0 || absolute)
+                return USCH_FALSE;
+        }
+        else
+        {
+            num_names++;
+        }
+        if (p_slash == NULL)
+            break;
+        // trailing slash
+        if (p_slash[1] == '\0')
+            return USCH_FALSE;
+        p_pos = p_slash + 1;
+    }
+    return USCH_TRUE;
+}
+
+/*
+ * Normalize p_path into p_out, which must hold strlen(p_path) + 2 bytes.
+ * Returns the length of the result.
+ */
+USCH_PRIV size_t priv_usch_path_norm(const char *p_path, char *p_out)
+{
+    const char *p_pos = p_path;
+    USCH_BOOL absolute = p_path[0] == '/';
+    size_t root = absolute ? 1 : 0;
+    size_t out_len = root;
+    size_t num_names = 0;
+
+    if (absolute)
+        p_out[0] = '/';
+
+    while (*p_pos != '\0')
+    {
+        size_t len = strcspn(p_pos, "/");
+
+        if (len == 0 || (len == 1 && p_pos[0] == '.'))
+        {
+            // skip empty and "." components
+        }
+        else if (len == 2 && p_pos[0] == '.' && p_pos[1] == '.')
+        {
+            if (num_names > 0)
+            {
+                while (out_len > root && p_out[out_len - 1] != '/')
+                    out_len--;
+                if (out_len > root)
+                    out_len--;
+                num_names--;
+            }
+            else if (!absolute)
+            {
+                if (out_len > root)
+                    p_out[out_len++] = '/';
+                memcpy(&p_out[out_len], "..", 2);
+                out_len += 2;
+            }
+        }
+        else
+        {
+            if (out_len > root)
+                p_out[out_len++] = '/';
+            memcpy(&p_out[out_len], p_pos, len);
+            out_len += len;
+            num_names++;
+        }
+        p_pos += len;
+        if (*p_pos == '/')
+            p_pos++;
+    }
+    if (out_len == 0)
+        p_out[out_len++] = '.';
+    p_out[out_len] = '\0';
+    return out_len;
+}
+
+USCH_PRIV char *priv_usch_strndup(ustash *p_ustash, const char *p_str, size_t len)
+{
+    static char emptystr[] = "";
+    struct priv_usch_stash_item *p_blob;
+
+    p_blob = (struct priv_usch_stash_item*)calloc(sizeof(struct priv_usch_stash_item) + len + 1, 1);
+    if (p_blob == NULL)
+        return emptystr;
+    memcpy(p_blob->str, p_str, len);
+    if (priv_usch_stash(p_ustash, p_blob) != 0)
+    {
+        fprintf(stderr, "stash failed, ohnoes!\n");
+        free(p_blob);
+        return emptystr;
+    }
+    return p_blob->str;
+}
+
+USCH_API char *udirname(ustash *p_ustash, const char *p_str)
+{
+    static char emptystr[] = "";
+    static char dotstr[] = ".";
+    const char *p_static;
+    size_t len;
+
+    if (p_ustash == NULL || p_str == NULL || p_str[0] == '\0')
+        return emptystr;
+
+    len = priv_usch_dirname_span(p_str, &p_static);
+    if (p_static != NULL)
+        return dotstr;
+    return priv_usch_strndup(p_ustash, p_str, len);
+}
+
+USCH_API char *ubasename(ustash *p_ustash, const char *p_path)
+{
+    static char emptystr[] = "";
+    size_t start;
+    size_t len;
+
+    if (p_ustash == NULL || p_path == NULL)
+        return emptystr;
+
+    priv_usch_basename_span(p_path, &start, &len);
+    if (p_path[start + len] == '\0')
+        return (char*)&p_path[start];
+    return priv_usch_strndup(p_ustash, &p_path[start], len);
+}
+
+USCH_API const char *uext(const char *p_path)
+{
+    const char *p_end;
+    const char *p_pos;
+
+    if (p_path == NULL)
+        return "";
+
+    p_end = p_path + strlen(p_path);
+    if (p_end > p_path && p_end[-1] == '/')
+        return p_end;
+    for (p_pos = p_end; p_pos > p_path && p_pos[-1] != '/'; p_pos--)
+        ;
+    // leading dots belong to the name
+    while (*p_pos == '.')
+        p_pos++;
+    p_pos = strrchr(p_pos, '.');
+    return p_pos ? p_pos : p_end;
+}
+
+USCH_API char *upathjoinv(ustash *p_ustash, const char **pp_parts)
+{
+    static char emptystr[] = "";
+    char *p_path = emptystr;
+    char *p_dststr;
+    struct priv_usch_stash_item *p_blob = NULL;
+    size_t total_len = 0;
+    size_t i;
+
+    if (p_ustash == NULL || pp_parts == NULL)
+        goto end;
+
+    for (i = 0; pp_parts[i] != NULL; i++)
+        total_len += strlen(pp_parts[i]) + 1;
+
+    p_blob = (struct priv_usch_stash_item*)calloc(sizeof(struct priv_usch_stash_item) + total_len + 1, 1);
+    if (p_blob == NULL)
+        goto end;
+
+    p_dststr = p_blob->str;
+    for (i = 0; pp_parts[i] != NULL; i++)
+    {
+        const char *p_part = pp_parts[i];
+        size_t len;
+
+        if (p_dststr != p_blob->str)
+        {
+            while (*p_part == '/')
+                p_part++;
+        }
+        len = strlen(p_part);
+        while (len > 1 && p_part[len - 1] == '/')
+            len--;
+        if (len == 0)
+            continue;
+        if (p_dststr != p_blob->str && p_dststr[-1] != '/')
+            *p_dststr++ = '/';
+        memcpy(p_dststr, p_part, len);
+        p_dststr += len;
+    }
+    *p_dststr = '\0';
+
+    if (priv_usch_stash(p_ustash, p_blob) != 0)
+    {
+        fprintf(stderr, "stash failed, ohnoes!\n");
+        goto end;
+    }
+    p_path = p_blob->str;
+    p_blob = NULL;
+end:
+    free(p_blob);
+    return p_path;
+}
+
+USCH_API char *upathnorm(ustash *p_ustash, const char *p_path)
+{
+    static char dotstr[] = ".";
+    struct priv_usch_stash_item *p_blob;
+
+    if (p_ustash == NULL || p_path == NULL || p_path[0] == '\0')
+        return dotstr;
+    if (priv_usch_path_isnorm(p_path))
+        return (char*)p_path;
+
+    p_blob = (struct priv_usch_stash_item*)calloc(sizeof(struct priv_usch_stash_item) + strlen(p_path) + 2, 1);
+    if (p_blob == NULL)
+        return (char*)p_path;
+    priv_usch_path_norm(p_path, p_blob->str);
+    if (priv_usch_stash(p_ustash, p_blob) != 0)
+    {
+        fprintf(stderr, "stash failed, ohnoes!\n");
+        free(p_blob);
+        return (char*)p_path;
+    }
+    return p_blob->str;
+}
+
+USCH_API char *urealpath(ustash *p_ustash, const char *p_path)
+{
+    static char emptystr[] = "";
+    char real[PATH_MAX];
+
+    if (p_ustash == NULL || p_path == NULL)
+    {
+        errno = EINVAL;
+        return emptystr;
+    }
+    if (realpath(p_path, real) == NULL)
+        return emptystr;
+    return priv_usch_strndup(p_ustash, real, strlen(real));
+}
+
+/*
+ * Shared implementation of udirnamev(), ubasenamev() and upathnormv().
+ * The first pass finds which results are views into pp_paths and how
+ * much must be copied, the second fills a single blob.
+ */
+USCH_PRIV char **priv_usch_pathv(ustash *p_ustash, char **pp_paths, enum priv_usch_pathop op)
+{
+    static char *emptyarr[1];
+    char **pp_out = emptyarr;
+    struct priv_usch_stash_item *p_blob = NULL;
+    char *p_dststr;
+    size_t num = 0;
+    size_t total_len = 0;
+    size_t i;
+
+    if (p_ustash == NULL || pp_paths == NULL)
+        goto end;
+
+    for (num = 0; pp_paths[num] != NULL; num++)
+    {
+        const char *p_path = pp_paths[num];
+        if (op == USCH_PATH_NORM)
+        {
+            if (!priv_usch_path_isnorm(p_path))
+                total_len += strlen(p_path) + 2;
+        }
+        else if (op == USCH_PATH_BASENAME)
+        {
+            size_t start, len;
+            priv_usch_basename_span(p_path, &start, &len);
+            if (p_path[start + len] != '\0')
+                total_len += len + 1;
+        }
+        else
+        {
+            const char *p_static;
+            size_t len = priv_usch_dirname_span(p_path, &p_static);
+            if (p_path[0] != '\0' && p_static == NULL)
+                total_len += len + 1;
+        }
+    }
+
+    p_blob = (struct priv_usch_stash_item*)calloc(sizeof(struct priv_usch_stash_item)
+                    + (num + 1) * sizeof(char*) + total_len, 1);
+    if (p_blob == NULL)
+        goto end;
+
+    p_dststr = (char*)((char**)p_blob->str + num + 1);
+    for (i = 0; i < num; i++)
+    {
+        char *p_path = pp_paths[i];
+        char **pp_dst = &((char**)p_blob->str)[i];
+        if (op == USCH_PATH_NORM)
+        {
+            if (priv_usch_path_isnorm(p_path))
+            {
+                *pp_dst = p_path;
+                continue;
+            }
+            *pp_dst = p_dststr;
+            p_dststr += priv_usch_path_norm(p_path, p_dststr) + 1;
+        }
+        else if (op == USCH_PATH_BASENAME)
+        {
+            size_t start, len;
+            priv_usch_basename_span(p_path, &start, &len);
+            if (p_path[start + len] == '\0')
+            {
+                *pp_dst = &p_path[start];
+                continue;
+            }
+            *pp_dst = p_dststr;
+            memcpy(p_dststr, &p_path[start], len);
+            p_dststr += len + 1;
+        }
+        else
+        {
+            const char *p_static;
+            size_t len = priv_usch_dirname_span(p_path, &p_static);
+            if (p_path[0] == '\0')
+            {
+                *pp_dst = p_path;
+                continue;
+            }
+            if (p_static != NULL)
+            {
+                *pp_dst = (char*)p_static;
+                continue;
+            }
+            *pp_dst = p_dststr;
+            memcpy(p_dststr, p_path, len);
+            p_dststr += len + 1;
+        }
+    }
+
+    if (priv_usch_stash(p_ustash, p_blob) != 0)
+    {
+        fprintf(stderr, "stash failed, ohnoes!\n");
+        goto end;
+    }
+    pp_out = (char**)p_blob->str;
+    p_blob = NULL;
+end:
+    free(p_blob);
+    return pp_out;
+}
+
+USCH_API char **udirnamev(ustash *p_ustash, char **pp_paths)
+{
+    return priv_usch_pathv(p_ustash, pp_paths, USCH_PATH_DIRNAME);
+}
+
+USCH_API char **ubasenamev(ustash *p_ustash, char **pp_paths)
+{
+    return priv_usch_pathv(p_ustash, pp_paths, USCH_PATH_BASENAME);
+}
+
+USCH_API char **upathnormv(ustash *p_ustash, char **pp_paths)
+{
+    return priv_usch_pathv(p_ustash, pp_paths, USCH_PATH_NORM);
+}
+
+USCH_API char **urealpathv(ustash *p_ustash, char **pp_paths)
+{
+    static char *emptyarr[1];
+    char **pp_out = emptyarr;
+    struct priv_usch_stash_item *p_blob = NULL;
+    char *p_buf = NULL;
+    char *p_dststr;
+    size_t buf_len = 0;
+    size_t buf_size = 0;
+    size_t num;
+    size_t i;
+    char real[PATH_MAX];
+
+    if (p_ustash == NULL || pp_paths == NULL)
+        goto end;
+
+    // resolve into a scratch buffer first, realpath() is too costly to call twice
+    for (num = 0; pp_paths[num] != NULL; num++)
+    {
+        size_t len = 0;
+        if (realpath(pp_paths[num], real) != NULL)
+            len = strlen(real);
+        if (buf_len + len + 1 > buf_size)
+        {
+            char *p_tmp;
+            buf_size = 2 * (buf_len + len + 1) + PATH_MAX;
+            p_tmp = (char*)realloc(p_buf, buf_size);
+            if (p_tmp == NULL)
+                goto end;
+            p_buf = p_tmp;
+        }
+        memcpy(&p_buf[buf_len], real, len);
+        p_buf[buf_len + len] = '\0';
+        buf_len += len + 1;
+    }
+
+    p_blob = (struct priv_usch_stash_item*)calloc(sizeof(struct priv_usch_stash_item)
+                    + (num + 1) * sizeof(char*) + buf_len, 1);
+    if (p_blob == NULL)
+        goto end;
+
+    p_dststr = (char*)((char**)p_blob->str + num + 1);
+    if (buf_len > 0)
+        memcpy(p_dststr, p_buf, buf_len);
+    for (i = 0; i < num; i++)
+    {
+        ((char**)p_blob->str)[i] = p_dststr;
+        p_dststr += strlen(p_dststr) + 1;
+    }
+
+    if (priv_usch_stash(p_ustash, p_blob) != 0)
+    {
+        fprintf(stderr, "stash failed, ohnoes!\n");
+        goto end;
+    }
+    pp_out = (char**)p_blob->str;
+    p_blob = NULL;
+end:
+    free(p_blob);
+    free(p_buf);
+    return pp_out;
+}
+
+USCH_API char *ustrtrim(ustash *p_ustash, const char *p_str)
+{
+    static char emptystr[] = "\0";
+    char *p_trim = emptystr;
+    struct priv_usch_stash_item* p_blob = NULL;
+    size_t start = 0;
+    size_t end;
+
+    if (p_str == NULL)
+        goto end;
+
+    end = strlen(p_str);
+    while (start < end && p_str[start] == ' ')
+    {
+        start++;
+    }
+    while (end > start && p_str[end - 1] == ' ')
+    {
+        end--;
+    }
+
+    p_blob = (struct priv_usch_stash_item*)calloc(end - start + 1 + sizeof(struct priv_usch_stash_item), 1);
+    if (p_blob == NULL)
+        goto end;
+    memcpy(p_blob->str, &p_str[start], end - start);
+    p_blob->str[end - start] = '\0';
+
+    if (priv_usch_stash(p_ustash, p_blob) != 0)
+    {
+        fprintf(stderr, "stash failed, ohnoes!\n");
+        goto end;
+    }
+    p_trim = p_blob->str;
+    p_blob = NULL;
+end:
+    free(p_blob);
+    return p_trim;
+}
+
+USCH_API char *ustrjoinv(ustash *p_ustash, const char **pp_strings)
+{
+    static char emptystr[] = "";
+    char *p_strjoin_retval = emptystr;
+    char *p_dststr = NULL;
+
+    size_t i;
+    struct priv_usch_stash_item *p_blob = NULL;
+    size_t total_len = 0;
+
+    p_strjoin_retval = emptystr;
+
+    if (pp_strings == NULL)
+    {
+        goto end;
+    }
+    for (i = 0; pp_strings[i] != NULL; i++)
+    {
+        total_len += strlen(pp_strings[i]);
+    }
+
+    p_blob = (struct priv_usch_stash_item*)calloc(sizeof(struct priv_usch_stash_item) + sizeof(char) * total_len + 1, 1);
+    if (p_blob == NULL)
+        goto end;
+
+    p_dststr = p_blob->str; 
+
+    for (i = 0; pp_strings[i] != NULL; i++)
+    {
+        size_t len = strlen(pp_strings[i]);
+        memcpy(p_dststr, pp_strings[i], len);
+        p_dststr += len;
+    }
+
+    *p_dststr = '\0';
+
+    if (priv_usch_stash(p_ustash, p_blob) != 0)
+    {
+        fprintf(stderr, "stash failed, ohnoes!\n");
+        goto end;
+    }
+
+    p_strjoin_retval = p_blob->str;
+end:
+    return p_strjoin_retval;
+}
+
+
+USCH_API char *ustrreplace(ustash *p_ustash, const char *p_str, const char *p_old, const char *p_new)
+{
+    static char emptystr[] = "";
+    char *p_replaced = emptystr;
+    char *p_dststr;
+    const char *p_pos;
+    const char *p_hit;
+    struct priv_usch_stash_item *p_blob = NULL;
+    size_t old_len;
+    size_t new_len;
+    size_t total_len;
+    size_t num_hits = 0;
+
+    if (p_ustash == NULL || p_str == NULL || p_old == NULL || p_new == NULL || p_old[0] == '\0')
+        goto end;
+
+    old_len = strlen(p_old);
+    new_len = strlen(p_new);
+    for (p_pos = p_str; (p_hit = strstr(p_pos, p_old)) != NULL; p_pos = p_hit + old_len)
+        num_hits++;
+    total_len = (size_t)(p_pos - p_str) + strlen(p_pos) + num_hits * new_len - num_hits * old_len;
+
+    p_blob = (struct priv_usch_stash_item*)calloc(sizeof(struct priv_usch_stash_item) + total_len + 1, 1);
+    if (p_blob == NULL)
+        goto end;
+
+    p_dststr = p_blob->str;
+    for (p_pos = p_str; num_hits > 0; num_hits--)
+    {
+        p_hit = strstr(p_pos, p_old);
+        memcpy(p_dststr, p_pos, (size_t)(p_hit - p_pos));
+        p_dststr += p_hit - p_pos;
+        memcpy(p_dststr, p_new, new_len);
+        p_dststr += new_len;
+        p_pos = p_hit + old_len;
+    }
+    strcpy(p_dststr, p_pos);
+
+    if (priv_usch_stash(p_ustash, p_blob) != 0)
+    {
+        fprintf(stderr, "stash failed, ohnoes!\n");
+        goto end;
+    }
+    p_replaced = p_blob->str;
+    p_blob = NULL;
+end:
+    free(p_blob);
+    return p_replaced;
+}
+
+USCH_API char *ustrvfmt(ustash *p_ustash, const char *p_fmt, va_list args)
+{
+    static char emptystr[] = "";
+    char *p_formatted = emptystr;
+    struct priv_usch_stash_item *p_blob = NULL;
+    va_list measure_args;
+    int len;
+
+    if (p_ustash == NULL || p_fmt == NULL)
+        goto end;
+
+    va_copy(measure_args, args);
+    len = vsnprintf(NULL, 0, p_fmt, measure_args);
+    va_end(measure_args);
+    if (len < 0)
+        goto end;
+
+    p_blob = (struct priv_usch_stash_item*)calloc(sizeof(struct priv_usch_stash_item) + (size_t)len + 1, 1);
+    if (p_blob == NULL)
+        goto end;
+    vsnprintf(p_blob->str, (size_t)len + 1, p_fmt, args);
+
+    if (priv_usch_stash(p_ustash, p_blob) != 0)
+    {
+        fprintf(stderr, "stash failed, ohnoes!\n");
+        goto end;
+    }
+    p_formatted = p_blob->str;
+    p_blob = NULL;
+end:
+    free(p_blob);
+    return p_formatted;
+}
+
+USCH_API char *ustrfmt(ustash *p_ustash, const char *p_fmt, ...)
+{
+    char *p_formatted;
+    va_list args;
+
+    va_start(args, p_fmt);
+    p_formatted = ustrvfmt(p_ustash, p_fmt, args);
+    va_end(args);
+    return p_formatted;
+}
+
+USCH_PRIV int priv_usch_cached_whereis(char** pp_cached_path, int path_items, char* p_search_item, char** pp_dest)
+{
+    int status = 0;
+    size_t i;
+    char *p_dest = NULL;
+    char **pp_path = NULL;
+    char **pp_relarray = NULL;
+    size_t num_items = 0;
+    char *p_item = NULL;
+    char *p_item_copy = NULL;
+    char *p_slash = NULL;
+    size_t item_length = strlen(p_search_item);
+
+    // like execvp(), a name with a slash is not looked up in PATH
+    if (strchr(p_search_item, '/') != NULL)
+    {
+        pp_relarray = (char**)calloc(1, sizeof(char*));
+        if (pp_relarray == NULL)
+        {
+            status = -1;
+            goto end;
+        }
+        p_item_copy = (char*)calloc(item_length + 1, 1);
+        if (p_item_copy == NULL)
+        {
+            status = -1;
+            goto end;
+        }
+        memcpy(p_item_copy, p_search_item, item_length + 1);
+
+        p_slash = strrchr(p_item_copy, '/');
+        *p_slash = '\0';
+
+        pp_relarray[0] = p_item_copy;
+        pp_path = pp_relarray;
+        num_items = 1;
+        p_item = p_slash + 1;
+    }
+    else
+    {
+        p_item = p_search_item;
+        pp_path = pp_cached_path;
+        num_items = path_items;
+    }
+    item_length = strlen(p_item);
+
+    for (i = 0; i < num_items; i++)
+    {
+        size_t dir_length = strlen(pp_path[i]);
+        char new_path[dir_length + 1 + item_length + 1];
+        struct stat sb;
+
+        memcpy(new_path, pp_path[i], dir_length);
+        new_path[dir_length] = '/';
+        memcpy(&new_path[dir_length + 1], p_item, item_length);
+        new_path[dir_length + 1 + item_length] = '\0';
+        if (stat(new_path, &sb) == -1)
+            continue;
+        if (!S_ISREG(sb.st_mode) || access(new_path, X_OK) != 0)
+            continue;
+
+        status = 1;
+        p_dest = (char*)malloc(dir_length + 1 + item_length + 1);
+        if (p_dest == NULL)
+        {
+            status = -1;
+            goto end;
+        }
+        memcpy(p_dest, new_path, dir_length + 1 + item_length + 1);
+        *pp_dest = p_dest;
+        p_dest = NULL;
+        goto end;
+    }
+end:
+    free(pp_relarray);
+    free(p_item_copy);
+    free(p_dest);
+
+    return status;
+}
+
+/*
+ * Test in constant time if the snapshot may be stale. Adding a variable
+ * moves the NULL at the end of environ or reallocates it, removing one
+ * moves the last entry down. Only a value replaced in place is missed,
+ * uenvrefresh() is for that.
+ * Must be called with priv_usch_env_lock held.
+ */
+USCH_PRIV USCH_BOOL priv_usch_env_changed(void)
+{
+    extern char **environ;
+    size_t num = priv_usch_env_built_num;
+
+    if (priv_usch_env_map == NULL || priv_usch_env_built != priv_usch_env_generation)
+        return USCH_TRUE;
+    if (environ != priv_usch_env_built_environ)
+        return USCH_TRUE;
+    if (environ == NULL)
+        return USCH_FALSE;
+    return environ[num] != NULL || (num > 0 && environ[num - 1] != priv_usch_env_built_last);
+}
+
+/*
+ * Return the environ snapshot, rebuilding it if needed.
+ * Must be called with priv_usch_env_lock held.
+ */
+USCH_PRIV ustrmap *priv_usch_env_snapshot(void)
+{
+    extern char **environ;
+    struct priv_usch_stash_item *p_names = NULL;
+    ustrmap *p_map;
+    char *p_name;
+    size_t num = 0;
+    size_t total_len = 0;
+    size_t i;
+
+    if (!priv_usch_env_changed())
+        return priv_usch_env_map;
+
+    uclear(&priv_usch_env_stash);
+    priv_usch_env_map = NULL;
+
+    for (i = 0; environ != NULL && environ[i] != NULL; i++)
+    {
+        const char *p_eq = strchr(environ[i], '=');
+        if (p_eq != NULL)
+            total_len += (size_t)(p_eq - environ[i]) + 1;
+        num++;
+    }
+
+    p_map = ustrmapnew(&priv_usch_env_stash, num);
+    if (p_map == NULL)
+        return NULL;
+    p_names = (struct priv_usch_stash_item*)calloc(sizeof(struct priv_usch_stash_item) + total_len + 1, 1);
+    if (p_names == NULL)
+        return NULL;
+    if (priv_usch_stash(&priv_usch_env_stash, p_names) != 0)
+    {
+        free(p_names);
+        return NULL;
+    }
+
+    p_name = p_names->str;
+    for (i = 0; i < num; i++)
+    {
+        const char *p_eq = strchr(environ[i], '=');
+        size_t len;
+        if (p_eq == NULL)
+            continue;
+        len = (size_t)(p_eq - environ[i]);
+        memcpy(p_name, environ[i], len);
+        p_name[len] = '\0';
+        // the first entry wins, like getenv()
+        if (ustrmapget(p_map, p_name) == NULL)
+        {
+            if (ustrmapset(p_map, p_name, p_eq + 1) < 0)
+                return NULL;
+        }
+        p_name += len + 1;
+    }
+
+    priv_usch_env_map = p_map;
+    priv_usch_env_built = priv_usch_env_generation;
+    priv_usch_env_built_environ = environ;
+    priv_usch_env_built_num = num;
+    priv_usch_env_built_last = num > 0 ? environ[num - 1] : NULL;
+    return p_map;
+}
+
+USCH_PRIV const char *priv_usch_env_lookup(ustrmap *p_map, const char *p_name, size_t len)
+{
+    char name[256];
+    char *p_key = name;
+    const char *p_value;
+
+    if (len >= sizeof(name))
+    {
+        p_key = (char*)malloc(len + 1);
+        if (p_key == NULL)
+            return NULL;
+    }
+    memcpy(p_key, p_name, len);
+    p_key[len] = '\0';
+    p_value = ustrmapget(p_map, p_key);
+    if (p_key != name)
+        free(p_key);
+    return p_value;
+}
+
+/*
+ * Expand $NAME and ${NAME} of p_str into p_out, or only measure when
+ * p_out is NULL. Returns the length of the result.
+ * Must be called with priv_usch_env_lock held.
+ */
+USCH_PRIV size_t priv_usch_envexpand(ustrmap *p_map, const char *p_str, char *p_out)
+{
+    const char *p_pos = p_str;
+    size_t out_len = 0;
+
+    while (*p_pos != '\0')
+    {
+        const char *p_dollar = strchr(p_pos, '$');
+        const char *p_name;
+        const char *p_value = NULL;
+        size_t copy_len;
+        size_t name_len = 0;
+        USCH_BOOL braced;
+
+        if (p_dollar == NULL)
+            p_dollar = p_pos + strlen(p_pos);
+        copy_len = (size_t)(p_dollar - p_pos);
+        if (*p_dollar == '$' && p_dollar > p_pos && p_dollar[-1] == '\\')
+        {
+            // "\$" is a literal '$', drop the backslash
+            if (p_out != NULL)
+            {
+                memcpy(&p_out[out_len], p_pos, copy_len - 1);
+                p_out[out_len + copy_len - 1] = '$';
+            }
+            out_len += copy_len;
+            p_pos = p_dollar + 1;
+            continue;
+        }
+        if (p_out != NULL)
+            memcpy(&p_out[out_len], p_pos, copy_len);
+        out_len += copy_len;
+        p_pos += copy_len;
+        if (*p_pos != '$')
+            continue;
+
+        braced = p_pos[1] == '{';
+        p_name = p_pos + (braced ? 2 : 1);
+        if (isalpha((unsigned char)p_name[0]) || p_name[0] == '_')
+        {
+            while (isalnum((unsigned char)p_name[name_len]) || p_name[name_len] == '_')
+                name_len++;
+        }
+        if (name_len > 0 && (!braced || p_name[name_len] == '}'))
+            p_value = priv_usch_env_lookup(p_map, p_name, name_len);
+
+        if (p_value == NULL)
+        {
+            // not a reference to a set variable, keep the '$'
+            if (p_out != NULL)
+                p_out[out_len] = '$';
+            out_len++;
+            p_pos++;
+            continue;
+        }
+        copy_len = strlen(p_value);
+        if (p_out != NULL)
+            memcpy(&p_out[out_len], p_value, copy_len);
+        out_len += copy_len;
+        p_pos = p_name + name_len + (braced ? 1 : 0);
+    }
+    if (p_out != NULL)
+        p_out[out_len] = '\0';
+    return out_len;
+}
+
+/* expand p_str into a malloc'ed string at offset header, or return NULL */
+USCH_PRIV char *priv_usch_envexpand_alloc(const char *p_str, size_t header)
+{
+    char *p_buf = NULL;
+    ustrmap *p_map;
+
+    pthread_mutex_lock(&priv_usch_env_lock);
+    p_map = priv_usch_env_snapshot();
+    if (p_map != NULL)
+    {
+        p_buf = (char*)calloc(header + priv_usch_envexpand(p_map, p_str, NULL) + 1, 1);
+        if (p_buf != NULL)
+            priv_usch_envexpand(p_map, p_str, p_buf + header);
+    }
+    pthread_mutex_unlock(&priv_usch_env_lock);
+    return p_buf;
+}
+
+USCH_API const char *uenvget(const char *p_name)
+{
+    const char *p_value = NULL;
+    ustrmap *p_map;
+
+    if (p_name == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&priv_usch_env_lock);
+    p_map = priv_usch_env_snapshot();
+    if (p_map != NULL)
+        p_value = ustrmapget(p_map, p_name);
+    else
+        p_value = getenv(p_name);
+    pthread_mutex_unlock(&priv_usch_env_lock);
+    return p_value;
+}
+
+USCH_API int uenvset(const char *p_name, const char *p_value)
+{
+    int res;
+
+    if (p_name == NULL || p_value == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&priv_usch_env_lock);
+    res = setenv(p_name, p_value, 1);
+    priv_usch_env_generation++;
+    pthread_mutex_unlock(&priv_usch_env_lock);
+    return res;
+}
+
+USCH_API int uenvunset(const char *p_name)
+{
+    int res;
+
+    if (p_name == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&priv_usch_env_lock);
+    res = unsetenv(p_name);
+    priv_usch_env_generation++;
+    pthread_mutex_unlock(&priv_usch_env_lock);
+    return res;
+}
+
+USCH_API void uenvrefresh(void)
+{
+    pthread_mutex_lock(&priv_usch_env_lock);
+    priv_usch_env_generation++;
+    pthread_mutex_unlock(&priv_usch_env_lock);
+}
+
+USCH_API char *uenvexpand(ustash *p_ustash, const char *p_str)
+{
+    static char emptystr[] = "";
+    struct priv_usch_stash_item *p_blob;
+
+    if (p_ustash == NULL || p_str == NULL)
+        return emptystr;
+
+    p_blob = (struct priv_usch_stash_item*)priv_usch_envexpand_alloc(p_str, offsetof(struct priv_usch_stash_item, str));
+    if (p_blob == NULL)
+        return emptystr;
+    if (priv_usch_stash(p_ustash, p_blob) != 0)
+    {
+        fprintf(stderr, "stash failed, ohnoes!\n");
+        free(p_blob);
+        return emptystr;
+    }
+    return p_blob->str;
+}
+
+USCH_PRIV const char **priv_usch_globexpand(const char **pp_orig_argv, size_t num_args, struct priv_usch_glob_list **pp_glob_list)
+{
+    const char **pp_expanded_argv = NULL;
+    struct priv_usch_glob_list *p_glob_list = NULL;
+    struct priv_usch_glob_list *p_current_glob_item = NULL;
+    size_t i, j;
+    int orig_arg_idx = 0;
+    int num_glob_items = 0;
+
+    for (i = 0; i < num_args; i++)
+    {
+        if (strcmp(pp_orig_argv[i], "--") == 0)
+        {
+            orig_arg_idx++;
+            break;
+        }
+
+        if (p_current_glob_item == NULL)
+        {
+            p_current_glob_item = (struct priv_usch_glob_list*)calloc(1, sizeof(struct priv_usch_glob_list));
+            if (p_current_glob_item == NULL)
+                goto end;
+            p_glob_list = p_current_glob_item;
+        }
+        else
+        {
+            p_current_glob_item->p_next = (struct priv_usch_glob_list*)calloc(1, sizeof(struct priv_usch_glob_list));
+            if (p_current_glob_item->p_next == NULL)
+                goto end;
+            p_current_glob_item = p_current_glob_item->p_next;
+        }
+        if (strchr(pp_orig_argv[i], '$') != NULL)
+        {
+            char *p_expanded = priv_usch_envexpand_alloc(pp_orig_argv[i], 0);
+            int res;
+            if (p_expanded == NULL)
+                goto end;
+            res = glob(p_expanded, GLOB_MARK | GLOB_NOCHECK | GLOB_TILDE | GLOB_NOMAGIC | GLOB_BRACE, NULL, &p_current_glob_item->glob_data);
+            free(p_expanded);
+            if (res != 0)
+                goto end;
+        }
+        else if (glob(pp_orig_argv[i], GLOB_MARK | GLOB_NOCHECK | GLOB_TILDE | GLOB_NOMAGIC | GLOB_BRACE, NULL, &p_current_glob_item->glob_data) != 0)
+        {
+            goto end;
+        }
+        num_glob_items += p_current_glob_item->glob_data.gl_pathc;
+        orig_arg_idx++;
+    }
+    pp_expanded_argv = (const char**)calloc(num_glob_items + num_args - orig_arg_idx + 1, sizeof(char*));
+    if (pp_expanded_argv == NULL)
+        goto end;
+    p_current_glob_item = p_glob_list;
+
+    i = 0;
+    j = 0;
+    while (p_current_glob_item != NULL)
+    {
+        for (j = 0; j < p_current_glob_item->glob_data.gl_pathc; j++, i++)
+        {
+            pp_expanded_argv[i] = p_current_glob_item->glob_data.gl_pathv[j];
+        }
+        p_current_glob_item = p_current_glob_item->p_next;
+    }
+
+    // the arguments after "--" are passed as they are
+    for (j = orig_arg_idx; j < num_args; j++, i++)
+    {
+        pp_expanded_argv[i] = pp_orig_argv[j];
+    }
+    *pp_glob_list = p_glob_list;
+    p_glob_list = NULL;
+
+end:
+    priv_usch_free_globlist(p_glob_list);
+    return pp_expanded_argv;
+}
+USCH_PRIV void
+priv_usch_free_globlist(struct priv_usch_glob_list *p_glob_list)
+{
+    if (p_glob_list)
+    {
+        struct priv_usch_glob_list *p_current_glob_item = p_glob_list;
+        while (p_current_glob_item != NULL)
+        {
+            struct priv_usch_glob_list *p_free_glob_item = p_current_glob_item;
+
+            p_current_glob_item = p_current_glob_item->p_next;
+
+            globfree(&p_free_glob_item->glob_data);
+            free(p_free_glob_item);
+        }
+    }
+}
+
+USCH_PRIV int priv_usch_cmd_arr(struct priv_usch_stash_item **pp_in,
+        struct priv_usch_stash_item **pp_out,
+        struct priv_usch_stash_item **pp_err,
+        int in_fd,
+        int out_fd,
+        const ucmdopts *p_opts,
+        size_t num_args,
+        const char **pp_orig_argv)
+{
+    (void)pp_in;
+    (void)pp_err;
+    struct priv_usch_glob_list *p_glob_list = NULL;
+    const char **pp_argv = NULL;
+    int argc = 0;
+    int status = 0;
+
+    pp_argv = priv_usch_globexpand(pp_orig_argv, num_args, &p_glob_list);
+    if (pp_argv == NULL)
+        goto end;
+
+    while (pp_argv[argc] != NULL)
+    {
+        if (*pp_argv[argc] == '|')
+        {
+            pp_argv[argc] = NULL;
+        }
+        argc++;
+    }
+
+    if (ustreq(pp_argv[0], "cd"))
+    {
+        status = priv_usch_cd(pp_argv[1]);
+    }
+    else
+    {
+        status = priv_usch_pipeline(pp_argv, argc, pp_out, in_fd, out_fd, p_opts);
+    }
+end:
+    priv_usch_free_globlist(p_glob_list);
+    free(pp_argv);
+
+    return status;
+}
+
+/*
+ * The "cd" builtin. On Linux the calling thread first stops sharing its
+ * working directory with unshare(CLONE_FS), so the change is seen by this
+ * thread and the threads it creates later, but not by any other thread.
+ */
+USCH_PRIV int priv_usch_cd(const char *p_dir)
+{
+    if (p_dir == NULL)
+        p_dir = getenv("HOME");
+    if (p_dir == NULL)
+    {
+        fprintf(stderr, "usch: cd: HOME not set\n");
+        return 1;
+    }
+#if defined(__linux__) && defined(CLONE_FS)
+    if (!priv_usch_cwd_unshared)
+    {
+        if (unshare(CLONE_FS) != 0)
+        {
+            perror("usch: cd");
+            return 1;
+        }
+        priv_usch_cwd_unshared = USCH_TRUE;
+    }
+#else
+    fprintf(stderr, "usch: cd: not supported here, use ucmdopts.p_cwd\n");
+    return 1;
+#endif // __linux__ && CLONE_FS
+    if (chdir(p_dir) != 0)
+    {
+        fprintf(stderr, "usch: cd: %s: %s\n", p_dir, strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Run a pipe-sequence where the commands in pp_argv are separated by NULL,
+ * argc is the total number of entries including the separators.
+ */
+USCH_PRIV int priv_usch_pipeline(const char **pp_argv,
+        int argc,
+        struct priv_usch_stash_item **pp_out,
+        int in_fd,
+        int out_fd,
+        const ucmdopts *p_opts)
+{
+    int status = -1;
+    int i = 0;
+    int end;
+    int child_pid = 0;
+    int num_calls = 0;
+    int num_pids = 0;
+    pid_t pids[argc + 1];
+    pid_t timeout_pids[argc + 1];
+    struct priv_usch_timeout timeout;
+    int input = 0;
+    int first = 1;
+    int last = 0;
+
+    priv_usch_timeout_init(&timeout, p_opts);
+    if (timeout.deadline_ms > 0 && in_fd < 0 && isatty(STDIN_FILENO))
+    {
+        // In a new process group a command reading the terminal would
+        // stop on SIGTTIN, so stay in ours and signal by pid instead.
+        timeout.pgid = -1;
+        timeout.p_pids = timeout_pids;
+    }
+    for (i = 0; priv_usch_nextcmd(pp_argv, argc, &i, &end, &last); i = end + 1)
+    {
+        child_pid = -1;
+        input = priv_usch_run(&pp_argv[i], input, first, last, &child_pid, pp_out, in_fd, out_fd, p_opts, &timeout, &num_calls);
+        if (child_pid > 0)
+            pids[num_pids++] = child_pid;
+        if (input < 0 && last == 0)
+        {
+            // out of pipes, do not start the rest reading our stdin
+            child_pid = -1;
+            break;
+        }
+        first = 0;
+    }
+
+    // the exit status is the one of the last command, but every command
+    // is reaped so that none is left behind as a zombie
+    if (num_calls == 0)
+        status = 0;
+    for (i = 0; i < num_pids; i++)
+    {
+        int res = priv_usch_waitforall(pids[i], &timeout);
+        if (i == num_pids - 1 && child_pid > 0)
+            status = res;
+    }
+
+    return status;
+}
+
+/*
+ * Find the next command of a pipe-sequence at or after *p_start. Empty
+ * commands, from "a | | b" or a leading or trailing "|", are skipped.
+ * Sets *p_start to its first argument, *p_end to the NULL after its
+ * last one and *p_last to 1 if no command follows.
+ * Returns USCH_FALSE when there is no command left.
+ */
+USCH_PRIV USCH_BOOL priv_usch_nextcmd(const char **pp_argv, int argc, int *p_start, int *p_end, int *p_last)
+{
+    int i = *p_start;
+    int j;
+
+    while (i < argc && pp_argv[i] == NULL)
+    {
+        i++;
+    }
+    if (i >= argc)
+        return USCH_FALSE;
+
+    j = i;
+    while (j < argc && pp_argv[j] != NULL)
+    {
+        j++;
+    }
+    *p_start = i;
+    *p_end = j;
+    *p_last = 1;
+    for (; j < argc; j++)
+    {
+        if (pp_argv[j] != NULL)
+        {
+            *p_last = 0;
+            break;
+        }
+    }
+    return USCH_TRUE;
+}
+
+/*
+ * Handle commands separatly
+ * input: return value from previous priv_usch_command (useful for pipe file descriptor)
+ * first: 1 if first command in pipe-sequence (no input from previous pipe)
+ * last: 1 if last command in pipe-sequence (no input from previous pipe)
+ *
+ * EXAMPLE: If you type "ls | grep shell | wc" in your shell:
+ *    fd1 = command(0, 1, 0), with args[0] = "ls"
+ *    fd2 = command(fd1, 0, 0), with args[0] = "grep" and args[1] = "shell"
+ *    fd3 = command(fd2, 0, 1), with args[0] = "wc"
+ *
+ * So if 'command' returns a file descriptor, the next 'command' has this
+ * descriptor as its 'input'.
+ */
+USCH_PRIV int priv_usch_command(const char **pp_argv, int input, int first, int last, int *p_child_pid, struct priv_usch_stash_item **pp_out, int in_fd, int out_fd, const ucmdopts *p_opts, struct priv_usch_timeout *p_timeout)
+{
+    struct priv_usch_stash_item *p_priv_usch_stash_item = NULL;
+    int pipettes[2];
+    pid_t pid;
+
+    int child_in = -1;
+    int child_out = -1;
+
+    priv_usch_pipe(pipettes);
+    if (pipettes[USCH_FD_READ] < 0)
+    {
+        *p_child_pid = -1;
+        if (input > 0)
+            close(input);
+        return -1;
+    }
+
+    /*
+SCHEME:
+STDIN --> O --> O --> O --> STDOUT
+*/
+
+    if (first == 1 && in_fd >= 0) {
+        child_in = in_fd;
+    }
+    if (input > 0) {
+        // Middle or last command, reads from the previous one
+        child_in = input;
+    }
+    if (last == 0 || pp_out || out_fd >= 0) {
+        // First or middle command, or last command with captured output
+        child_out = pipettes[USCH_FD_WRITE];
+    }
+
+    if (p_timeout->deadline_ms > 0)
+    {
+        pid = priv_usch_spawn(pp_argv, child_in, child_out, -1, p_timeout->pgid, p_opts);
+        if (p_timeout->pgid == 0 && pid > 0)
+            p_timeout->pgid = pid;
+        if (p_timeout->p_pids != NULL && pid > 0)
+            p_timeout->p_pids[p_timeout->num_pids++] = pid;
+    }
+    else
+    {
+        pid = priv_usch_spawn(pp_argv, child_in, child_out, -1, -1, p_opts);
+    }
+
+    if (input > 0)
+        close(input);
+
+    // Nothing more needs to be written
+    close(pipettes[USCH_FD_WRITE]);
+    *p_child_pid = pid;
+
+    if (pp_out != NULL && last == 1)
+    {
+        size_t i = 0;
+        size_t read_size = 1024;
+        p_priv_usch_stash_item = (struct priv_usch_stash_item*)calloc(read_size + sizeof(struct priv_usch_stash_item), 1);
+        if (p_priv_usch_stash_item == NULL)
+            goto end;
+        p_priv_usch_stash_item->p_next = NULL;
+
+        for (;;)
+        {
+            ssize_t len;
+
+            if (p_timeout->deadline_ms > 0)
+                priv_usch_timeout_poll(p_timeout, pipettes[USCH_FD_READ]);
+            len = read(pipettes[USCH_FD_READ], &p_priv_usch_stash_item->str[i], read_size - i);
+            if (len == 0)
+                break;
+            if (len < 0)
+            {
+                if (errno == EINTR || errno == EAGAIN)
+                    continue;
+                break;
+            }
+            i += len;
+            if (i >= read_size)
+            {
+                struct priv_usch_stash_item *p_grown;
+                read_size *= 2;
+                p_grown = (struct priv_usch_stash_item*)realloc(p_priv_usch_stash_item, read_size + sizeof(struct priv_usch_stash_item));
+                if (p_grown == NULL)
+                    goto end;
+                p_priv_usch_stash_item = p_grown;
+            }
+        }
+        p_priv_usch_stash_item->str[i] = '\0';
+        if (i > 0)
+        {
+            if (p_priv_usch_stash_item->str[i - 1] == '\n')
+            {
+                p_priv_usch_stash_item->str[i - 1] = '\0';
+            }
+        }
+
+    }
+    else if (out_fd >= 0 && last == 1)
+    {
+        if (priv_usch_fdcopy(pipettes[USCH_FD_READ], out_fd, p_timeout) < 0)
+            perror("usch: ufdcopy");
+    }
+
+    if (pp_out && last == 1)
+    {
+        *pp_out = p_priv_usch_stash_item;
+    }
+    p_priv_usch_stash_item = NULL;
+end:
+    free(p_priv_usch_stash_item);
+    // If it's the last command, nothing more needs to be read
+    if (last == 1)
+    {
+        close(pipettes[USCH_FD_READ]);
+        return -1;
+    }
+    return pipettes[USCH_FD_READ];
+}
+
+/* @brief priv_usch_waitforall
+ *
+ * Wait for processes to terminate.
+ *
+ * @param  child_pid.
+ * @return child error status.
+ */
+USCH_PRIV int priv_usch_waitforall(int child_pid, struct priv_usch_timeout *p_timeout)
+{
+    int status = 0;
+    int child_status;
+
+    if (priv_usch_forksrv_wait(child_pid, p_timeout, &status) != 0 &&
+        priv_usch_timeout_waitpid(p_timeout, child_pid, &status) != 0)
+    {
+        perror("waitpid");
+        return -1;
+    }
+    if (WIFEXITED(status)) {
+        child_status = WEXITSTATUS(status);
+    } else {
+        child_status = -1;
+    }
+    if (p_timeout->p_pids != NULL && p_timeout->num_pids > 0 && p_timeout->p_pids[0] == child_pid)
+    {
+        // reaped, from now on the pid may belong to another process
+        p_timeout->p_pids++;
+        p_timeout->num_pids--;
+    }
+    if (p_timeout->num_signals > 0)
+    {
+        // do not leave earlier commands that ignored SIGTERM behind
+        if (p_timeout->num_signals == 1)
+            priv_usch_timeout_kill(p_timeout, SIGKILL);
+        errno = ETIMEDOUT;
+        child_status = -1;
+    }
+    return child_status;
+}
+
+/* @brief priv_usch_waitpid
+ *
+ * Wait for a child process to exit or be killed.
+ *
+ * @param  child_pid.
+ * @param  p_status raw wait status.
+ * @return 0 on success, -1 on waitpid error.
+ */
+USCH_PRIV int priv_usch_waitpid(int child_pid, int *p_status)
+{
+    pid_t wpid;
+    int status = 0;
+    do {
+        wpid = waitpid(child_pid, &status, WUNTRACED
+#ifdef WCONTINUED       /* Not all implementations support this */
+                | WCONTINUED
+#endif
+                );
+        if (wpid == -1) {
+            if (errno != EINTR)
+                return -1;
+            wpid = 0;
+        }
+        if (wpid > 0 && WIFSTOPPED(status) &&
+            (WSTOPSIG(status) == SIGTTIN || WSTOPSIG(status) == SIGTTOU) &&
+            getpgid(child_pid) != getpgrp())
+        {
+            // Outside of our process group it never gets the terminal, so
+            // nothing continues it and this would wait forever.
+            fprintf(stderr, "usch: %d: stopped on terminal access, killed\n", (int)child_pid);
+            kill(child_pid, SIGKILL);
+        }
+    } while (wpid == 0 || (!WIFEXITED(status) && !WIFSIGNALED(status)));
+    *p_status = status;
+    return 0;
+}
+
+USCH_PRIV int priv_usch_run(const char **pp_argv,
+                         int input,
+                         int first,
+                         int last,
+                         int *p_child_pid,
+                         struct priv_usch_stash_item **pp_out,
+                         int in_fd,
+                         int out_fd,
+                         const ucmdopts *p_opts,
+                         struct priv_usch_timeout *p_timeout,
+                         int *p_num_calls)
+{
+    if (pp_argv[0] != NULL) {
+        *p_num_calls += 1;
+        return priv_usch_command(pp_argv, input, first, last, p_child_pid, pp_out, in_fd, out_fd, p_opts, p_timeout);
+    }
+    return 0;
+}
+
+USCH_PRIV void priv_usch_pipe(int *p_pipettes)
+{
+#if defined(__linux__) && defined(O_CLOEXEC)
+    if (pipe2(p_pipettes, O_CLOEXEC) == 0)
+        return;
+#endif // __linux__ && O_CLOEXEC
+    if (pipe(p_pipettes) != 0)
+    {
+        perror("usch: pipe");
+        p_pipettes[USCH_FD_READ] = -1;
+        p_pipettes[USCH_FD_WRITE] = -1;
+        return;
+    }
+    fcntl(p_pipettes[USCH_FD_READ], F_SETFD, FD_CLOEXEC);
+    fcntl(p_pipettes[USCH_FD_WRITE], F_SETFD, FD_CLOEXEC);
+}
+
+/*
+ * Write "usch: <p_what>: <p_msg>" to stderr from a forked child.
+ * stdio may be locked by another thread of the parent, use write(2).
+ */
+USCH_PRIV void priv_usch_child_error(const char *p_what, const char *p_msg)
+{
+    struct iovec iov[5];
+    ssize_t res;
+
+    iov[0].iov_base = (void*)"usch: ";
+    iov[0].iov_len = 6;
+    iov[1].iov_base = (void*)p_what;
+    iov[1].iov_len = strlen(p_what);
+    iov[2].iov_base = (void*)": ";
+    iov[2].iov_len = 2;
+    iov[3].iov_base = (void*)p_msg;
+    iov[3].iov_len = strlen(p_msg);
+    iov[4].iov_base = (void*)"\n";
+    iov[4].iov_len = 1;
+    res = writev(STDERR_FILENO, iov, 5);
+    (void)res;
+}
+
+/*
+ * Set up stdin/stdout of a forked child and exec.
+ * All other pipe descriptors are close-on-exec, dup2() clears the flag.
+ */
+USCH_PRIV void priv_usch_exec_child(const char **pp_argv, int child_in, int child_out, int child_err, pid_t pgid, const ucmdopts *p_opts)
+{
+    if (pgid >= 0)
+    {
+        struct sigaction sa_ign;
+
+        setpgid(0, pgid);
+        // Nothing gives the terminal to this process group. Reading it
+        // then fails with EIO instead of stopping on SIGTTIN for good.
+        memset(&sa_ign, 0, sizeof(sa_ign));
+        sa_ign.sa_handler = SIG_IGN;
+        sigaction(SIGTTIN, &sa_ign, NULL);
+        sigaction(SIGTTOU, &sa_ign, NULL);
+    }
+    if (child_in >= 0)
+        dup2(child_in, STDIN_FILENO);
+    if (child_out >= 0)
+        dup2(child_out, STDOUT_FILENO);
+    if (child_err >= 0)
+        dup2(child_err, STDERR_FILENO);
+
+    if (p_opts != NULL && p_opts->p_cwd != NULL && p_opts->p_cwd[0] != '\0')
+    {
+        if (chdir(p_opts->p_cwd) != 0)
+        {
+            priv_usch_child_error(p_opts->p_cwd, "No such file or directory");
+            _exit(EXIT_FAILURE);
+        }
+    }
+    if (p_opts != NULL && p_opts->rlimit_as > 0)
+    {
+        struct rlimit rl;
+        rl.rlim_cur = rl.rlim_max = (rlim_t)p_opts->rlimit_as;
+        if (setrlimit(RLIMIT_AS, &rl) != 0)
+        {
+            priv_usch_child_error(pp_argv[0], "cannot set RLIMIT_AS");
+            _exit(EXIT_FAILURE);
+        }
+    }
+    if (p_opts != NULL && p_opts->rlimit_cpu > 0)
+    {
+        struct rlimit rl;
+        rl.rlim_cur = rl.rlim_max = (rlim_t)p_opts->rlimit_cpu;
+        if (setrlimit(RLIMIT_CPU, &rl) != 0)
+        {
+            priv_usch_child_error(pp_argv[0], "cannot set RLIMIT_CPU");
+            _exit(EXIT_FAILURE);
+        }
+    }
+
+    if (execvp((const char*)(pp_argv[0]), (char**)pp_argv) == -1)
+    {
+        priv_usch_child_error(pp_argv[0], "command not found");
+        _exit(EXIT_FAILURE); // If child fails
+    }
+}
+
+/*
+ * Fork and exec a command, through the fork server if one is running.
+ * pgid: -1 to stay in the caller's process group, 0 to start a new
+ * process group or the id of a process group to join.
+ */
+USCH_PRIV pid_t priv_usch_spawn(const char **pp_argv, int child_in, int child_out, int child_err, pid_t pgid, const ucmdopts *p_opts)
+{
+    pid_t pid;
+
+    pid = priv_usch_forksrv_spawn(pp_argv, child_in, child_out, child_err, pgid, p_opts);
+    if (pid > 0)
+        return pid;
+
+    pid = fork();
+    if (pid == 0)
+        priv_usch_exec_child(pp_argv, child_in, child_out, child_err, pgid, p_opts);
+    // also set in the parent, so the group exists before it is signalled
+    if (pid > 0 && pgid >= 0)
+        setpgid(pid, pgid == 0 ? pid : pgid);
+
+    return pid;
+}
+
+USCH_PRIV int priv_usch_writeall(int fd, const void *p_buf, size_t len)
+{
+    const char *p_pos = (const char*)p_buf;
+    while (len > 0)
+    {
+        ssize_t res = write(fd, p_pos, len);
+        if (res < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p_pos += res;
+        len -= res;
+    }
+    return 0;
+}
+
+USCH_PRIV int priv_usch_readall(int fd, void *p_buf, size_t len)
+{
+    char *p_pos = (char*)p_buf;
+    while (len > 0)
+    {
+        ssize_t res = read(fd, p_pos, len);
+        if (res == 0)
+            return -1;
+        if (res < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p_pos += res;
+        len -= res;
+    }
+    return 0;
+}
+
+USCH_PRIV int priv_usch_forksrv_send(int sock, struct priv_usch_forksrv_msg *p_msg, const int *p_fds, int num_fds, const char *p_payload)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    union
+    {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+    } control;
+    ssize_t res;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    iov.iov_base = p_msg;
+    iov.iov_len = sizeof(*p_msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (num_fds > 0)
+    {
+        struct cmsghdr *p_cmsg;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(num_fds * sizeof(int));
+        p_cmsg = CMSG_FIRSTHDR(&msg);
+        p_cmsg->cmsg_level = SOL_SOCKET;
+        p_cmsg->cmsg_type = SCM_RIGHTS;
+        p_cmsg->cmsg_len = CMSG_LEN(num_fds * sizeof(int));
+        memcpy(CMSG_DATA(p_cmsg), p_fds, num_fds * sizeof(int));
+    }
+    do {
+        res = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while (res < 0 && errno == EINTR);
+    if (res < 0)
+        return -1;
+    if ((size_t)res < sizeof(*p_msg) &&
+        priv_usch_writeall(sock, (char*)p_msg + res, sizeof(*p_msg) - res) != 0)
+        return -1;
+    if (p_msg->payload_len > 0)
+        return priv_usch_writeall(sock, p_payload, p_msg->payload_len);
+    return 0;
+}
+
+USCH_PRIV int priv_usch_forksrv_recv(int sock, struct priv_usch_forksrv_msg *p_msg, int *p_fds, int *p_num_fds)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *p_cmsg;
+    union
+    {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+    } control;
+    ssize_t res;
+
+    *p_num_fds = 0;
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = p_msg;
+    iov.iov_len = sizeof(*p_msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    do {
+        res = recvmsg(sock, &msg, 0);
+    } while (res < 0 && errno == EINTR);
+    if (res <= 0)
+        return -1;
+    for (p_cmsg = CMSG_FIRSTHDR(&msg); p_cmsg != NULL; p_cmsg = CMSG_NXTHDR(&msg, p_cmsg))
+    {
+        if (p_cmsg->cmsg_level == SOL_SOCKET && p_cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            *p_num_fds = (p_cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(p_fds, CMSG_DATA(p_cmsg), *p_num_fds * sizeof(int));
+        }
+    }
+    if ((size_t)res < sizeof(*p_msg))
+        return priv_usch_readall(sock, (char*)p_msg + res, sizeof(*p_msg) - res);
+    return 0;
+}
+
+USCH_PRIV void priv_usch_forksrv_loop(int sock)
+{
+    struct sigaction sa_ign;
+    struct sigaction sa_int;
+    struct sigaction sa_quit;
+
+    // The terminal signals the whole foreground process group,
+    // the fork server must survive ^C like the parent would.
+    memset(&sa_ign, 0, sizeof(sa_ign));
+    sa_ign.sa_handler = SIG_IGN;
+    sigaction(SIGINT, &sa_ign, &sa_int);
+    sigaction(SIGQUIT, &sa_ign, &sa_quit);
+
+    for (;;)
+    {
+        struct priv_usch_forksrv_msg msg;
+        struct priv_usch_forksrv_reply reply;
+        int fds[3];
+        int num_fds = 0;
+        int i;
+        char *p_payload = NULL;
+        char **pp_strs = NULL;
+
+        if (priv_usch_forksrv_recv(sock, &msg, fds, &num_fds) != 0)
+            break;
+
+        memset(&reply, 0, sizeof(reply));
+        if (msg.type == USCH_FORKSRV_WAIT)
+        {
+            // never block, the next request may come from another thread
+            do {
+                reply.pid = waitpid(msg.pid, &reply.status, WNOHANG);
+            } while (reply.pid < 0 && errno == EINTR);
+            if (reply.pid < 0)
+                reply.err = errno;
+        }
+        else if (msg.type == USCH_FORKSRV_SPAWN)
+        {
+            size_t pos = 0;
+            int child_in = -1;
+            int child_out = -1;
+            int child_err = -1;
+            int fd_idx = 0;
+
+            // argv, NULL, envp, NULL
+            p_payload = (char*)malloc(msg.payload_len + 1);
+            pp_strs = (char**)calloc(msg.argc + msg.envc + 2, sizeof(char*));
+            if (p_payload == NULL || pp_strs == NULL ||
+                priv_usch_readall(sock, p_payload, msg.payload_len) != 0)
+            {
+                free(p_payload);
+                free(pp_strs);
+                break;
+            }
+            p_payload[msg.payload_len] = '\0';
+            for (i = 0; i < msg.argc; i++)
+            {
+                pp_strs[i] = &p_payload[pos];
+                pos += strlen(&p_payload[pos]) + 1;
+            }
+            char *p_cwd = &p_payload[pos];
+            pos += strlen(p_cwd) + 1;
+            for (i = 0; i < msg.envc && pos < msg.payload_len; i++)
+            {
+                pp_strs[msg.argc + 1 + i] = &p_payload[pos];
+                pos += strlen(&p_payload[pos]) + 1;
+            }
+            if (msg.fd_mask & USCH_FORKSRV_HAS_IN && fd_idx < num_fds)
+                child_in = fds[fd_idx++];
+            if (msg.fd_mask & USCH_FORKSRV_HAS_OUT && fd_idx < num_fds)
+                child_out = fds[fd_idx++];
+            if (msg.fd_mask & USCH_FORKSRV_HAS_ERR && fd_idx < num_fds)
+                child_err = fds[fd_idx++];
+
+            reply.pid = fork();
+            if (reply.pid == 0)
+            {
+                extern char **environ;
+
+                sigaction(SIGINT, &sa_int, NULL);
+                sigaction(SIGQUIT, &sa_quit, NULL);
+                close(sock);
+                ucmdopts opts;
+
+                memset(&opts, 0, sizeof(opts));
+                opts.p_cwd = p_cwd;
+                opts.rlimit_as = msg.rlimit_as;
+                opts.rlimit_cpu = msg.rlimit_cpu;
+                environ = &pp_strs[msg.argc + 1];
+                priv_usch_exec_child((const char**)pp_strs, child_in, child_out, child_err, msg.pgid, &opts);
+            }
+            if (reply.pid > 0 && msg.pgid >= 0)
+                setpgid(reply.pid, msg.pgid == 0 ? reply.pid : msg.pgid);
+            if (reply.pid < 0)
+                reply.err = errno;
+        }
+        for (i = 0; i < num_fds; i++)
+            close(fds[i]);
+        free(p_payload);
+        free(pp_strs);
+
+        if (priv_usch_writeall(sock, &reply, sizeof(reply)) != 0)
+            break;
+    }
+    close(sock);
+}
+
+USCH_PRIV pid_t priv_usch_forksrv_spawn(const char **pp_argv, int child_in, int child_out, int child_err, pid_t pgid, const ucmdopts *p_opts)
+{
+    extern char **environ;
+    struct priv_usch_forksrv_msg msg;
+    struct priv_usch_forksrv_reply reply;
+    int fds[3];
+    int num_fds = 0;
+    int i;
+    size_t pos = 0;
+    size_t cwd_len;
+    char cwd[PATH_MAX];
+    char *p_payload = NULL;
+    pid_t pid = -1;
+
+    if (__atomic_load_n(&priv_usch_forksrv_fd, __ATOMIC_RELAXED) < 0)
+        return -1;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.type = USCH_FORKSRV_SPAWN;
+    msg.pgid = pgid;
+    if (p_opts != NULL)
+    {
+        msg.rlimit_as = p_opts->rlimit_as;
+        msg.rlimit_cpu = p_opts->rlimit_cpu;
+    }
+    if (p_opts != NULL && p_opts->p_cwd != NULL && p_opts->p_cwd[0] == '/')
+    {
+        cwd[0] = '\0';
+    }
+    else if (getcwd(cwd, sizeof(cwd)) == NULL)
+    {
+        cwd[0] = '\0';
+    }
+    if (p_opts != NULL && p_opts->p_cwd != NULL && p_opts->p_cwd[0] != '\0')
+    {
+        size_t len = strlen(cwd);
+        if (len > 0 && len + 1 < sizeof(cwd))
+            cwd[len++] = '/';
+        snprintf(&cwd[len], sizeof(cwd) - len, "%s", p_opts->p_cwd);
+    }
+    cwd_len = strlen(cwd) + 1;
+
+    if (child_in >= 0)
+    {
+        msg.fd_mask |= USCH_FORKSRV_HAS_IN;
+        fds[num_fds++] = child_in;
+    }
+    if (child_out >= 0)
+    {
+        msg.fd_mask |= USCH_FORKSRV_HAS_OUT;
+        fds[num_fds++] = child_out;
+    }
+    if (child_err >= 0)
+    {
+        msg.fd_mask |= USCH_FORKSRV_HAS_ERR;
+        fds[num_fds++] = child_err;
+    }
+
+    for (i = 0; pp_argv[i] != NULL; i++)
+        msg.payload_len += strlen(pp_argv[i]) + 1;
+    msg.argc = i;
+    msg.payload_len += cwd_len;
+    for (i = 0; environ != NULL && environ[i] != NULL; i++)
+        msg.payload_len += strlen(environ[i]) + 1;
+    msg.envc = i;
+
+    p_payload = (char*)malloc(msg.payload_len);
+    if (p_payload == NULL)
+        goto end;
+    for (i = 0; i < msg.argc; i++)
+    {
+        size_t len = strlen(pp_argv[i]) + 1;
+        memcpy(&p_payload[pos], pp_argv[i], len);
+        pos += len;
+    }
+    memcpy(&p_payload[pos], cwd, cwd_len);
+    pos += cwd_len;
+    for (i = 0; i < msg.envc; i++)
+    {
+        size_t len = strlen(environ[i]) + 1;
+        memcpy(&p_payload[pos], environ[i], len);
+        pos += len;
+    }
+
+    pthread_mutex_lock(&priv_usch_forksrv_lock);
+    if (priv_usch_forksrv_fd < 0)
+    {
+        pthread_mutex_unlock(&priv_usch_forksrv_lock);
+        goto end;
+    }
+    if (priv_usch_forksrv_send(priv_usch_forksrv_fd, &msg, fds, num_fds, p_payload) != 0 ||
+        priv_usch_readall(priv_usch_forksrv_fd, &reply, sizeof(reply)) != 0)
+    {
+        priv_usch_forksrv_stop_locked();
+        pthread_mutex_unlock(&priv_usch_forksrv_lock);
+        goto end;
+    }
+    pthread_mutex_unlock(&priv_usch_forksrv_lock);
+    pid = reply.pid;
+end:
+    free(p_payload);
+    return pid;
+}
+
+USCH_PRIV int priv_usch_forksrv_wait(pid_t pid, struct priv_usch_timeout *p_timeout, int *p_status)
+{
+    struct priv_usch_forksrv_msg msg;
+    struct priv_usch_forksrv_reply reply;
+    int pidfd;
+    int delay_ms = 1;
+
+    if (__atomic_load_n(&priv_usch_forksrv_fd, __ATOMIC_RELAXED) < 0)
+        return -1;
+
+    // Wait for the exit without holding the lock, so that other threads
+    // can spawn meanwhile. The WAIT request below then returns at once.
+    pidfd = priv_usch_pidfd_open(pid);
+    if (pidfd >= 0)
+    {
+        priv_usch_timeout_poll(p_timeout, pidfd);
+        close(pidfd);
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.type = USCH_FORKSRV_WAIT;
+    msg.pid = pid;
+    for (;;)
+    {
+        int wait_ms = delay_ms;
+
+        pthread_mutex_lock(&priv_usch_forksrv_lock);
+        if (priv_usch_forksrv_fd < 0)
+        {
+            pthread_mutex_unlock(&priv_usch_forksrv_lock);
+            return -1;
+        }
+        if (priv_usch_forksrv_send(priv_usch_forksrv_fd, &msg, NULL, 0, NULL) != 0 ||
+            priv_usch_readall(priv_usch_forksrv_fd, &reply, sizeof(reply)) != 0)
+        {
+            priv_usch_forksrv_stop_locked();
+            pthread_mutex_unlock(&priv_usch_forksrv_lock);
+            return -1;
+        }
+        pthread_mutex_unlock(&priv_usch_forksrv_lock);
+        if (reply.pid != 0)
+            break;
+
+        // Still running, only without a pidfd. The server does not block
+        // on WAIT, so poll it with a backoff while not holding the lock.
+        if (p_timeout->deadline_ms > 0)
+        {
+            long long now = priv_usch_now_ms();
+            if (now >= p_timeout->deadline_ms)
+            {
+                priv_usch_timeout_expire(p_timeout);
+                continue;
+            }
+            if (p_timeout->deadline_ms - now < wait_ms)
+                wait_ms = (int)(p_timeout->deadline_ms - now);
+        }
+        poll(NULL, 0, wait_ms);
+        if (delay_ms < 10)
+            delay_ms *= 2;
+    }
+    if (reply.pid < 0)
+    {
+        // not spawned by the fork server
+        errno = reply.err;
+        return -1;
+    }
+    *p_status = reply.status;
+    return 0;
+}
+
+USCH_API int uforkserver(void)
+{
+    int socks[2];
+    pid_t pid;
+    int status = 0;
+
+    pthread_mutex_lock(&priv_usch_forksrv_lock);
+    if (priv_usch_forksrv_fd >= 0)
+        goto end;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, socks) != 0)
+    {
+        status = -1;
+        goto end;
+    }
+
+    pid = fork();
+    if (pid < 0)
+    {
+        close(socks[0]);
+        close(socks[1]);
+        status = -1;
+        goto end;
+    }
+    if (pid == 0)
+    {
+        close(socks[0]);
+        priv_usch_forksrv_loop(socks[1]);
+        _exit(EXIT_SUCCESS);
+    }
+    close(socks[1]);
+    priv_usch_forksrv_pid = pid;
+    __atomic_store_n(&priv_usch_forksrv_fd, socks[0], __ATOMIC_RELEASE);
+end:
+    pthread_mutex_unlock(&priv_usch_forksrv_lock);
+    return status;
+}
+
+USCH_PRIV void priv_usch_forksrv_stop_locked(void)
+{
+    int status;
+
+    if (priv_usch_forksrv_fd < 0)
+        return;
+
+    close(priv_usch_forksrv_fd);
+    __atomic_store_n(&priv_usch_forksrv_fd, -1, __ATOMIC_RELEASE);
+    (void)priv_usch_waitpid(priv_usch_forksrv_pid, &status);
+    priv_usch_forksrv_pid = -1;
+}
+
+USCH_API void uforkserverstop(void)
+{
+    pthread_mutex_lock(&priv_usch_forksrv_lock);
+    priv_usch_forksrv_stop_locked();
+    pthread_mutex_unlock(&priv_usch_forksrv_lock);
+}
+
+USCH_PRIV int priv_usch_pidfd_open(pid_t pid)
+{
+#if defined(__linux__) && defined(SYS_pidfd_open)
+    return (int)syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void)pid;
+    errno = ENOSYS;
+    return -1;
+#endif // __linux__ && SYS_pidfd_open
+}
+
+USCH_API ucmdprep *priv_ucmdprepare_impl(ustash *p_ustash, int num, const char **pp_args)
+{
+    ucmdprep *p_prep = NULL;
+    struct priv_usch_stash_item *p_blob = NULL;
+    struct priv_usch_glob_list *p_glob_list = NULL;
+    const char **pp_exp = NULL;
+    char **pp_resolved = NULL;
+    ustash path_stash = {NULL};
+    char **pp_path = NULL;
+    int num_path = 0;
+    size_t total_len = 0;
+    size_t num_slots = 0;
+    size_t slot = 0;
+    size_t pos = 0;
+    char *p_data;
+    int argc;
+    int i;
+
+    for (i=0; i < (num - 1); i++)
+    {
+        pp_args[i] = pp_args[i+1];
+    }
+    pp_args[num-1] = NULL;
+
+    if (p_ustash == NULL || pp_args[0] == NULL)
+        goto end;
+
+    pp_exp = priv_usch_globexpand(pp_args, num - 1, &p_glob_list);
+    if (pp_exp == NULL)
+        goto end;
+    for (argc = 0; pp_exp[argc] != NULL; argc++)
+        ;
+    pp_resolved = (char**)calloc(argc + 1, sizeof(char*));
+    if (pp_resolved == NULL)
+        goto end;
+
+    if (getenv("PATH") != NULL)
+    {
+        pp_path = ustrsplit(&path_stash, getenv("PATH"), ":");
+        for (num_path = 0; pp_path != NULL && pp_path[num_path] != NULL; num_path++)
+            ;
+    }
+
+    for (i = 0; i < argc; i++)
+    {
+        int first = (i == 0 || *pp_exp[i - 1] == '|');
+
+        if (ustreq(pp_exp[i], USLOT))
+        {
+            num_slots++;
+            continue;
+        }
+        if (*pp_exp[i] == '|')
+            continue;
+        // resolve commands in PATH once, execvp() then skips the search
+        if (first && strchr(pp_exp[i], '/') == NULL && pp_path != NULL)
+            (void)priv_usch_cached_whereis(pp_path, num_path, (char*)pp_exp[i], &pp_resolved[i]);
+        total_len += strlen(pp_resolved[i] != NULL ? pp_resolved[i] : pp_exp[i]) + 1;
+    }
+
+    p_blob = (struct priv_usch_stash_item*)calloc(sizeof(struct priv_usch_stash_item)
+                    + sizeof(ucmdprep)
+                    + (argc + 1) * sizeof(char*)
+                    + num_slots * sizeof(size_t)
+                    + total_len, 1);
+    if (p_blob == NULL)
+        goto end;
+
+    p_prep = (ucmdprep*)p_blob->str;
+    p_prep->argc = argc;
+    p_prep->pp_argv = (const char**)(p_prep + 1);
+    p_prep->num_slots = num_slots;
+    p_prep->p_slots = (size_t*)&p_prep->pp_argv[argc + 1];
+    p_data = (char*)&p_prep->p_slots[num_slots];
+
+    for (i = 0; i < argc; i++)
+    {
+        const char *p_src = pp_resolved[i] != NULL ? pp_resolved[i] : pp_exp[i];
+        size_t len;
+
+        if (ustreq(pp_exp[i], USLOT))
+        {
+            p_prep->p_slots[slot++] = i;
+            continue;
+        }
+        if (*pp_exp[i] == '|')
+        {
+            p_prep->pp_argv[i] = NULL;
+            continue;
+        }
+        len = strlen(p_src) + 1;
+        memcpy(&p_data[pos], p_src, len);
+        p_prep->pp_argv[i] = &p_data[pos];
+        pos += len;
+    }
+
+    if (priv_usch_stash(p_ustash, p_blob) != 0)
+    {
+        fprintf(stderr, "stash failed, ohnoes!\n");
+        p_prep = NULL;
+        goto end;
+    }
+    p_blob = NULL;
+end:
+    if (pp_resolved != NULL)
+    {
+        for (i = 0; pp_exp != NULL && pp_exp[i] != NULL; i++)
+            free(pp_resolved[i]);
+        free(pp_resolved);
+    }
+    free(p_blob);
+    uclear(&path_stash);
+    priv_usch_free_globlist(p_glob_list);
+    free(pp_exp);
+    return p_prep;
+}
+
+USCH_API int priv_ucmdexec_impl(ustash *p_ustash, ucmdprep *p_prep, int num, const char **pp_args, char **pp_strout)
+{
+    struct priv_usch_stash_item *p_out = NULL;
+    const char **pp_argv = NULL;
+    size_t i;
+    int status = -1;
+
+    if (p_prep == NULL || (size_t)(num - 1) != p_prep->num_slots)
+    {
+        fprintf(stderr, "usch: ucmdexec: expected %zu arguments\n", p_prep ? p_prep->num_slots : 0);
+        goto end;
+    }
+
+    pp_argv = (const char**)malloc((p_prep->argc + 1) * sizeof(char*));
+    if (pp_argv == NULL)
+        goto end;
+    memcpy(pp_argv, p_prep->pp_argv, (p_prep->argc + 1) * sizeof(char*));
+    for (i = 0; i < p_prep->num_slots; i++)
+        pp_argv[p_prep->p_slots[i]] = pp_args[i + 1];
+
+    status = priv_usch_pipeline(pp_argv, p_prep->argc, pp_strout ? &p_out : NULL, -1, -1, NULL);
+    if (pp_strout != NULL && p_out != NULL)
+    {
+        if (priv_usch_stash(p_ustash, p_out) != 0)
+        {
+            fprintf(stderr, "stash failed, ohnoes!\n");
+            free(p_out);
+            goto end;
+        }
+        *pp_strout = p_out->str;
+    }
+end:
+    free(pp_argv);
+    return status;
+}
+
+USCH_API char *priv_ustroutexec_impl(ustash *p_ustash, ucmdprep *p_prep, int num, const char **pp_args)
+{
+    static char emptystr[] = "";
+    char *p_strout = emptystr;
+
+    (void)priv_ucmdexec_impl(p_ustash, p_prep, num, pp_args, &p_strout);
+    return p_strout;
+}
+
+USCH_API ujob *priv_ujobstart_impl(ustash *p_ustash, const ucmdopts *p_opts, USCH_BOOL capture, int num, const char **pp_args)
+{
+    struct priv_usch_stash_item *p_blob = NULL;
+    struct priv_usch_glob_list *p_glob_list = NULL;
+    const char **pp_argv = NULL;
+    ujob *p_job = NULL;
+    int out_pipe[2] = {-1, -1};
+    int err_pipe[2] = {-1, -1};
+    int argc;
+    int i;
+    int end;
+    int last = 0;
+    int input = -1;
+
+    for (i = 0; i < (num - 1); i++)
+    {
+        pp_args[i] = pp_args[i+1];
+    }
+    pp_args[num-1] = NULL;
+
+    if (p_ustash == NULL)
+        goto end;
+    pp_argv = priv_usch_globexpand(pp_args, num - 1, &p_glob_list);
+    if (pp_argv == NULL)
+        goto end;
+    for (argc = 0; pp_argv[argc] != NULL; argc++)
+    {
+        if (*pp_argv[argc] == '|')
+            pp_argv[argc] = NULL;
+    }
+
+    p_blob = (struct priv_usch_stash_item*)calloc(sizeof(struct priv_usch_stash_item) + sizeof(ujob) + (argc + 1) * (sizeof(pid_t) + sizeof(int)), 1);
+    if (p_blob == NULL)
+        goto end;
+    p_job = (ujob*)p_blob->str;
+    p_job->p_pids = (pid_t*)(p_job + 1);
+    p_job->p_pidfds = (int*)(p_job->p_pids + argc + 1);
+    p_job->out_fd = -1;
+    p_job->err_fd = -1;
+    p_job->forward_slot = -1;
+    p_job->status = -1;
+    priv_usch_timeout_init(&p_job->timeout, p_opts);
+
+    if (capture)
+    {
+        priv_usch_pipe(out_pipe);
+        priv_usch_pipe(err_pipe);
+        if (out_pipe[USCH_FD_READ] < 0 || err_pipe[USCH_FD_READ] < 0)
+            goto end;
+        fcntl(out_pipe[USCH_FD_READ], F_SETFL, O_NONBLOCK);
+        fcntl(err_pipe[USCH_FD_READ], F_SETFL, O_NONBLOCK);
+    }
+
+    // a background process group can not read the terminal
+    if (isatty(STDIN_FILENO))
+        input = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    for (i = 0; priv_usch_nextcmd(pp_argv, argc, &i, &end, &last); i = end + 1)
+    {
+        int pipettes[2] = {-1, -1};
+        pid_t pid;
+
+        if (!last)
+        {
+            priv_usch_pipe(pipettes);
+            if (pipettes[USCH_FD_READ] < 0)
+                break;
+        }
+        else
+        {
+            pipettes[USCH_FD_WRITE] = out_pipe[USCH_FD_WRITE];
+            out_pipe[USCH_FD_WRITE] = -1;
+        }
+        // pgid 0 puts the first command in a new process group
+        pid = priv_usch_spawn(&pp_argv[i], input, pipettes[USCH_FD_WRITE], err_pipe[USCH_FD_WRITE], p_job->pgid, p_opts);
+        if (pid > 0)
+        {
+            if (p_job->pgid == 0)
+                p_job->pgid = pid;
+            p_job->p_pidfds[p_job->num_pids] = priv_usch_pidfd_open(pid);
+            p_job->p_pids[p_job->num_pids++] = pid;
+        }
+        if (input >= 0)
+            close(input);
+        if (pipettes[USCH_FD_WRITE] >= 0)
+            close(pipettes[USCH_FD_WRITE]);
+        input = pipettes[USCH_FD_READ];
+        p_job->started_all = last && pid > 0;
+    }
+    if (input >= 0)
+        close(input);
+    if (p_job->num_pids == 0)
+        goto end;
+    if (p_job->timeout.deadline_ms > 0)
+        p_job->timeout.pgid = p_job->pgid;
+    p_job->out_fd = out_pipe[USCH_FD_READ];
+    p_job->err_fd = err_pipe[USCH_FD_READ];
+    out_pipe[USCH_FD_READ] = -1;
+    err_pipe[USCH_FD_READ] = -1;
+
+    if (priv_usch_stash(p_ustash, p_blob) != 0)
+    {
+        fprintf(stderr, "stash failed, ohnoes!\n");
+        // not returned, so never waited for otherwise
+        (void)ujobwait(p_job);
+        goto end;
+    }
+    p_blob = NULL;
+end:
+    for (i = 0; i < 2; i++)
+    {
+        if (out_pipe[i] >= 0)
+            close(out_pipe[i]);
+        if (err_pipe[i] >= 0)
+            close(err_pipe[i]);
+    }
+    if (p_blob != NULL)
+        p_job = NULL;
+    free(p_blob);
+    priv_usch_free_globlist(p_glob_list);
+    free(pp_argv);
+    return p_job;
+}
+
+USCH_API pid_t ujobpgid(const ujob *p_job)
+{
+    if (p_job == NULL)
+        return -1;
+    return p_job->pgid;
+}
+
+USCH_API int ujobkill(ujob *p_job, int sig)
+{
+    if (p_job == NULL || p_job->pgid <= 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    // once waited for, the process group id may be in use again
+    if (p_job->waited)
+    {
+        errno = ESRCH;
+        return -1;
+    }
+    if (kill(-p_job->pgid, sig) != 0)
+        return -1;
+    if (sig != SIGKILL && sig != SIGCONT && sig != SIGSTOP &&
+        sig != SIGTSTP && sig != SIGTTIN && sig != SIGTTOU && sig != 0)
+        kill(-p_job->pgid, SIGCONT);
+    return 0;
+}
+
+/*
+ * Send sig to the process group of every forwarded job.
+ * Runs as a signal handler, only async-signal-safe calls.
+ */
+USCH_PRIV void priv_usch_fwd_handler(int sig)
+{
+    int saved_errno = errno;
+    int i;
+
+    for (i = 0; i < USCH_FWD_MAX; i++)
+    {
+        pid_t pgid = __atomic_load_n(&priv_usch_fwd_pgids[i], __ATOMIC_RELAXED);
+        if (pgid > 0)
+        {
+            kill(-pgid, sig);
+            // like ujobkill(), a stopped job acts on it at once
+            kill(-pgid, SIGCONT);
+        }
+    }
+    errno = saved_errno;
+}
+
+USCH_API int ujobforward(ujob *p_job)
+{
+    size_t i;
+    int slot;
+
+    if (p_job == NULL || p_job->pgid <= 0 || p_job->waited)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (p_job->forward_slot >= 0)
+        return 0;
+
+    pthread_mutex_lock(&priv_usch_fwd_lock);
+    for (slot = 0; slot < USCH_FWD_MAX; slot++)
+    {
+        if (priv_usch_fwd_pgids[slot] == 0)
+            break;
+    }
+    if (slot == USCH_FWD_MAX)
+    {
+        pthread_mutex_unlock(&priv_usch_fwd_lock);
+        errno = EAGAIN;
+        return -1;
+    }
+    __atomic_store_n(&priv_usch_fwd_pgids[slot], p_job->pgid, __ATOMIC_RELAXED);
+    if (priv_usch_fwd_count++ == 0)
+    {
+        struct sigaction sa;
+
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = priv_usch_fwd_handler;
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        for (i = 0; i < sizeof(priv_usch_fwd_signals)/sizeof(int); i++)
+            sigaction(priv_usch_fwd_signals[i], &sa, &priv_usch_fwd_old[i]);
+    }
+    p_job->forward_slot = slot;
+    pthread_mutex_unlock(&priv_usch_fwd_lock);
+    return 0;
+}
+
+USCH_PRIV void priv_usch_fwd_remove(ujob *p_job)
+{
+    size_t i;
+
+    if (p_job->forward_slot < 0)
+        return;
+
+    pthread_mutex_lock(&priv_usch_fwd_lock);
+    __atomic_store_n(&priv_usch_fwd_pgids[p_job->forward_slot], 0, __ATOMIC_RELAXED);
+    if (--priv_usch_fwd_count == 0)
+    {
+        for (i = 0; i < sizeof(priv_usch_fwd_signals)/sizeof(int); i++)
+            sigaction(priv_usch_fwd_signals[i], &priv_usch_fwd_old[i], NULL);
+    }
+    pthread_mutex_unlock(&priv_usch_fwd_lock);
+    p_job->forward_slot = -1;
+}
+
+/*
+ * Wait for every command of a job and release what it holds, except
+ * the output descriptors.
+ */
+USCH_PRIV void priv_usch_jobreap(ujob *p_job)
+{
+    int i;
+
+    for (i = 0; i < p_job->num_pids; i++)
+    {
+        int res = priv_usch_waitforall(p_job->p_pids[i], &p_job->timeout);
+        if (i == p_job->num_pids - 1 && p_job->started_all)
+            p_job->status = res;
+        if (p_job->p_pidfds[i] >= 0)
+            close(p_job->p_pidfds[i]);
+        p_job->p_pidfds[i] = -1;
+    }
+    priv_usch_fwd_remove(p_job);
+    p_job->waited = USCH_TRUE;
+}
+
+USCH_API int ujobwait(ujob *p_job)
+{
+    if (p_job == NULL)
+        return -1;
+
+    if (p_job->out_fd >= 0)
+        close(p_job->out_fd);
+    if (p_job->err_fd >= 0)
+        close(p_job->err_fd);
+    p_job->out_fd = -1;
+    p_job->err_fd = -1;
+    if (!p_job->waited)
+        priv_usch_jobreap(p_job);
+    return p_job->status;
+}
+
+USCH_API int ujobfd(const ujob *p_job, int which)
+{
+    if (p_job == NULL)
+        return -1;
+    return which == UJOB_STDERR ? p_job->err_fd : which == UJOB_STDOUT ? p_job->out_fd : -1;
+}
+
+USCH_API char *ujobread(ustash *p_ustash, ujob *p_job, int which, size_t *p_len)
+{
+    static char emptystr[] = "";
+    struct priv_usch_stash_item *p_item = NULL;
+    char *p_data = NULL;
+    int *p_fd;
+    size_t len = 0;
+    size_t size = 4096;
+    USCH_BOOL eof = USCH_FALSE;
+
+    if (p_len != NULL)
+        *p_len = 0;
+    if (p_ustash == NULL || p_job == NULL || (which != UJOB_STDOUT && which != UJOB_STDERR))
+        goto end;
+    p_fd = which == UJOB_STDERR ? &p_job->err_fd : &p_job->out_fd;
+    if (*p_fd < 0)
+        goto end;
+
+    p_item = (struct priv_usch_stash_item*)calloc(sizeof(struct priv_usch_stash_item) + size + 1, 1);
+    if (p_item == NULL)
+        goto end;
+    for (;;)
+    {
+        ssize_t res = read(*p_fd, &p_item->str[len], size - len);
+
+        if (res == 0)
+        {
+            eof = USCH_TRUE;
+            break;
+        }
+        if (res < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            // EAGAIN, all there is for now
+            eof = errno != EAGAIN && errno != EWOULDBLOCK;
+            break;
+        }
+        len += res;
+        if (len == size)
+        {
+            struct priv_usch_stash_item *p_grown;
+            size *= 2;
+            p_grown = (struct priv_usch_stash_item*)realloc(p_item, sizeof(struct priv_usch_stash_item) + size + 1);
+            if (p_grown == NULL)
+                break;
+            p_item = p_grown;
+        }
+    }
+    if (eof)
+    {
+        close(*p_fd);
+        *p_fd = -1;
+    }
+    if (len == 0)
+    {
+        p_data = eof ? NULL : emptystr;
+        goto end;
+    }
+    p_item->str[len] = '\0';
+    if (priv_usch_stash(p_ustash, p_item) != 0)
+    {
+        fprintf(stderr, "stash failed, ohnoes!\n");
+        goto end;
+    }
+    p_data = p_item->str;
+    p_item = NULL;
+    if (p_len != NULL)
+        *p_len = len;
+end:
+    free(p_item);
+    return p_data;
+}
+
+USCH_API int ujobpidfd(const ujob *p_job)
+{
+    int i;
+
+    if (p_job == NULL || p_job->waited)
+        return -1;
+    for (i = 0; i < p_job->num_pids; i++)
+    {
+        struct pollfd pfd;
+
+        if (p_job->p_pidfds[i] < 0)
+            return -1;
+        pfd.fd = p_job->p_pidfds[i];
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, 0) == 0)
+            return p_job->p_pidfds[i];
+    }
+    // all have exited, any of them is readable
+    return p_job->num_pids > 0 ? p_job->p_pidfds[p_job->num_pids - 1] : -1;
+}
+
+USCH_API int ujobdeadline(const ujob *p_job)
+{
+    long long left;
+
+    if (p_job == NULL || p_job->waited || p_job->timeout.deadline_ms <= 0)
+        return -1;
+    left = p_job->timeout.deadline_ms - priv_usch_now_ms();
+    if (left < 0)
+        return 0;
+    return left > INT_MAX ? INT_MAX : (int)left;
+}
+
+USCH_API int ujobtrywait(ujob *p_job, int *p_status)
+{
+    int i;
+
+    if (p_job == NULL)
+        return -1;
+    if (!p_job->waited)
+    {
+        if (p_job->timeout.deadline_ms > 0 && priv_usch_now_ms() >= p_job->timeout.deadline_ms)
+            priv_usch_timeout_expire(&p_job->timeout);
+        for (i = 0; i < p_job->num_pids; i++)
+        {
+            struct pollfd pfd;
+
+            // without a pidfd there is no way to tell, wait
+            if (p_job->p_pidfds[i] < 0)
+                break;
+            pfd.fd = p_job->p_pidfds[i];
+            pfd.events = POLLIN;
+            if (poll(&pfd, 1, 0) == 0)
+                return 0;
+        }
+        priv_usch_jobreap(p_job);
+    }
+    if (p_status != NULL)
+        *p_status = p_job->status;
+    return 1;
+}
+
+USCH_PRIV long long priv_usch_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+USCH_PRIV void priv_usch_timeout_init(struct priv_usch_timeout *p_timeout, const ucmdopts *p_opts)
+{
+    memset(p_timeout, 0, sizeof(*p_timeout));
+    p_timeout->pgid = -1;
+    if (p_opts == NULL || p_opts->timeout_ms <= 0)
+        return;
+
+    p_timeout->deadline_ms = priv_usch_now_ms() + p_opts->timeout_ms;
+    p_timeout->grace_ms = p_opts->kill_grace_ms > 0 ? p_opts->kill_grace_ms : 1000;
+    p_timeout->pgid = 0;
+}
+
+/*
+ * The deadline has passed: SIGTERM the process group, then SIGKILL it
+ * grace_ms later. After SIGKILL there is nothing left to wait for.
+ */
+USCH_PRIV void priv_usch_timeout_expire(struct priv_usch_timeout *p_timeout)
+{
+    if (p_timeout->p_pids != NULL ? p_timeout->num_pids == 0 : p_timeout->pgid <= 0)
+    {
+        p_timeout->deadline_ms = 0;
+        return;
+    }
+    if (p_timeout->num_signals == 0)
+    {
+        priv_usch_timeout_kill(p_timeout, SIGTERM);
+        priv_usch_timeout_kill(p_timeout, SIGCONT);
+        p_timeout->deadline_ms = priv_usch_now_ms() + p_timeout->grace_ms;
+    }
+    else
+    {
+        priv_usch_timeout_kill(p_timeout, SIGKILL);
+        p_timeout->deadline_ms = 0;
+    }
+    p_timeout->num_signals++;
+}
+
+USCH_PRIV void priv_usch_timeout_kill(struct priv_usch_timeout *p_timeout, int sig)
+{
+    int i;
+
+    if (p_timeout->p_pids == NULL)
+    {
+        if (p_timeout->pgid > 0)
+            kill(-p_timeout->pgid, sig);
+        return;
+    }
+    for (i = 0; i < p_timeout->num_pids; i++)
+        kill(p_timeout->p_pids[i], sig);
+}
+
+/*
+ * Wait until fd is readable or hung up, signalling the process group
+ * whenever the deadline passes meanwhile.
+ */
+USCH_PRIV int priv_usch_timeout_poll(struct priv_usch_timeout *p_timeout, int fd)
+{
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    for (;;)
+    {
+        int wait_ms = -1;
+        int res;
+
+        if (p_timeout != NULL && p_timeout->deadline_ms > 0)
+        {
+            long long now = priv_usch_now_ms();
+            if (now >= p_timeout->deadline_ms)
+            {
+                priv_usch_timeout_expire(p_timeout);
+                continue;
+            }
+            wait_ms = (int)(p_timeout->deadline_ms - now);
+        }
+        res = poll(&pfd, 1, wait_ms);
+        if (res > 0)
+            return 0;
+        if (res < 0 && errno != EINTR)
+            return -1;
+    }
+}
+
+USCH_PRIV int priv_usch_timeout_waitpid(struct priv_usch_timeout *p_timeout, pid_t pid, int *p_status)
+{
+    int pidfd;
+
+    if (p_timeout == NULL || p_timeout->deadline_ms <= 0)
+        return priv_usch_waitpid(pid, p_status);
+
+    pidfd = priv_usch_pidfd_open(pid);
+    if (pidfd >= 0)
+    {
+        priv_usch_timeout_poll(p_timeout, pidfd);
+        close(pidfd);
+        return priv_usch_waitpid(pid, p_status);
+    }
+
+    // no pidfd, poll with WNOHANG
+    while (p_timeout->deadline_ms > 0)
+    {
+        long long now;
+        pid_t wpid = waitpid(pid, p_status, WNOHANG);
+
+        if (wpid == pid)
+            return 0;
+        if (wpid < 0 && errno != EINTR)
+            return -1;
+        now = priv_usch_now_ms();
+        if (now >= p_timeout->deadline_ms)
+            priv_usch_timeout_expire(p_timeout);
+        else
+            poll(NULL, 0, p_timeout->deadline_ms - now < 10 ? (int)(p_timeout->deadline_ms - now) : 10);
+    }
+    return priv_usch_waitpid(pid, p_status);
+}
+
+USCH_API long long ufdcopy(int in_fd, int out_fd)
+{
+    return priv_usch_fdcopy(in_fd, out_fd, NULL);
+}
+
+USCH_PRIV long long priv_usch_fdcopy(int in_fd, int out_fd, struct priv_usch_timeout *p_timeout)
+{
+    long long total = 0;
+    ssize_t len;
+    char buf[65536];
+    int timed = p_timeout != NULL && p_timeout->deadline_ms > 0;
+
+    if (in_fd < 0 || out_fd < 0)
+        return -1;
+
+#if USCH_HAVE_SPLICE
+    for (;;)
+    {
+        if (timed)
+            priv_usch_timeout_poll(p_timeout, in_fd);
+        len = splice(in_fd, NULL, out_fd, NULL, 1 << 20, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (len > 0)
+        {
+            total += len;
+            continue;
+        }
+        if (len == 0)
+            return total;
+        if (errno == EINTR)
+            continue;
+        if (errno == EINVAL || errno == ENOSYS)
+            break; // neither end is a pipe, or unsupported file type
+        return -1;
+    }
+#endif // USCH_HAVE_SPLICE
+#if USCH_HAVE_COPY_FILE_RANGE
+    for (;;)
+    {
+        if (timed)
+            priv_usch_timeout_poll(p_timeout, in_fd);
+        len = copy_file_range(in_fd, NULL, out_fd, NULL, 1 << 30, 0);
+        if (len > 0)
+        {
+            total += len;
+            continue;
+        }
+        if (len == 0)
+            return total;
+        if (errno == EINTR)
+            continue;
+        if (errno == EINVAL || errno == EXDEV || errno == ENOSYS || errno == EBADF || errno == EOPNOTSUPP)
+            break;
+        return -1;
+    }
+#endif // USCH_HAVE_COPY_FILE_RANGE
+    for (;;)
+    {
+        ssize_t written = 0;
+
+        if (timed)
+            priv_usch_timeout_poll(p_timeout, in_fd);
+        len = read(in_fd, buf, sizeof(buf));
+        if (len == 0)
+            return total;
+        if (len < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        while (written < len)
+        {
+            ssize_t res = write(out_fd, &buf[written], len - written);
+            if (res < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            }
+            written += res;
+        }
+        total += len;
+    }
+}
+
+USCH_API char **ufiletostrv(ustash *p_ustash, const char *p_filename, char *p_delims)
+{
+    FILE *p_file = NULL;
+    static char *p_strv[1] = {NULL};
+    struct priv_usch_stash_item *p_data = NULL;
+    struct priv_usch_stash_item *p_vector = NULL;
+    char **pp_strv = p_strv;
+    char **pp_vector = NULL;
+    char *p_str = NULL;
+    size_t len = 0;
+    struct stat st;
+    size_t i, j;
+    size_t delims_len = 0;
+    size_t num_delims = 0;
+    size_t vpos = 0;
+    if (!p_filename || !p_ustash || !p_delims)
+        goto cleanup;
+    if (stat(p_filename, &st) == 0)
+        len = st.st_size;
+    else
+        goto cleanup;
+
+    p_file = fopen(p_filename, "rb");
+    if (!p_file)
+        goto cleanup;
+    p_data = (struct priv_usch_stash_item*)calloc(sizeof(struct priv_usch_stash_item) + len + 1, 1);
+    if (!p_data) goto cleanup;
+    p_str = p_data->str;
+
+    if (fread(p_str, 1, len, p_file) != len) goto cleanup;
+    p_str[len] = '\0';
+    delims_len = strlen(p_delims);
+    for (i = 0; i < len; i++)
+    {
+        for (j = 0; j < delims_len; j++)
+        {
+            if (p_str[i] == p_delims[j])
+            {
+                p_str[i] = '\0';
+                num_delims++;
+            }
+        }
+    }
+    // one more string than delimiters, and the NULL
+    p_vector = (struct priv_usch_stash_item*)calloc(sizeof(struct priv_usch_stash_item) + (num_delims + 2) * sizeof(char*), 1);
+    if (!p_vector) goto cleanup;
+    pp_vector = (char**)p_vector->str;
+
+    // an empty file has no strings, like ugrepfile() finds no lines in it
+    if (len > 0)
+        pp_vector[vpos++] = p_str;
+    for (i = 0; i < len; i++)
+    {
+        if (p_str[i] == '\0' && i + 1 != len)
+        {
+            pp_vector[vpos++] = &p_str[i+1];
+        }
+    }
+    pp_vector[vpos] = NULL;
+
+    if (priv_usch_stash(p_ustash, p_data) != 0)
+    {
+        fprintf(stderr, "stash failed, ohnoes!\n");
+        goto cleanup;
+    }
+    p_data = NULL;
+    if (priv_usch_stash(p_ustash, p_vector) != 0)
+    {
+        fprintf(stderr, "stash failed, ohnoes!\n");
+        goto cleanup;
+    }
+    p_vector = NULL;
+    pp_strv = pp_vector;
+cleanup:
+    if (p_file) fclose(p_file);
+    free(p_data);
+    free(p_vector);
+    return pp_strv;
+}
+
+USCH_API int ustrvtofile(const char **pp_strv, const char *p_filename, const char *p_delim)
+{
+    int i = 0;
+    int res = 0;
+    FILE *p_file = NULL;
+    if (!pp_strv || !p_filename || !p_delim)
+        return -1;
+    
+    size_t delim_len = strlen(p_delim);
+
+    p_file = fopen(p_filename, "w");
+    if (!p_file)
+    {
+        res = -1;
+        goto cleanup;
+    }
+
+    while (pp_strv[i] != NULL)
+    {
+        size_t bytes_to_write = strlen(pp_strv[i]);
+        size_t bytes_written = fwrite(pp_strv[i], sizeof(char), bytes_to_write, p_file);
+
+        if (bytes_to_write != bytes_written)
+        {
+            res = -1;
+            goto cleanup;
+        }
+        bytes_written = fwrite(p_delim, sizeof(char), delim_len, p_file);
+        if (delim_len != bytes_written)
+        {
+            res = -1;
+            goto cleanup;
+        }
+        i++;
+    }
+cleanup:
+    if (p_file)
+        fclose(p_file);
+    return res;
+}
+
+USCH_PRIV uint64_t priv_usch_mix(uint64_t a, uint64_t b)
+{
+#ifdef __SIZEOF_INT128__
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+#else
+    uint64_t ha = a >> 32, hb = b >> 32, la = (uint32_t)a, lb = (uint32_t)b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t t = rl + (rm0 << 32);
+    uint64_t c = t < rl;
+    uint64_t lo = t + (rm1 << 32);
+    c += lo < t;
+    return lo ^ (rh + (rm0 >> 32) + (rm1 >> 32) + c);
+#endif // __SIZEOF_INT128__
+}
+
+USCH_PRIV uint64_t priv_usch_read64(const unsigned char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+USCH_PRIV uint64_t priv_usch_read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/*
+ * wyhash style 64-bit hash: mixes 16 bytes per 64x64->128 bit multiply,
+ * 48 bytes per round in three independent lanes for long keys.
+ */
+USCH_PRIV uint64_t priv_usch_hash(const void *p_key, size_t len, uint64_t seed)
+{
+    static const uint64_t secret[4] = {
+        0xa0761d6478bd642full, 0xe7037ed1a0b428dbull,
+        0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull
+    };
+    const unsigned char *p = (const unsigned char*)p_key;
+    uint64_t a;
+    uint64_t b;
+
+    seed ^= priv_usch_mix(seed ^ secret[0], secret[1]);
+    if (len <= 16)
+    {
+        if (len >= 4)
+        {
+            a = (priv_usch_read32(p) << 32) | priv_usch_read32(p + ((len >> 3) << 2));
+            b = (priv_usch_read32(p + len - 4) << 32) | priv_usch_read32(p + len - 4 - ((len >> 3) << 2));
+        }
+        else if (len > 0)
+        {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+            b = 0;
+        }
+        else
+        {
+            a = b = 0;
+        }
+    }
+    else
+    {
+        size_t i = len;
+        if (i > 48)
+        {
+            uint64_t see1 = seed;
+            uint64_t see2 = seed;
+            do
+            {
+                seed = priv_usch_mix(priv_usch_read64(p) ^ secret[1], priv_usch_read64(p + 8) ^ seed);
+                see1 = priv_usch_mix(priv_usch_read64(p + 16) ^ secret[2], priv_usch_read64(p + 24) ^ see1);
+                see2 = priv_usch_mix(priv_usch_read64(p + 32) ^ secret[3], priv_usch_read64(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16)
+        {
+            seed = priv_usch_mix(priv_usch_read64(p) ^ secret[1], priv_usch_read64(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = priv_usch_read64(p + i - 16);
+        b = priv_usch_read64(p + i - 8);
+    }
+    return priv_usch_mix(secret[1] ^ len, priv_usch_mix(a ^ secret[1], b ^ seed));
+}
+
+USCH_PRIV int priv_usch_strmap_alloc(ustrmap *p_map, size_t capacity)
+{
+    struct priv_usch_stash_item *p_blob;
+
+    p_blob = (struct priv_usch_stash_item*)calloc(sizeof(struct priv_usch_stash_item)
+                    + capacity * sizeof(struct priv_usch_strmap_slot), 1);
+    if (p_blob == NULL)
+        return -1;
+    if (priv_usch_stash(p_map->p_ustash, p_blob) != 0)
+    {
+        free(p_blob);
+        return -1;
+    }
+    p_map->p_slots = (struct priv_usch_strmap_slot*)p_blob->str;
+    p_map->mask = capacity - 1;
+    return 0;
+}
+
+USCH_PRIV struct priv_usch_strmap_slot *priv_usch_strmap_find(const ustrmap *p_map, const char *p_key, uint64_t hash)
+{
+    size_t i = hash & p_map->mask;
+
+    for (;;)
+    {
+        struct priv_usch_strmap_slot *p_slot = &p_map->p_slots[i];
+        if (p_slot->p_key == NULL)
+            return p_slot;
+        if (p_slot->hash == hash && strcmp(p_slot->p_key, p_key) == 0)
+            return p_slot;
+        i = (i + 1) & p_map->mask;
+    }
+}
+
+USCH_API ustrmap *ustrmapnew(ustash *p_ustash, size_t hint)
+{
+    struct priv_usch_stash_item *p_blob = NULL;
+    ustrmap *p_map = NULL;
+    size_t capacity = 16;
+
+    if (p_ustash == NULL)
+        goto end;
+
+    // keep the load factor below 3/4
+    while (capacity * 3 < hint * 4 + 4)
+        capacity *= 2;
+
+    p_blob = (struct priv_usch_stash_item*)calloc(sizeof(struct priv_usch_stash_item) + sizeof(ustrmap), 1);
+    if (p_blob == NULL)
+        goto end;
+    p_map = (ustrmap*)p_blob->str;
+    p_map->p_ustash = p_ustash;
+    if (priv_usch_strmap_alloc(p_map, capacity) != 0)
+    {
+        p_map = NULL;
+        goto end;
+    }
+    if (priv_usch_stash(p_ustash, p_blob) != 0)
+    {
+        fprintf(stderr, "stash failed, ohnoes!\n");
+        p_map = NULL;
+        goto end;
+    }
+    p_blob = NULL;
+end:
+    free(p_blob);
+    return p_map;
+}
+
+USCH_API int ustrmapset(ustrmap *p_map, const char *p_key, const char *p_value)
+{
+    struct priv_usch_strmap_slot *p_slot;
+    uint64_t hash;
+
+    if (p_map == NULL || p_key == NULL)
+        return -1;
+
+    if ((p_map->count + 1) * 4 > (p_map->mask + 1) * 3)
+    {
+        struct priv_usch_strmap_slot *p_old = p_map->p_slots;
+        size_t old_capacity = p_map->mask + 1;
+        size_t i;
+
+        if (priv_usch_strmap_alloc(p_map, old_capacity * 2) != 0)
+            return -1;
+        for (i = 0; i < old_capacity; i++)
+        {
+            if (p_old[i].p_key != NULL)
+                *priv_usch_strmap_find(p_map, p_old[i].p_key, p_old[i].hash) = p_old[i];
+        }
+    }
+
+    hash = priv_usch_hash(p_key, strlen(p_key), 0);
+    p_slot = priv_usch_strmap_find(p_map, p_key, hash);
+    p_slot->p_value = p_value;
+    if (p_slot->p_key != NULL)
+        return 0;
+    p_slot->hash = hash;
+    p_slot->p_key = p_key;
+    p_map->count++;
+    return 1;
+}
+
+USCH_API char *ustrmapget(const ustrmap *p_map, const char *p_key)
+{
+    struct priv_usch_strmap_slot *p_slot;
+
+    if (p_map == NULL || p_key == NULL)
+        return NULL;
+
+    p_slot = priv_usch_strmap_find(p_map, p_key, priv_usch_hash(p_key, strlen(p_key), 0));
+    return (char*)p_slot->p_value;
+}
+
+USCH_API ustrset *ustrsetnew(ustash *p_ustash, size_t hint)
+{
+    return ustrmapnew(p_ustash, hint);
+}
+
+USCH_API ustrset *ustrsetv(ustash *p_ustash, char **pp_strv)
+{
+    ustrset *p_set;
+    size_t num = 0;
+    size_t i;
+
+    while (pp_strv != NULL && pp_strv[num] != NULL)
+        num++;
+
+    p_set = ustrsetnew(p_ustash, num);
+    if (p_set == NULL)
+        return NULL;
+    for (i = 0; i < num; i++)
+    {
+        if (ustrsetadd(p_set, pp_strv[i]) < 0)
+            return NULL;
+    }
+    return p_set;
+}
+
+USCH_API int ustrsetadd(ustrset *p_set, const char *p_str)
+{
+    return ustrmapset(p_set, p_str, p_str);
+}
+
+USCH_API USCH_BOOL ustrsethas(const ustrset *p_set, const char *p_str)
+{
+    if (p_set == NULL || p_str == NULL)
+        return USCH_FALSE;
+
+    return priv_usch_strmap_find(p_set, p_str, priv_usch_hash(p_str, strlen(p_str), 0))->p_key != NULL;
+}
+
+USCH_API size_t ustrsetsize(const ustrset *p_map)
+{
+    return p_map != NULL ? p_map->count : 0;
+}
+
+/*
+ * Keep the strings of pp_a that are (keep) or are not (!keep) in pp_b.
+ * pp_b == NULL removes duplicates from pp_a.
+ */
+USCH_PRIV char **priv_usch_strvfilter(ustash *p_ustash, char **pp_a, char **pp_b, USCH_BOOL keep)
+{
+    static char *emptyarr[1];
+    char **pp_out = emptyarr;
+    struct priv_usch_stash_item *p_blob = NULL;
+    ustash tmp_stash = {NULL};
+    ustrset *p_set = NULL;
+    size_t num = 0;
+    size_t pos = 0;
+    size_t i;
+
+    if (p_ustash == NULL || pp_a == NULL)
+        goto end;
+
+    while (pp_a[num] != NULL)
+        num++;
+
+    if (pp_b != NULL)
+        p_set = ustrsetv(&tmp_stash, pp_b);
+    else
+        p_set = ustrsetnew(&tmp_stash, num);
+    if (p_set == NULL)
+        goto end;
+
+    p_blob = (struct priv_usch_stash_item*)calloc(sizeof(struct priv_usch_stash_item) + (num + 1) * sizeof(char*), 1);
+    if (p_blob == NULL)
+        goto end;
+
+    for (i = 0; i < num; i++)
+    {
+        USCH_BOOL found;
+        if (pp_b == NULL)
+            found = ustrsetadd(p_set, pp_a[i]) == 0;
+        else
+            found = ustrsethas(p_set, pp_a[i]);
+        if (found == keep)
+            ((char**)p_blob->str)[pos++] = pp_a[i];
+    }
+    ((char**)p_blob->str)[pos] = NULL;
+
+    if (priv_usch_stash(p_ustash, p_blob) != 0)
+    {
+        fprintf(stderr, "stash failed, ohnoes!\n");
+        goto end;
+    }
+    pp_out = (char**)p_blob->str;
+    p_blob = NULL;
+end:
+    free(p_blob);
+    uclear(&tmp_stash);
+    return pp_out;
+}
+
+USCH_API char **ustrvdiff(ustash *p_ustash, char **pp_a, char **pp_b)
+{
+    static char *emptyarr[1];
+    // a NULL pp_b would make priv_usch_strvfilter() deduplicate pp_a
+    return priv_usch_strvfilter(p_ustash, pp_a, pp_b != NULL ? pp_b : emptyarr, USCH_FALSE);
+}
+
+USCH_API char **ustrvisect(ustash *p_ustash, char **pp_a, char **pp_b)
+{
+    static char *emptyarr[1];
+    if (pp_b == NULL)
+        return emptyarr;
+    return priv_usch_strvfilter(p_ustash, pp_a, pp_b, USCH_TRUE);
+}
+
+USCH_API char **ustrvdedup(ustash *p_ustash, char **pp_strv)
+{
+    return priv_usch_strvfilter(p_ustash, pp_strv, NULL, USCH_FALSE);
+}
+
+USCH_PRIV int priv_usch_grep_init(struct priv_usch_grep *p_grep, const char *p_pattern, int flags)
+{
+    int cflags = REG_EXTENDED | REG_NOSUB;
+
+    memset(p_grep, 0, sizeof(*p_grep));
+    p_grep->flags = flags;
+    if (flags & UGREP_FIXED)
+    {
+        p_grep->p_needle = p_pattern;
+        p_grep->needle_len = strlen(p_pattern);
+        p_grep->lower = (unsigned char)tolower((unsigned char)p_pattern[0]);
+        p_grep->upper = (unsigned char)toupper((unsigned char)p_pattern[0]);
+        return 0;
+    }
+    if (flags & UGREP_ICASE)
+        cflags |= REG_ICASE;
+    if (regcomp(&p_grep->regex, p_pattern, cflags) != 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+USCH_PRIV void priv_usch_grep_free(struct priv_usch_grep *p_grep)
+{
+    if (!(p_grep->flags & UGREP_FIXED))
+        regfree(&p_grep->regex);
+}
+
+/*
+ * Find a fixed string. memchr() skips to candidates for the first byte,
+ * which libc does a word or a vector at a time, and memcmp() confirms.
+ */
+USCH_PRIV const char *priv_usch_memfind(const struct priv_usch_grep *p_grep, const char *p_hay, size_t len)
+{
+    const char *p_end = p_hay + len;
+    size_t needle_len = p_grep->needle_len;
+
+    if (needle_len == 0)
+        return p_hay;
+    if (len < needle_len)
+        return NULL;
+
+    if (!(p_grep->flags & UGREP_ICASE))
+    {
+        const char *p_last = p_end - needle_len;
+        const char *p_pos = p_hay;
+        while (p_pos <= p_last)
+        {
+            p_pos = (const char*)memchr(p_pos, p_grep->p_needle[0], (size_t)(p_last - p_pos) + 1);
+            if (p_pos == NULL)
+                return NULL;
+            if (memcmp(p_pos + 1, p_grep->p_needle + 1, needle_len - 1) == 0)
+                return p_pos;
+            p_pos++;
+        }
+    }
+    else
+    {
+        const char *p_pos;
+        for (p_pos = p_hay; p_pos + needle_len <= p_end; p_pos++)
+        {
+            size_t i;
+            unsigned char c = (unsigned char)*p_pos;
+            if (c != p_grep->lower && c != p_grep->upper)
+                continue;
+            for (i = 1; i < needle_len; i++)
+            {
+                if (tolower((unsigned char)p_pos[i]) != tolower((unsigned char)p_grep->p_needle[i]))
+                    break;
+            }
+            if (i == needle_len)
+                return p_pos;
+        }
+    }
+    return NULL;
+}
+
+/* test a string, which does not have to be NUL terminated for fixed patterns */
+USCH_PRIV USCH_BOOL priv_usch_grep_match(struct priv_usch_grep *p_grep, const char *p_str, size_t len)
+{
+    if (p_grep->flags & UGREP_FIXED)
+        return priv_usch_memfind(p_grep, p_str, len) != NULL;
+#ifdef REG_STARTEND
+    {
+        regmatch_t match;
+        match.rm_so = 0;
+        match.rm_eo = (regoff_t)len;
+        return regexec(&p_grep->regex, p_str, 1, &match, REG_STARTEND) == 0;
+    }
+#else
+    {
+        USCH_BOOL found;
+        char *p_copy = (char*)malloc(len + 1);
+        if (p_copy == NULL)
+            return USCH_FALSE;
+        memcpy(p_copy, p_str, len);
+        p_copy[len] = '\0';
+        found = regexec(&p_grep->regex, p_copy, 0, NULL, 0) == 0;
+        free(p_copy);
+        return found;
+    }
+#endif
+}
+
+USCH_API char **ugrep(ustash *p_ustash, char **pp_strv, const char *p_pattern, int flags)
+{
+    static char *emptyarr[1];
+    char **pp_out = emptyarr;
+    struct priv_usch_stash_item *p_blob = NULL;
+    struct priv_usch_grep grep;
+    USCH_BOOL invert = (flags & UGREP_INVERT) != 0;
+    size_t num = 0;
+    size_t pos = 0;
+    size_t i;
+
+    if (p_ustash == NULL || pp_strv == NULL || p_pattern == NULL)
+        return pp_out;
+    if (priv_usch_grep_init(&grep, p_pattern, flags) != 0)
+        return pp_out;
+
+    while (pp_strv[num] != NULL)
+        num++;
+
+    p_blob = (struct priv_usch_stash_item*)calloc(sizeof(struct priv_usch_stash_item) + (num + 1) * sizeof(char*), 1);
+    if (p_blob == NULL)
+        goto end;
+
+    for (i = 0; i < num; i++)
+    {
+        USCH_BOOL found;
+        if (grep.flags & UGREP_FIXED)
+            found = priv_usch_grep_match(&grep, pp_strv[i], strlen(pp_strv[i]));
+        else
+            found = regexec(&grep.regex, pp_strv[i], 0, NULL, 0) == 0;
+        if (found != invert)
+            ((char**)p_blob->str)[pos++] = pp_strv[i];
+    }
+    ((char**)p_blob->str)[pos] = NULL;
+
+    if (priv_usch_stash(p_ustash, p_blob) != 0)
+    {
+        fprintf(stderr, "stash failed, ohnoes!\n");
+        goto end;
+    }
+    pp_out = (char**)p_blob->str;
+    p_blob = NULL;
+end:
+    free(p_blob);
+    priv_usch_grep_free(&grep);
+    return pp_out;
+}
+
+USCH_API char **ugrepfile(ustash *p_ustash, const char *p_filename, const char *p_pattern, int flags)
+{
+    static char *emptyarr[1];
+    char **pp_out = emptyarr;
+    struct priv_usch_stash_item *p_blob = NULL;
+    struct priv_usch_grep grep;
+    USCH_BOOL invert = (flags & UGREP_INVERT) != 0;
+    USCH_BOOL have_grep = USCH_FALSE;
+    const char *p_map = (const char*)MAP_FAILED;
+    const char *p_end;
+    const char *p_line;
+    size_t *p_lines = NULL;
+    size_t num_lines = 0;
+    size_t max_lines = 0;
+    size_t total = 0;
+    size_t len = 0;
+    size_t i;
+    struct stat st;
+    int fd = -1;
+    char *p_str;
+
+    if (p_ustash == NULL || p_filename == NULL || p_pattern == NULL)
+        goto end;
+    if (priv_usch_grep_init(&grep, p_pattern, flags) != 0)
+        goto end;
+    have_grep = USCH_TRUE;
+
+    fd = open(p_filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) != 0)
+        goto end;
+    len = (size_t)st.st_size;
+    if (len == 0)
+        goto end;
+    p_map = (const char*)mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p_map == MAP_FAILED)
+        goto end;
+    p_end = p_map + len;
+
+    // collect (offset, length) pairs of the selected lines
+    p_line = p_map;
+    while (p_line < p_end)
+    {
+        const char *p_nl;
+        if ((grep.flags & UGREP_FIXED) && !invert)
+        {
+            // jump straight to the next hit instead of testing every line
+            const char *p_hit = priv_usch_memfind(&grep, p_line, (size_t)(p_end - p_line));
+            if (p_hit == NULL)
+                break;
+            while (p_hit > p_line && p_hit[-1] != '\n')
+                p_hit--;
+            p_line = p_hit;
+            p_nl = (const char*)memchr(p_line, '\n', (size_t)(p_end - p_line));
+            if (p_nl == NULL)
+                p_nl = p_end;
+            // a newline within the needle means no line contains it
+            if (priv_usch_memfind(&grep, p_line, (size_t)(p_nl - p_line)) == NULL)
+            {
+                p_line = p_nl + 1;
+                continue;
+            }
+        }
+        else
+        {
+            p_nl = (const char*)memchr(p_line, '\n', (size_t)(p_end - p_line));
+            if (p_nl == NULL)
+                p_nl = p_end;
+            if (priv_usch_grep_match(&grep, p_line, (size_t)(p_nl - p_line)) == invert)
+            {
+                p_line = p_nl + 1;
+                continue;
+            }
+        }
+        if (num_lines == max_lines)
+        {
+            size_t *p_tmp;
+            max_lines = max_lines ? 2 * max_lines : 64;
+            p_tmp = (size_t*)realloc(p_lines, 2 * max_lines * sizeof(size_t));
+            if (p_tmp == NULL)
+                goto end;
+            p_lines = p_tmp;
+        }
+        p_lines[2 * num_lines] = (size_t)(p_line - p_map);
+        p_lines[2 * num_lines + 1] = (size_t)(p_nl - p_line);
+        total += (size_t)(p_nl - p_line) + 1;
+        num_lines++;
+        p_line = p_nl + 1;
+    }
+    if (num_lines == 0)
+        goto end;
+
+    p_blob = (struct priv_usch_stash_item*)calloc(sizeof(struct priv_usch_stash_item) + (num_lines + 1) * sizeof(char*) + total, 1);
+    if (p_blob == NULL)
+        goto end;
+    p_str = (char*)((char**)p_blob->str + num_lines + 1);
+    for (i = 0; i < num_lines; i++)
+    {
+        ((char**)p_blob->str)[i] = p_str;
+        memcpy(p_str, p_map + p_lines[2 * i], p_lines[2 * i + 1]);
+        p_str += p_lines[2 * i + 1] + 1;
+    }
 
-    if (p_ustash == NULL || p_in == NULL || p_delims == NULL)
+    if (priv_usch_stash(p_ustash, p_blob) != 0)
+    {
+        fprintf(stderr, "stash failed, ohnoes!\n");
         goto end;
+    }
+    pp_out = (char**)p_blob->str;
+    p_blob = NULL;
+end:
+    free(p_blob);
+    free(p_lines);
+    if (p_map != MAP_FAILED)
+        munmap((void*)p_map, len);
+    if (fd >= 0)
+        close(fd);
+    if (have_grep)
+        priv_usch_grep_free(&grep);
+    return pp_out;
+}
 
-    len_in = strlen(p_in);
-    len_delims = strlen(p_delims);
-    num_str = 1;
-    for (i = 0; i < len_in; i++)
+/*
+ * Scan p_in once, counting rows and fields into p_tab->num_rows and
+ * *p_num_fields. The fields and row starts are also stored when
+ * p_tab->p_fields is not NULL.
+ */
+USCH_PRIV void priv_usch_fieldscan(const char *p_in, size_t len, const unsigned char *p_class, int flags,
+        ufieldtab *p_tab, size_t *p_num_fields)
+{
+    USCH_BOOL collapse = (flags & UFIELDS_COLLAPSE) != 0;
+    USCH_BOOL quoted = (flags & UFIELDS_QUOTED) != 0;
+    size_t pos = 0;
+    size_t num_rows = 0;
+    size_t num_fields = 0;
+    size_t num_cols = 0;
+
+    while (pos < len)
     {
-        for (j = 0; j < len_delims; j++)
+        size_t row_start = num_fields;
+
+        if (p_tab->p_fields != NULL)
+            p_tab->p_row_start[num_rows] = num_fields;
+        if (collapse)
         {
-            if (p_in[i] == p_delims[j])
+            while (pos < len && p_class[(unsigned char)p_in[pos]] == USCH_FIELD_DELIM)
+                pos++;
+        }
+        if (pos < len && (p_in[pos] == '\n' || (p_in[pos] == '\r' && pos + 1 < len && p_in[pos + 1] == '\n')))
+        {
+            pos += p_in[pos] == '\r' ? 2 : 1;
+            num_rows++;
+            continue;
+        }
+        // only delimiters after the last newline
+        if (pos >= len)
+            break;
+
+        for (;;)
+        {
+            size_t start = pos;
+            size_t field_len;
+
+            if (quoted && pos < len && p_in[pos] == '"')
             {
-                num_str++;
+                start = ++pos;
+                for (;;)
+                {
+                    const char *p_quote = (const char*)memchr(&p_in[pos], '"', len - pos);
+                    if (p_quote == NULL)
+                    {
+                        pos = len;
+                        break;
+                    }
+                    pos = (size_t)(p_quote - p_in) + 1;
+                    if (pos < len && p_in[pos] == '"')
+                    {
+                        pos++;
+                        continue;
+                    }
+                    break;
+                }
+                field_len = pos - start;
+                if (field_len > 0 && p_in[start + field_len - 1] == '"')
+                    field_len--;
+                // ignore anything between the closing quote and the next delimiter
+                while (pos < len && p_class[(unsigned char)p_in[pos]] == USCH_FIELD_TEXT)
+                    pos++;
+            }
+            else
+            {
+                while (pos < len && p_class[(unsigned char)p_in[pos]] == USCH_FIELD_TEXT)
+                    pos++;
+                field_len = pos - start;
+                if (field_len > 0 && p_in[pos - 1] == '\r' && (pos == len || p_in[pos] == '\n'))
+                    field_len--;
+            }
+            if (p_tab->p_fields != NULL)
+            {
+                p_tab->p_fields[num_fields].p_str = &p_in[start];
+                p_tab->p_fields[num_fields].len = field_len;
+            }
+            num_fields++;
+
+            if (pos >= len)
+                break;
+            if (p_in[pos] == '\n')
+            {
+                pos++;
+                break;
+            }
+            pos++;
+            if (collapse)
+            {
+                while (pos < len && p_class[(unsigned char)p_in[pos]] == USCH_FIELD_DELIM)
+                    pos++;
+                if (pos >= len)
+                    break;
+                if (p_in[pos] == '\n')
+                {
+                    pos++;
+                    break;
+                }
             }
         }
+        if (num_fields - row_start > num_cols)
+            num_cols = num_fields - row_start;
+        num_rows++;
     }
+    if (p_tab->p_fields != NULL)
+        p_tab->p_row_start[num_rows] = num_fields;
+    p_tab->num_rows = num_rows;
+    p_tab->num_cols = num_cols;
+    *p_num_fields = num_fields;
+}
 
-    size = sizeof(struct priv_usch_stash_item)
-                  + (len_in + 1)  * sizeof(char)
-                  + (num_str + 1) * sizeof(char*);
-    
-    p_stashitem = (struct priv_usch_stash_item*)calloc(size, 1);
-    if (p_stashitem == NULL)
+USCH_API ufieldtab *ufields(ustash *p_ustash, const char *p_in, const char *p_delims, int flags)
+{
+    struct priv_usch_stash_item *p_blob = NULL;
+    ufieldtab *p_tab = NULL;
+    ufieldtab count;
+    unsigned char class_table[256];
+    size_t num_fields = 0;
+    size_t len;
+    size_t i;
+
+    if (p_ustash == NULL || p_in == NULL || p_delims == NULL)
         goto end;
 
-    pp_out = (char**)p_stashitem->str;
-    p_out = (char*)(pp_out + num_str + 1);
-    memcpy(p_out, p_in, len_in + 1);
+    memset(class_table, USCH_FIELD_TEXT, sizeof(class_table));
+    for (i = 0; p_delims[i] != '\0'; i++)
+        class_table[(unsigned char)p_delims[i]] = USCH_FIELD_DELIM;
+    class_table['\n'] = USCH_FIELD_NEWLINE;
 
-    pp_out[out_pos++] = p_out;
+    len = strlen(p_in);
+    memset(&count, 0, sizeof(count));
+    priv_usch_fieldscan(p_in, len, class_table, flags, &count, &num_fields);
 
-    for (i = 0; i < len_in; i++)
+    p_blob = (struct priv_usch_stash_item*)calloc(sizeof(struct priv_usch_stash_item)
+                    + sizeof(ufieldtab)
+                    + (count.num_rows + 1) * sizeof(size_t)
+                    + num_fields * sizeof(ufield), 1);
+    if (p_blob == NULL)
+        goto end;
+
+    p_tab = (ufieldtab*)p_blob->str;
+    p_tab->p_row_start = (size_t*)(p_tab + 1);
+    p_tab->p_fields = (ufield*)(p_tab->p_row_start + count.num_rows + 1);
+    priv_usch_fieldscan(p_in, len, class_table, flags, p_tab, &num_fields);
+
+    if (priv_usch_stash(p_ustash, p_blob) != 0)
     {
-        for (j = 0; j < len_delims; j++)
-        {
-            if (p_out[i] == p_delims[j])
-            {
-                p_out[i] = '\0';
-                pp_out[out_pos++] = &p_out[i+1];
-            }
-        }
+        fprintf(stderr, "stash failed, ohnoes!\n");
+        p_tab = NULL;
+        goto end;
     }
+    p_blob = NULL;
+end:
+    free(p_blob);
+    return p_tab;
+}
 
-    if (priv_usch_stash(p_ustash, p_stashitem) != 0)
+USCH_API ufield ufieldat(const ufieldtab *p_tab, size_t row, size_t col)
+{
+    ufield field = {NULL, 0};
+
+    if (p_tab == NULL || row >= p_tab->num_rows)
+        return field;
+    if (col >= p_tab->p_row_start[row + 1] - p_tab->p_row_start[row])
+        return field;
+    return p_tab->p_fields[p_tab->p_row_start[row] + col];
+}
+
+USCH_API char **ucut(ustash *p_ustash, const ufieldtab *p_tab, size_t col)
+{
+    static char *emptyarr[1];
+    char **pp_out = emptyarr;
+    struct priv_usch_stash_item *p_blob = NULL;
+    size_t total = 0;
+    size_t row;
+    char *p_str;
+
+    if (p_ustash == NULL || p_tab == NULL || p_tab->num_rows == 0)
+        goto end;
+
+    for (row = 0; row < p_tab->num_rows; row++)
+        total += ufieldat(p_tab, row, col).len + 1;
+
+    p_blob = (struct priv_usch_stash_item*)calloc(sizeof(struct priv_usch_stash_item)
+                    + (p_tab->num_rows + 1) * sizeof(char*) + total, 1);
+    if (p_blob == NULL)
+        goto end;
+
+    p_str = (char*)((char**)p_blob->str + p_tab->num_rows + 1);
+    for (row = 0; row < p_tab->num_rows; row++)
+    {
+        ufield field = ufieldat(p_tab, row, col);
+        ((char**)p_blob->str)[row] = p_str;
+        if (field.len > 0)
+            memcpy(p_str, field.p_str, field.len);
+        p_str += field.len + 1;
+    }
+
+    if (priv_usch_stash(p_ustash, p_blob) != 0)
     {
         fprintf(stderr, "stash failed, ohnoes!\n");
         goto end;
     }
-    p_stashitem = NULL;
+    pp_out = (char**)p_blob->str;
+    p_blob = NULL;
 end:
-    free(p_stashitem);
+    free(p_blob);
     return pp_out;
 }
 
-static inline char **ustrexpv(ustash *p_ustash, const char **pp_strings)
+USCH_PRIV unsigned int priv_usch_walk_typebit(unsigned char type)
 {
-    char **pp_strexp = NULL;
-    size_t i;
-    struct priv_usch_stash_item *p_blob = NULL;
-    static char* emptyarr[1];
-    struct priv_usch_glob_list *p_glob_list = NULL;
-    size_t total_len = 0;
-    char **pp_strexp_copy = NULL;
-    const char **pp_strexp_extmem = NULL;
-    size_t pos = 0;
-    size_t num_globbed_args = 0;
-    char *p_strexp_data = NULL;
-    int num_args = 0;
+    switch (type)
+    {
+        case DT_REG:
+            return ULS_FILE;
+        case DT_DIR:
+            return ULS_DIR;
+        case DT_LNK:
+            return ULS_LINK;
+        default:
+            return ULS_OTHER;
+    }
+}
 
-    for (i = 0; pp_strings[i] != NULL; i++)
+USCH_PRIV int priv_usch_walk_add(struct priv_usch_walk *p_walk, const uentry *p_entry, size_t name_len)
+{
+    size_t path_len = p_walk->path_len + name_len + 1;
+
+    if (p_walk->num_entries == p_walk->max_entries)
     {
-       num_args++; 
+        uentry *p_tmp;
+        p_walk->max_entries = p_walk->max_entries ? 2 * p_walk->max_entries : 64;
+        p_tmp = (uentry*)realloc(p_walk->p_entries, p_walk->max_entries * sizeof(uentry));
+        if (p_tmp == NULL)
+            return -1;
+        p_walk->p_entries = p_tmp;
+    }
+    if (p_walk->names_len + path_len > p_walk->names_size)
+    {
+        char *p_tmp;
+        p_walk->names_size = 2 * (p_walk->names_len + path_len) + 4096;
+        p_tmp = (char*)realloc(p_walk->p_names, p_walk->names_size);
+        if (p_tmp == NULL)
+            return -1;
+        p_walk->p_names = p_tmp;
     }
+    p_walk->p_entries[p_walk->num_entries] = *p_entry;
+    // offset for now, made a pointer when packed
+    p_walk->p_entries[p_walk->num_entries].p_name = (const char*)(uintptr_t)p_walk->names_len;
+    memcpy(&p_walk->p_names[p_walk->names_len], p_walk->path, p_walk->path_len);
+    p_walk->names_len += p_walk->path_len;
+    memcpy(&p_walk->p_names[p_walk->names_len], p_entry->p_name, name_len + 1);
+    p_walk->names_len += name_len + 1;
+    p_walk->num_entries++;
+    return 0;
+}
 
-    pp_strexp = emptyarr;
+/*
+ * Remember the first error and carry on with the rest of the walk, like
+ * find(1). ENOENT is an entry removed while walking, not an error.
+ */
+USCH_PRIV void priv_usch_walk_error(struct priv_usch_walk *p_walk, int err)
+{
+    if (p_walk->err == 0 && err != ENOENT)
+        p_walk->err = err;
+}
 
-    if (pp_strings == NULL)
+USCH_PRIV int priv_usch_walk_entry(struct priv_usch_walk *p_walk, int dir_fd, const char *p_name, unsigned char type)
+{
+    const ulsfilter *p_filter = p_walk->p_filter;
+    uentry entry;
+    size_t name_len;
+    USCH_BOOL keep = USCH_TRUE;
+
+    if (p_name[0] == '.')
     {
-        goto end;
+        if (p_name[1] == '\0' || (p_name[1] == '.' && p_name[2] == '\0'))
+            return 0;
+        if (!(p_walk->flags & ULS_HIDDEN))
+            return 0;
     }
 
-    pp_strexp_extmem = priv_usch_globexpand(pp_strings,
-                                            num_args,
-                                            &p_glob_list);
-    if (pp_strexp_extmem == NULL)
+    memset(&entry, 0, sizeof(entry));
+    entry.p_name = p_name;
+    entry.type = type;
+    if (p_walk->need_stat || type == DT_UNKNOWN)
+    {
+        struct stat st;
+        if (fstatat(dir_fd, p_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+        {
+            priv_usch_walk_error(p_walk, errno);
+            return 0;
+        }
+        entry.mode = (unsigned int)st.st_mode;
+        entry.size = (unsigned long long)st.st_size;
+        entry.mtime = (long long)st.st_mtime;
+        if (S_ISREG(st.st_mode))
+            entry.type = DT_REG;
+        else if (S_ISDIR(st.st_mode))
+            entry.type = DT_DIR;
+        else if (S_ISLNK(st.st_mode))
+            entry.type = DT_LNK;
+        else if (S_ISFIFO(st.st_mode))
+            entry.type = DT_FIFO;
+        else if (S_ISSOCK(st.st_mode))
+            entry.type = DT_SOCK;
+        else if (S_ISCHR(st.st_mode))
+            entry.type = DT_CHR;
+        else if (S_ISBLK(st.st_mode))
+            entry.type = DT_BLK;
+    }
+
+    if (p_filter != NULL)
+    {
+        if (p_filter->types != 0 && !(p_filter->types & priv_usch_walk_typebit(entry.type)))
+            keep = USCH_FALSE;
+        if (entry.size < p_filter->min_size)
+            keep = USCH_FALSE;
+        if (p_filter->max_size != 0 && entry.size > p_filter->max_size)
+            keep = USCH_FALSE;
+        if (p_filter->min_mtime != 0 && entry.mtime < p_filter->min_mtime)
+            keep = USCH_FALSE;
+        if (p_filter->max_mtime != 0 && entry.mtime > p_filter->max_mtime)
+            keep = USCH_FALSE;
+    }
+
+    name_len = strlen(p_name);
+    if (keep && priv_usch_walk_add(p_walk, &entry, name_len) != 0)
+        return -1;
+
+    if (p_walk->recurse && entry.type == DT_DIR)
+    {
+        size_t saved_len = p_walk->path_len;
+        int res;
+        int sub_fd;
+
+        if (p_walk->path_len + name_len + 2 >= sizeof(p_walk->path))
+        {
+            priv_usch_walk_error(p_walk, ENAMETOOLONG);
+            return 0;
+        }
+        sub_fd = openat(dir_fd, p_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (sub_fd < 0)
+        {
+            priv_usch_walk_error(p_walk, errno);
+            return 0;
+        }
+        memcpy(&p_walk->path[p_walk->path_len], p_name, name_len);
+        p_walk->path_len += name_len;
+        p_walk->path[p_walk->path_len++] = '/';
+        res = priv_usch_walk_dir(p_walk, sub_fd);
+        p_walk->path_len = saved_len;
+        close(sub_fd);
+        return res;
+    }
+    return 0;
+}
+
+#if defined(__linux__) && defined(SYS_getdents64)
+struct priv_usch_dirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+USCH_PRIV int priv_usch_walk_dir(struct priv_usch_walk *p_walk, int dir_fd)
+{
+    char *p_buf;
+    long len;
+    int res = 0;
+
+    p_buf = (char*)malloc(32768);
+    if (p_buf == NULL)
+        return -1;
+    while (res == 0 && (len = syscall(SYS_getdents64, dir_fd, p_buf, 32768)) > 0)
+    {
+        long pos = 0;
+        while (res == 0 && pos < len)
+        {
+            struct priv_usch_dirent64 *p_dirent = (struct priv_usch_dirent64*)&p_buf[pos];
+            res = priv_usch_walk_entry(p_walk, dir_fd, p_dirent->d_name, p_dirent->d_type);
+            pos += p_dirent->d_reclen;
+        }
+    }
+    if (res == 0 && len < 0)
+        priv_usch_walk_error(p_walk, errno);
+    free(p_buf);
+    return res;
+}
+#else
+USCH_PRIV int priv_usch_walk_dir(struct priv_usch_walk *p_walk, int dir_fd)
+{
+    struct dirent *p_dirent;
+    DIR *p_dir;
+    int res = 0;
+    int fd = dup(dir_fd);
+
+    if (fd < 0)
+    {
+        priv_usch_walk_error(p_walk, errno);
+        return 0;
+    }
+    p_dir = fdopendir(fd);
+    if (p_dir == NULL)
+    {
+        priv_usch_walk_error(p_walk, errno);
+        close(fd);
+        return 0;
+    }
+    for (;;)
+    {
+        errno = 0;
+        p_dirent = readdir(p_dir);
+        if (p_dirent == NULL)
+        {
+            priv_usch_walk_error(p_walk, errno);
+            break;
+        }
+        res = priv_usch_walk_entry(p_walk, dir_fd, p_dirent->d_name, p_dirent->d_type);
+        if (res != 0)
+            break;
+    }
+    closedir(p_dir);
+    return res;
+}
+#endif
+
+USCH_PRIV uentry *priv_usch_walk(ustash *p_ustash, const char *p_dir, int flags, const ulsfilter *p_filter, size_t *p_num, USCH_BOOL recurse)
+{
+    struct priv_usch_walk *p_walk = NULL;
+    struct priv_usch_stash_item *p_blob = NULL;
+    uentry *p_entries = NULL;
+    char *p_names;
+    size_t i;
+    int dir_fd = -1;
+    int err = 0;
+
+    if (p_num != NULL)
+        *p_num = 0;
+    if (p_ustash == NULL || p_dir == NULL)
+    {
+        errno = EINVAL;
         goto end;
+    }
 
-    for (i = 0; pp_strexp_extmem[i] != NULL; i++)
-        total_len += strlen(pp_strexp_extmem[i]) + 1;
+    dir_fd = open(p_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0)
+        goto end;
 
-    num_globbed_args = i;
+    p_walk = (struct priv_usch_walk*)calloc(1, sizeof(struct priv_usch_walk));
+    if (p_walk == NULL)
+        goto end;
+    p_walk->flags = flags;
+    p_walk->p_filter = p_filter;
+    p_walk->recurse = recurse;
+    p_walk->need_stat = (flags & ULS_STAT) ||
+        (p_filter != NULL && (p_filter->min_size || p_filter->max_size || p_filter->min_mtime || p_filter->max_mtime));
+    if (priv_usch_walk_dir(p_walk, dir_fd) != 0)
+        goto end;
 
     p_blob = (struct priv_usch_stash_item*)calloc(sizeof(struct priv_usch_stash_item)
-                    + (num_globbed_args + 1) * sizeof(char*) + total_len, 1);
+                    + (p_walk->num_entries + 1) * sizeof(uentry) + p_walk->names_len, 1);
     if (p_blob == NULL)
         goto end;
 
-    pp_strexp_copy = (char**)p_blob->str;
-    pp_strexp_copy[num_globbed_args] = NULL;
-    p_strexp_data = (char*)&pp_strexp_copy[num_globbed_args+1];
-    // TODO: debug
-    memset(p_strexp_data, 0x0, total_len);
-    for (i = 0; pp_strexp_extmem[i] != NULL; i++)
+    p_entries = (uentry*)p_blob->str;
+    p_names = (char*)(p_entries + p_walk->num_entries + 1);
+    if (p_walk->names_len > 0)
+        memcpy(p_names, p_walk->p_names, p_walk->names_len);
+    for (i = 0; i < p_walk->num_entries; i++)
     {
-        size_t len = strlen(pp_strexp_extmem[i]);
-
-        pp_strexp_copy[i] = &p_strexp_data[pos];
-        pos += len + 1;
-        memcpy(pp_strexp_copy[i], pp_strexp_extmem[i], len);
+        p_entries[i] = p_walk->p_entries[i];
+        p_entries[i].p_name = p_names + (uintptr_t)p_walk->p_entries[i].p_name;
     }
+
     if (priv_usch_stash(p_ustash, p_blob) != 0)
     {
         fprintf(stderr, "stash failed, ohnoes!\n");
+        p_entries = NULL;
         goto end;
     }
-
-    pp_strexp = pp_strexp_copy;
+    p_blob = NULL;
+    if (p_num != NULL)
+        *p_num = p_walk->num_entries;
+    err = p_walk->err;
 end:
-    pp_strexp_copy = NULL;
-    priv_usch_free_globlist(p_glob_list);
-    free(pp_strexp_extmem);
-    return pp_strexp;
+    free(p_blob);
+    if (p_walk != NULL)
+    {
+        free(p_walk->p_entries);
+        free(p_walk->p_names);
+        free(p_walk);
+    }
+    if (dir_fd >= 0)
+        close(dir_fd);
+    if (p_entries != NULL)
+        errno = err;
+    return p_entries;
+}
+
+USCH_API uentry *ulsdir(ustash *p_ustash, const char *p_dir, int flags, const ulsfilter *p_filter, size_t *p_num)
+{
+    return priv_usch_walk(p_ustash, p_dir, flags, p_filter, p_num, USCH_FALSE);
+}
+
+USCH_API uentry *ufind(ustash *p_ustash, const char *p_dir, int flags, const ulsfilter *p_filter, size_t *p_num)
+{
+    return priv_usch_walk(p_ustash, p_dir, flags, p_filter, p_num, USCH_TRUE);
+}
+
+USCH_PRIV uint32_t priv_usch_ror32(uint32_t x, int n)
+{
+    return (x >> n) | (x << (32 - n));
+}
+
+USCH_PRIV void priv_usch_sha256_block(struct priv_usch_sha256 *p_ctx, const unsigned char *p_block)
+{
+    static const uint32_t k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+    };
+    uint32_t w[64];
+    uint32_t a, b, c, d, e, f, g, h;
+    int i;
+
+    for (i = 0; i < 16; i++)
+    {
+        w[i] = ((uint32_t)p_block[4 * i] << 24) | ((uint32_t)p_block[4 * i + 1] << 16) |
+               ((uint32_t)p_block[4 * i + 2] << 8) | (uint32_t)p_block[4 * i + 3];
+    }
+    for (i = 16; i < 64; i++)
+    {
+        uint32_t s0 = priv_usch_ror32(w[i - 15], 7) ^ priv_usch_ror32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = priv_usch_ror32(w[i - 2], 17) ^ priv_usch_ror32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    a = p_ctx->state[0]; b = p_ctx->state[1]; c = p_ctx->state[2]; d = p_ctx->state[3];
+    e = p_ctx->state[4]; f = p_ctx->state[5]; g = p_ctx->state[6]; h = p_ctx->state[7];
+    for (i = 0; i < 64; i++)
+    {
+        uint32_t s1 = priv_usch_ror32(e, 6) ^ priv_usch_ror32(e, 11) ^ priv_usch_ror32(e, 25);
+        uint32_t t1 = h + s1 + ((e & f) ^ (~e & g)) + k[i] + w[i];
+        uint32_t s0 = priv_usch_ror32(a, 2) ^ priv_usch_ror32(a, 13) ^ priv_usch_ror32(a, 22);
+        uint32_t t2 = s0 + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    p_ctx->state[0] += a; p_ctx->state[1] += b; p_ctx->state[2] += c; p_ctx->state[3] += d;
+    p_ctx->state[4] += e; p_ctx->state[5] += f; p_ctx->state[6] += g; p_ctx->state[7] += h;
+}
+
+USCH_PRIV void priv_usch_sha256_init(struct priv_usch_sha256 *p_ctx)
+{
+    static const uint32_t init[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(p_ctx->state, init, sizeof(init));
+    p_ctx->num_bytes = 0;
+    p_ctx->block_len = 0;
+}
+
+USCH_PRIV void priv_usch_sha256_update(struct priv_usch_sha256 *p_ctx, const unsigned char *p_data, size_t len)
+{
+    p_ctx->num_bytes += len;
+    if (p_ctx->block_len > 0)
+    {
+        size_t fill = 64 - p_ctx->block_len;
+        if (fill > len)
+            fill = len;
+        memcpy(&p_ctx->block[p_ctx->block_len], p_data, fill);
+        p_ctx->block_len += fill;
+        p_data += fill;
+        len -= fill;
+        if (p_ctx->block_len < 64)
+            return;
+        priv_usch_sha256_block(p_ctx, p_ctx->block);
+        p_ctx->block_len = 0;
+    }
+    for (; len >= 64; p_data += 64, len -= 64)
+        priv_usch_sha256_block(p_ctx, p_data);
+    memcpy(p_ctx->block, p_data, len);
+    p_ctx->block_len = len;
+}
+
+USCH_PRIV void priv_usch_sha256_final(struct priv_usch_sha256 *p_ctx, unsigned char *p_digest)
+{
+    uint64_t num_bits = p_ctx->num_bytes * 8;
+    unsigned char pad[72];
+    size_t pad_len = (p_ctx->block_len < 56 ? 56 : 120) - p_ctx->block_len;
+    int i;
+
+    memset(pad, 0, sizeof(pad));
+    pad[0] = 0x80;
+    for (i = 0; i < 8; i++)
+        pad[pad_len + i] = (unsigned char)(num_bits >> (56 - 8 * i));
+    priv_usch_sha256_update(p_ctx, pad, pad_len + 8);
+    for (i = 0; i < 32; i++)
+        p_digest[i] = (unsigned char)(p_ctx->state[i / 4] >> (24 - 8 * (i % 4)));
 }
 
-static inline char *udirname(ustash *p_ustash, const char *p_str)
+USCH_PRIV size_t priv_usch_digest_len(int algo)
 {
-    static char emptystr[] = "";
-    static char dotstr[] = ".";
-    char *p_dirname = emptystr;
-    struct priv_usch_stash_item* p_blob = NULL;
-    int i = 0;
-    int last_slash = -1;
+    return algo == UHASH_SHA256 ? 64 : 16;
+}
 
-    if (p_str == NULL ||
-        p_str[0] == '\0')
-        goto end;
+/*
+ * Hash a file into p_hex, which holds priv_usch_digest_len(algo) + 1
+ * bytes. Regular files are mapped, anything else is read in blocks.
+ */
+USCH_PRIV int priv_usch_hashfile(const char *p_filename, int algo, char *p_hex)
+{
+    static const char hexdigits[] = "0123456789abcdef";
+    unsigned char digest[32];
+    size_t digest_len = algo == UHASH_SHA256 ? 32 : 8;
+    unsigned char *p_data = NULL;
+    size_t len = 0;
+    USCH_BOOL mapped = USCH_FALSE;
+    struct stat st;
+    size_t i;
+    int res = -1;
+    int fd;
 
-    while (p_str[i] != '\0')
-    {
-        if (p_str[i] == '/')
-            last_slash = i;
-        i++;
-    }
+    fd = open(p_filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) != 0)
+        goto end;
 
-    if (last_slash == 0)
+    if (S_ISREG(st.st_mode) && st.st_size > 0)
     {
-        p_blob = (struct priv_usch_stash_item*)calloc(2 + sizeof(struct priv_usch_stash_item), 1);
-        p_blob->str[0] = '/';
-        p_blob->str[1] = '\0';
-
-        if (priv_usch_stash(p_ustash, p_blob) != 0)
+        len = (size_t)st.st_size;
+        p_data = (unsigned char*)mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p_data == MAP_FAILED)
         {
+            p_data = NULL;
             goto end;
         }
-        p_dirname = p_blob->str;
-        p_blob = NULL;
+        mapped = USCH_TRUE;
+        madvise(p_data, len, MADV_SEQUENTIAL);
     }
-    else if (last_slash > 0)
+    else
     {
-        p_blob = (struct priv_usch_stash_item*)calloc(last_slash + sizeof(struct priv_usch_stash_item), 1);
-
-        memcpy(p_blob->str, p_str, last_slash);
-        p_blob->str[last_slash] = '\0';
-
-        if (priv_usch_stash(p_ustash, p_blob) != 0)
+        // pipes, and files like /proc/self/status that report no size
+        size_t size = 0;
+        ssize_t num_read;
+        do
         {
+            if (len == size)
+            {
+                unsigned char *p_tmp;
+                size = size ? 2 * size : 65536;
+                p_tmp = (unsigned char*)realloc(p_data, size);
+                if (p_tmp == NULL)
+                    goto end;
+                p_data = p_tmp;
+            }
+            num_read = read(fd, p_data + len, size - len);
+            if (num_read > 0)
+                len += (size_t)num_read;
+        } while (num_read > 0 || (num_read < 0 && errno == EINTR));
+        if (num_read < 0)
             goto end;
-        }
-        p_dirname = p_blob->str;
-        p_blob = NULL;
+    }
+
+    if (algo == UHASH_SHA256)
+    {
+        struct priv_usch_sha256 ctx;
+        priv_usch_sha256_init(&ctx);
+        priv_usch_sha256_update(&ctx, p_data, len);
+        priv_usch_sha256_final(&ctx, digest);
     }
     else
     {
-        p_dirname = dotstr;
+        uint64_t hash = priv_usch_hash(p_data != NULL ? (const void*)p_data : (const void*)"", len, 0);
+        for (i = 0; i < 8; i++)
+            digest[i] = (unsigned char)(hash >> (56 - 8 * i));
+    }
+    for (i = 0; i < digest_len; i++)
+    {
+        p_hex[2 * i] = hexdigits[digest[i] >> 4];
+        p_hex[2 * i + 1] = hexdigits[digest[i] & 0xf];
     }
+    p_hex[2 * digest_len] = '\0';
+    res = 0;
 end:
-    free(p_blob);
-    return p_dirname;
+    if (mapped)
+        munmap(p_data, len);
+    else
+        free(p_data);
+    close(fd);
+    return res;
 }
 
-static inline char *ustrtrim(ustash *p_ustash, const char *p_str)
+USCH_API char *uhashfile(ustash *p_ustash, const char *p_filename, int algo)
 {
-    static char emptystr[] = "\0";
-    char *p_trim = emptystr;
-    struct priv_usch_stash_item* p_blob = NULL;
-    int i = 0;
-    int start = 0;
-    int end = 0;
-    size_t len;
+    static char emptystr[] = "";
+    struct priv_usch_stash_item *p_blob;
 
-    if (p_str == NULL)
-        goto end;
+    if (p_ustash == NULL || p_filename == NULL)
+        return emptystr;
 
-    while (p_str[i] == ' ' && p_str[i] != '\0')
-    {
-        start = i+1;
-        i++;
-    }
-    len = strlen(p_str);
-    i = len - 1;
-    while (p_str[i] == ' ' && i > start)
+    p_blob = (struct priv_usch_stash_item*)calloc(sizeof(struct priv_usch_stash_item) + priv_usch_digest_len(algo) + 1, 1);
+    if (p_blob == NULL)
+        return emptystr;
+    if (priv_usch_hashfile(p_filename, algo, p_blob->str) != 0)
     {
-        i--;
+        free(p_blob);
+        return emptystr;
     }
-    end = i+1;
-
-    p_blob = (struct priv_usch_stash_item*)calloc(end - start + 1 + sizeof(struct priv_usch_stash_item), 1);
-    memcpy(p_blob->str, &p_str[start], end-start);
-    p_blob->str[end] = '\0';
-
     if (priv_usch_stash(p_ustash, p_blob) != 0)
     {
-        goto end;
+        fprintf(stderr, "stash failed, ohnoes!\n");
+        free(p_blob);
+        return emptystr;
     }
-    p_trim = p_blob->str;
-    p_blob = NULL;
-end:
-    return p_trim;
+    return p_blob->str;
 }
 
-static inline char *ustrjoinv(ustash *p_ustash, const char **pp_strings)
+USCH_PRIV void *priv_usch_hash_worker(void *p_arg)
 {
-    static char emptystr[1];
-    char *p_strjoin_retval = emptystr;
-    char *p_dststr = NULL;
-
-    emptystr[0] = '\0';
-
+    struct priv_usch_hash_job *p_job = (struct priv_usch_hash_job*)p_arg;
     size_t i;
-    struct priv_usch_stash_item *p_blob = NULL;
-    size_t total_len = 0;
-
-    p_strjoin_retval = emptystr;
 
-    if (pp_strings == NULL)
-    {
-        goto end;
-    }
-    for (i = 0; pp_strings[i] != NULL; i++)
+    while ((i = __atomic_fetch_add(&p_job->next, 1, __ATOMIC_RELAXED)) < p_job->num)
     {
-        total_len += strlen(pp_strings[i]);
+        if (priv_usch_hashfile(p_job->pp_paths[i], p_job->algo, p_job->pp_digests[i]) != 0)
+            p_job->pp_digests[i][0] = '\0';
     }
+    return NULL;
+}
 
-    p_blob = (struct priv_usch_stash_item*)calloc(sizeof(struct priv_usch_stash_item) + sizeof(char) * total_len + 1, 1);
-    if (p_blob == NULL)
+USCH_API char **uhashfiles(ustash *p_ustash, char **pp_paths, int algo)
+{
+    static char *emptyarr[1];
+    char **pp_out = emptyarr;
+    struct priv_usch_stash_item *p_blob = NULL;
+    struct priv_usch_hash_job job;
+    pthread_t threads[16];
+    size_t digest_size = priv_usch_digest_len(algo) + 1;
+    char *p_digest;
+    long num_threads;
+    long started = 0;
+    long i;
+
+    if (p_ustash == NULL || pp_paths == NULL)
         goto end;
 
-    p_dststr = p_blob->str; 
+    memset(&job, 0, sizeof(job));
+    job.pp_paths = pp_paths;
+    job.algo = algo;
+    while (pp_paths[job.num] != NULL)
+        job.num++;
 
-    for (i = 0; pp_strings[i] != NULL; i++)
+    p_blob = (struct priv_usch_stash_item*)calloc(sizeof(struct priv_usch_stash_item)
+                    + (job.num + 1) * sizeof(char*) + job.num * digest_size, 1);
+    if (p_blob == NULL)
+        goto end;
+    job.pp_digests = (char**)p_blob->str;
+    p_digest = (char*)(job.pp_digests + job.num + 1);
+    for (i = 0; i < (long)job.num; i++)
+        job.pp_digests[i] = p_digest + (size_t)i * digest_size;
+
+    num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_threads > 16)
+        num_threads = 16;
+    if (num_threads > (long)job.num)
+        num_threads = (long)job.num;
+    for (i = 1; i < num_threads; i++)
     {
-        size_t len = strlen(pp_strings[i]);
-        memcpy(p_dststr, pp_strings[i], len);
-        p_dststr += len;
+        if (pthread_create(&threads[started], NULL, priv_usch_hash_worker, &job) != 0)
+            break;
+        started++;
     }
-
-    *p_dststr = '\0';
+    priv_usch_hash_worker(&job);
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
 
     if (priv_usch_stash(p_ustash, p_blob) != 0)
     {
         fprintf(stderr, "stash failed, ohnoes!\n");
         goto end;
     }
-
-    p_strjoin_retval = p_blob->str;
+    pp_out = (char**)p_blob->str;
+    p_blob = NULL;
 end:
-    return p_strjoin_retval;
+    free(p_blob);
+    return pp_out;
 }
 
-
-static inline int priv_usch_cached_whereis(char** pp_cached_path, int path_items, char* p_search_item, char** pp_dest)
+/* read up to len bytes, stopping early only at end of file */
+USCH_PRIV ssize_t priv_usch_readblock(int fd, char *p_buf, size_t len)
 {
-    int status = 0;
-    size_t i;
-    char *p_dest = NULL;
-    char **pp_path = NULL;
-    char **pp_relarray = NULL;
-    size_t num_items = 0;
-    char *p_item = NULL;
-    char *p_item_copy = NULL;
-    size_t item_length = strlen(p_search_item);
+    size_t total = 0;
 
-    if (p_search_item[0] == '/' || p_search_item[0] == '.')
+    while (total < len)
     {
-        int basename_index = -1;
-        pp_relarray = (char**)calloc(1, sizeof(char*));
-        if (pp_relarray == NULL)
-        {
-            status = -1;
-            goto end;
-        }
-        p_item_copy = (char*)calloc(strlen(p_search_item), 1);
-        if (p_item_copy == NULL)
+        ssize_t res = read(fd, p_buf + total, len - total);
+        if (res == 0)
+            break;
+        if (res < 0)
         {
-            status = -1;
-            goto end;
+            if (errno == EINTR)
+                continue;
+            return -1;
         }
+        total += (size_t)res;
+    }
+    return (ssize_t)total;
+}
 
-        for (i = 0; i < item_length; i++)
-        {
-            if (p_item_copy[i] == '/')
-            {
-                basename_index = i;
-            }
-        }
-        if (basename_index < 0)
-        {
-            status = -1;
-            goto end;
-        }
-        p_item_copy[basename_index] = '\0';
+USCH_API int ufilesequal(const char *p_a, const char *p_b)
+{
+    struct stat st_a, st_b;
+    char *p_buf = NULL;
+    size_t block_size = 1 << 18;
+    int fd_a = -1;
+    int fd_b = -1;
+    int res = -1;
+
+    if (p_a == NULL || p_b == NULL)
+        return -1;
 
-        pp_relarray[0] = p_item_copy;
-        pp_path = pp_relarray;
-        num_items = 1;
-        p_item = &p_item_copy[basename_index + 1];
+    fd_a = open(p_a, O_RDONLY | O_CLOEXEC);
+    fd_b = open(p_b, O_RDONLY | O_CLOEXEC);
+    if (fd_a < 0 || fd_b < 0 || fstat(fd_a, &st_a) != 0 || fstat(fd_b, &st_b) != 0)
+        goto end;
+
+    if (st_a.st_dev == st_b.st_dev && st_a.st_ino == st_b.st_ino)
+    {
+        res = 1;
+        goto end;
     }
-    else
+    if (S_ISREG(st_a.st_mode) && S_ISREG(st_b.st_mode) &&
+        st_a.st_size > 0 && st_b.st_size > 0 && st_a.st_size != st_b.st_size)
     {
-        p_item = p_search_item;
-        pp_path = pp_cached_path;
-        num_items = path_items;
+        res = 0;
+        goto end;
     }
 
-    for (i = 0; i < num_items; i++)
+    p_buf = (char*)malloc(2 * block_size);
+    if (p_buf == NULL)
+        goto end;
+    for (;;)
     {
-        size_t dir_length = strlen(pp_path[i]);
-        char new_path[dir_length + 1 + item_length + 1];
-        struct stat sb;
-
-        memcpy(new_path, pp_path[i], dir_length);
-        new_path[dir_length] = '/';
-        memcpy(&new_path[dir_length + 1], p_item, item_length);
-        new_path[dir_length + 1 + item_length] = '\0';
-        if (stat(new_path, &sb) == -1)
-            continue;
-
-        status = 1;
-        // TODO: discard if not executable
-        p_dest = (char*)malloc(dir_length + 1 + item_length + 1);
-        if (p_dest == NULL)
+        ssize_t len_a = priv_usch_readblock(fd_a, p_buf, block_size);
+        ssize_t len_b = priv_usch_readblock(fd_b, p_buf + block_size, block_size);
+        if (len_a < 0 || len_b < 0)
+            goto end;
+        if (len_a != len_b || memcmp(p_buf, p_buf + block_size, (size_t)len_a) != 0)
         {
-            status = -1;
+            res = 0;
             goto end;
         }
-        memcpy(p_dest, new_path, dir_length + item_length + 1);
-        *pp_dest = p_dest;
-        p_dest = NULL;
-        goto end;
+        if (len_a == 0)
+            break;
     }
+    res = 1;
 end:
-    free(pp_relarray);
-    free(p_item_copy);
-    free(p_dest);
+    free(p_buf);
+    if (fd_a >= 0)
+        close(fd_a);
+    if (fd_b >= 0)
+        close(fd_b);
+    return res;
+}
 
-    return status;
+USCH_PRIV int priv_usch_buf_add(struct priv_usch_buf *p_buf, const void *p_data, size_t len)
+{
+    if (p_buf->len + len > p_buf->size)
+    {
+        char *p_tmp;
+        size_t size = 2 * (p_buf->len + len) + 256;
+        p_tmp = (char*)realloc(p_buf->p_data, size);
+        if (p_tmp == NULL)
+            return -1;
+        p_buf->p_data = p_tmp;
+        p_buf->size = size;
+    }
+    memcpy(p_buf->p_data + p_buf->len, p_data, len);
+    p_buf->len += len;
+    return 0;
 }
 
-static inline const char **priv_usch_globexpand(const char **pp_orig_argv, size_t num_args, struct priv_usch_glob_list **pp_glob_list)
+USCH_PRIV int priv_usch_buf_addstr(struct priv_usch_buf *p_buf, const char *p_str)
 {
-    const char **pp_expanded_argv = NULL;
-    struct priv_usch_glob_list *p_glob_list = NULL;
-    struct priv_usch_glob_list *p_current_glob_item = NULL;
-    size_t i, j;
-    int orig_arg_idx = 0;
-    int num_glob_items = 0;
+    return priv_usch_buf_add(p_buf, p_str, strlen(p_str) + 1);
+}
 
-    for (i = 0; i < num_args; i++)
+/* create p_path and its parents, like mkdir -p */
+USCH_PRIV int priv_usch_mkdirs(const char *p_path)
+{
+    char path[PATH_MAX];
+    size_t len = strlen(p_path);
+    size_t i;
+
+    if (len == 0 || len >= sizeof(path))
+        return -1;
+    memcpy(path, p_path, len + 1);
+    for (i = 1; i <= len; i++)
     {
-        if (strcmp(pp_orig_argv[i], "--") == 0)
+        if (path[i] == '/' || path[i] == '\0')
         {
-            orig_arg_idx++;
-            break;
+            char saved = path[i];
+            path[i] = '\0';
+            if (mkdir(path, 0700) != 0 && errno != EEXIST)
+                return -1;
+            path[i] = saved;
         }
+    }
+    return 0;
+}
 
-        if (p_current_glob_item == NULL)
+/*
+ * Serialize everything the output depends on into p_key.
+ */
+USCH_PRIV int priv_usch_cache_key(struct priv_usch_buf *p_key, const ucacheopts *p_copts, const char **pp_argv)
+{
+    char cwd[PATH_MAX];
+    size_t i;
+
+    for (i = 0; pp_argv[i] != NULL; i++)
+    {
+        if (priv_usch_buf_addstr(p_key, pp_argv[i]) != 0)
+            return -1;
+    }
+    if (priv_usch_buf_add(p_key, "", 1) != 0)
+        return -1;
+
+    if (p_copts != NULL && p_copts->p_opts != NULL && p_copts->p_opts->p_cwd != NULL)
+    {
+        if (priv_usch_buf_addstr(p_key, p_copts->p_opts->p_cwd) != 0)
+            return -1;
+    }
+    if (getcwd(cwd, sizeof(cwd)) == NULL || priv_usch_buf_addstr(p_key, cwd) != 0)
+        return -1;
+
+    for (i = 0; p_copts != NULL && p_copts->pp_env != NULL && p_copts->pp_env[i] != NULL; i++)
+    {
+        const char *p_value = uenvget(p_copts->pp_env[i]);
+        if (priv_usch_buf_addstr(p_key, p_copts->pp_env[i]) != 0 ||
+            priv_usch_buf_addstr(p_key, p_value ? p_value : "\001unset") != 0)
+            return -1;
+    }
+
+    for (i = 0; p_copts != NULL && p_copts->pp_files != NULL && p_copts->pp_files[i] != NULL; i++)
+    {
+        const char *p_file = p_copts->pp_files[i];
+        if (priv_usch_buf_addstr(p_key, p_file) != 0)
+            return -1;
+        if (p_copts->hash_files)
         {
-            p_current_glob_item = (struct priv_usch_glob_list*)calloc(1, sizeof(priv_usch_glob_list));
-            if (p_current_glob_item == NULL)
-                goto end;
-            p_glob_list = p_current_glob_item;
+            char hex[17];
+            if (priv_usch_hashfile(p_file, UHASH_FAST, hex) != 0)
+                strcpy(hex, "missing");
+            if (priv_usch_buf_addstr(p_key, hex) != 0)
+                return -1;
         }
         else
         {
-            p_current_glob_item->p_next = (struct priv_usch_glob_list*)calloc(1, sizeof(priv_usch_glob_list));
-            if (p_current_glob_item->p_next == NULL)
-                goto end;
-            p_current_glob_item = p_current_glob_item->p_next;
-        }
-        if (glob(pp_orig_argv[i], GLOB_MARK | GLOB_NOCHECK | GLOB_TILDE | GLOB_NOMAGIC | GLOB_BRACE, NULL, &p_current_glob_item->glob_data) != 0)
-        {
-            goto end;
+            struct stat st;
+            int64_t meta[3] = {-1, -1, -1};
+            if (stat(p_file, &st) == 0)
+            {
+                meta[0] = (int64_t)st.st_size;
+                meta[1] = (int64_t)st.st_mtim.tv_sec;
+                meta[2] = (int64_t)st.st_mtim.tv_nsec;
+            }
+            if (priv_usch_buf_add(p_key, meta, sizeof(meta)) != 0)
+                return -1;
         }
-        num_glob_items += p_current_glob_item->glob_data.gl_pathc;
-        orig_arg_idx++;
     }
-    pp_expanded_argv = (const char**)calloc(num_glob_items + num_args - orig_arg_idx + 1, sizeof(char*));
-    p_current_glob_item = p_glob_list;
+    return 0;
+}
 
-    i = 0;
-    j = 0;
-    while (p_current_glob_item != NULL)
-    {
-        for (j = 0; j < p_current_glob_item->glob_data.gl_pathc; j++, i++)
-        {
-            pp_expanded_argv[i] = p_current_glob_item->glob_data.gl_pathv[j];
-        }
-        p_current_glob_item = p_current_glob_item->p_next;
-    }
+/*
+ * Look up an entry, copying the output to a new stash item on a hit.
+ */
+USCH_PRIV struct priv_usch_stash_item *priv_usch_cache_get(const char *p_path, const struct priv_usch_buf *p_key, long max_age_s)
+{
+    struct priv_usch_stash_item *p_item = NULL;
+    const struct priv_usch_cache_header *p_header;
+    const char *p_map = (const char*)MAP_FAILED;
+    struct stat st;
+    size_t len = 0;
+    int fd;
 
-    for (i = orig_arg_idx; i < num_args; i++)
-    {
-        pp_expanded_argv[j + i] = pp_orig_argv[i];
-    }
-    *pp_glob_list = p_glob_list;
-    p_glob_list = NULL;
+    fd = open(p_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct priv_usch_cache_header))
+        goto end;
+    len = (size_t)st.st_size;
+    p_map = (const char*)mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p_map == MAP_FAILED)
+        goto end;
+
+    p_header = (const struct priv_usch_cache_header*)p_map;
+    if (memcmp(p_header->magic, USCH_CACHE_MAGIC, sizeof(p_header->magic)) != 0 ||
+        p_header->key_len != p_key->len ||
+        sizeof(*p_header) + p_header->key_len + p_header->out_len != len ||
+        memcmp(p_map + sizeof(*p_header), p_key->p_data, p_key->len) != 0)
+        goto end;
+    if (max_age_s > 0 && (int64_t)time(NULL) - p_header->created > max_age_s)
+        goto end;
 
+    p_item = (struct priv_usch_stash_item*)calloc(sizeof(struct priv_usch_stash_item) + p_header->out_len + 1, 1);
+    if (p_item != NULL)
+        memcpy(p_item->str, p_map + sizeof(*p_header) + p_header->key_len, p_header->out_len);
 end:
-    return pp_expanded_argv;
+    if (p_map != MAP_FAILED)
+        munmap((void*)p_map, len);
+    close(fd);
+    return p_item;
 }
-static inline void
-priv_usch_free_globlist(struct priv_usch_glob_list *p_glob_list)
+
+/*
+ * Store an entry through a temporary file, so readers never see a
+ * partially written one.
+ */
+USCH_PRIV void priv_usch_cache_put(const char *p_path, const struct priv_usch_buf *p_key, const char *p_out)
 {
-    if (p_glob_list)
-    {
-        struct priv_usch_glob_list *p_current_glob_item = p_glob_list;
-        while (p_current_glob_item != NULL)
-        {
-            struct priv_usch_glob_list *p_free_glob_item = p_current_glob_item;
+    struct priv_usch_cache_header header;
+    char tmp_path[PATH_MAX];
+    struct iovec iov[3];
+    ssize_t total;
+    int fd;
 
-            p_current_glob_item = p_current_glob_item->p_next;
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", p_path) >= (int)sizeof(tmp_path))
+        return;
+    fd = mkstemp(tmp_path);
+    if (fd < 0)
+        return;
 
-            globfree(&p_free_glob_item->glob_data);
-            free(p_free_glob_item);
-        }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, USCH_CACHE_MAGIC, sizeof(header.magic));
+    header.key_len = p_key->len;
+    header.out_len = strlen(p_out);
+    header.created = (int64_t)time(NULL);
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = p_key->p_data;
+    iov[1].iov_len = p_key->len;
+    iov[2].iov_base = (void*)p_out;
+    iov[2].iov_len = header.out_len;
+    total = (ssize_t)(iov[0].iov_len + iov[1].iov_len + iov[2].iov_len);
+
+    if (writev(fd, iov, 3) != total || close(fd) != 0 || rename(tmp_path, p_path) != 0)
+    {
+        unlink(tmp_path);
+        return;
     }
 }
 
-static inline int priv_usch_cmd_arr(struct priv_usch_stash_item **pp_in, 
-        struct priv_usch_stash_item **pp_out,
-        struct priv_usch_stash_item **pp_err,
-        size_t num_args,
-        const char **pp_orig_argv)
+USCH_API char* priv_ustrcached_impl(ustash *p_ustash, const ucacheopts *p_copts, int num, const char **pp_args)
 {
-    (void)pp_in;
-    (void)pp_err;
+    static char emptystr[] = "";
+    char *p_strout = emptystr;
+    struct priv_usch_stash_item *p_out = NULL;
+    struct priv_usch_buf key = {NULL, 0, 0};
     struct priv_usch_glob_list *p_glob_list = NULL;
     const char **pp_argv = NULL;
-    int argc = 0;
-    int status = 0;
-    int i = 0;
-    int child_pid = 0;
-    int num_calls = 0;
-
-    pp_argv = priv_usch_globexpand(pp_orig_argv, num_args, &p_glob_list);
-    if (pp_argv == NULL)
-        goto end;
+    const char *p_dir = p_copts != NULL ? p_copts->p_dir : NULL;
+    const ucmdopts *p_opts = p_copts != NULL ? p_copts->p_opts : NULL;
+    char dir[PATH_MAX];
+    char path[PATH_MAX];
+    USCH_BOOL cacheable = USCH_FALSE;
+    int status;
+    int argc;
+    int i;
 
-    while (pp_argv[argc] != NULL)
+    for (i=0; i < (num - 1); i++)
     {
-        if (*pp_argv[argc] == '|')
-        {
-            pp_argv[argc] = NULL;
-        }
-        argc++;
+        pp_args[i] = pp_args[i+1];
     }
+    pp_args[num-1] = NULL;
 
-    if (ustreq(pp_argv[0], "cd"))
+    if (p_dir == NULL)
     {
-        struct stat sb;
-	if (stat(pp_argv[1], &sb) == 0 || pp_argv[1] == NULL)
-	{
-            if (pp_argv[1] == NULL)
-	        chdir(getenv("HOME"));
-            else
-	        chdir(pp_argv[1]);
-	}
+        const char *p_xdg = uenvget("XDG_CACHE_HOME");
+        const char *p_home = uenvget("HOME");
+        if (p_xdg != NULL && p_xdg[0] == '/')
+            snprintf(dir, sizeof(dir), "%s/usch", p_xdg);
+        else if (p_home != NULL)
+            snprintf(dir, sizeof(dir), "%s/.cache/usch", p_home);
         else
-           fprintf(stderr, "usch: cd: %s: No such file or directory\n", pp_argv[1]);
+            dir[0] = '\0';
+        p_dir = dir;
     }
-    else
+
+    // expand first, the key must change with the variables and files
+    // the arguments refer to
+    pp_argv = priv_usch_globexpand(pp_args, num - 1, &p_glob_list);
+    if (pp_argv == NULL)
+        goto end;
+    if (p_dir[0] != '\0' && priv_usch_cache_key(&key, p_copts, pp_argv) == 0)
     {
-        int input = 0;
-        int first = 1;
-        i = 0;
-        int j = 0;
-        int last = 0;
-        while (i < argc)
+        int len = snprintf(path, sizeof(path), "%s/%016llx%016llx", p_dir,
+                           (unsigned long long)priv_usch_hash(key.p_data, key.len, 0),
+                           (unsigned long long)priv_usch_hash(key.p_data, key.len, 1));
+        if (len > 0 && len < (int)sizeof(path))
         {
-            last = 1;
-            j = i;
-            while (j < argc)
-            {
-                if (pp_argv[j] == '\0')
-                    last = 0;
-                j++;
-            }
-            input = priv_usch_run(&pp_argv[i], input, first, last, &child_pid, pp_out, &num_calls);
-
-            first = 0;
-            while (i < argc && pp_argv[i] != NULL)
-            {
-                i++;
-            }
-            if (pp_argv[i] == NULL && i != argc)
-            {
-                i++;
-            }
+            cacheable = USCH_TRUE;
+            p_out = priv_usch_cache_get(path, &key, p_copts != NULL ? p_copts->max_age_s : 0);
         }
-        if (pp_argv[i] == NULL && pp_out == NULL)
+    }
+
+    if (p_out == NULL)
+    {
+        for (argc = 0; pp_argv[argc] != NULL; argc++)
         {
-            priv_usch_run(&pp_argv[i], input, first, 1, &child_pid, pp_out, &num_calls);
+            if (*pp_argv[argc] == '|')
+                pp_argv[argc] = NULL;
         }
+        status = priv_usch_pipeline(pp_argv, argc, &p_out, -1, -1, p_opts);
+        if (p_out == NULL)
+            goto end;
+        if (status == 0 && cacheable && priv_usch_mkdirs(p_dir) == 0)
+            priv_usch_cache_put(path, &key, p_out->str);
+    }
 
-        status = priv_usch_waitforall(child_pid);
-        num_calls = 0;
+    if (priv_usch_stash(p_ustash, p_out) != 0)
+    {
+        fprintf(stderr, "stash failed, ohnoes!\n");
+        free(p_out);
+        goto end;
     }
+    p_strout = p_out->str;
 end:
     priv_usch_free_globlist(p_glob_list);
     free(pp_argv);
-
-    return status;
+    free(key.p_data);
+    return p_strout;
 }
 
-/*
- * Handle commands separatly
- * input: return value from previous priv_usch_command (useful for pipe file descriptor)
- * first: 1 if first command in pipe-sequence (no input from previous pipe)
- * last: 1 if last command in pipe-sequence (no input from previous pipe)
- *
- * EXAMPLE: If you type "ls | grep shell | wc" in your shell:
- *    fd1 = command(0, 1, 0), with args[0] = "ls"
- *    fd2 = command(fd1, 0, 0), with args[0] = "grep" and args[1] = "shell"
- *    fd3 = command(fd2, 0, 1), with args[0] = "wc"
- *
- * So if 'command' returns a file descriptor, the next 'command' has this
- * descriptor as its 'input'.
- */
-static int priv_usch_command(const char **pp_argv, int input, int first, int last, int *p_child_pid, struct priv_usch_stash_item **pp_out)
+USCH_PRIV int priv_usch_strcmp_qsort(const void *p_a, const void *p_b)
 {
-    struct priv_usch_stash_item *p_priv_usch_stash_item = NULL;
-    int pipettes[2];
-    pid_t pid;
+    return strcmp(*(char* const*)p_a, *(char* const*)p_b);
+}
 
-    pipe(pipettes);
-    pid = fork();
+USCH_PRIV void priv_usch_insertionsort(char **pp_strv, size_t num, size_t depth)
+{
+    size_t i, j;
 
-    /*
-SCHEME:
-STDIN --> O --> O --> O --> STDOUT
-*/
+    for (i = 1; i < num; i++)
+    {
+        char *p_str = pp_strv[i];
+        for (j = i; j > 0 && strcmp(pp_strv[j - 1] + depth, p_str + depth) > 0; j--)
+            pp_strv[j] = pp_strv[j - 1];
+        pp_strv[j] = p_str;
+    }
+}
 
-    if (pid == 0) {
-        if (first == 1 && last == 0 && input == 0) {
-            // First command
-            dup2(pipettes[USCH_FD_WRITE], STDOUT_FILENO );
-        } else if (first == 0 && last == 0 && input != 0) {
-            // Middle command
-            dup2(input, STDIN_FILENO);
-            dup2(pipettes[USCH_FD_WRITE], STDOUT_FILENO);
-        } else {
-            // Last command
-            if (pp_out)
-                dup2(pipettes[USCH_FD_WRITE], STDOUT_FILENO );
-            else
-                dup2(input, STDIN_FILENO);
-        }
+/*
+ * Distribute pp_strv on the byte at depth into 256 buckets, through pp_tmp.
+ * p_oracle caches the byte so each string is only read once per pass.
+ * bucket_start[c]..bucket_start[c+1] is bucket c afterwards.
+ */
+USCH_PRIV void priv_usch_radixpass(char **pp_strv, char **pp_tmp, unsigned char *p_oracle, size_t num, size_t depth, size_t *p_bucket_start)
+{
+    size_t count[256];
+    size_t pos[256];
+    size_t i;
 
-        if (execvp((const char*)(pp_argv[0]), (char**)pp_argv) == -1)
-        {
-            fprintf(stderr, "usch: %s: command not found\n", pp_argv[0]);
-            _exit(EXIT_FAILURE); // If child fails
-        }
+    memset(count, 0, sizeof(count));
+    for (i = 0; i < num; i++)
+    {
+        p_oracle[i] = (unsigned char)pp_strv[i][depth];
+        count[p_oracle[i]]++;
     }
+    p_bucket_start[0] = 0;
+    for (i = 0; i < 256; i++)
+    {
+        pos[i] = p_bucket_start[i];
+        p_bucket_start[i + 1] = p_bucket_start[i] + count[i];
+    }
+    for (i = 0; i < num; i++)
+        pp_tmp[pos[p_oracle[i]]++] = pp_strv[i];
+    memcpy(pp_strv, pp_tmp, num * sizeof(char*));
+}
 
-    if (input != 0) 
-        close(input);
-
-    // Nothing more needs to be written
-    close(pipettes[USCH_FD_WRITE]);
+USCH_PRIV void priv_usch_radixsort(char **pp_strv, char **pp_tmp, unsigned char *p_oracle, size_t num, size_t depth)
+{
+    size_t bucket_start[257];
+    int c;
 
-    if (pp_out != NULL && last == 1)
+    for (;;)
     {
-        size_t i = 0;
-        size_t read_size = 1024;
-        p_priv_usch_stash_item = (struct priv_usch_stash_item*)calloc(read_size + sizeof(struct priv_usch_stash_item), 1);
-        if (p_priv_usch_stash_item == NULL)
-            goto end;
-        p_priv_usch_stash_item->p_next = NULL;
+        size_t largest = 0;
+        int largest_c = 0;
 
-        while (read(pipettes[USCH_FD_READ], &p_priv_usch_stash_item->str[i], 1) != 0)
+        if (num <= USCH_SORT_INSERTION_MAX)
         {
-            i++;
-            if (i >= read_size)
-            {
-                read_size *= 2;
-                p_priv_usch_stash_item = (struct priv_usch_stash_item*)realloc(p_priv_usch_stash_item, read_size + sizeof(struct priv_usch_stash_item));
-                if (p_priv_usch_stash_item == NULL)
-                    goto end;
-            }
+            priv_usch_insertionsort(pp_strv, num, depth);
+            return;
         }
-        p_priv_usch_stash_item->str[i] = '\0';
-        if (i > 0)
+        priv_usch_radixpass(pp_strv, pp_tmp, p_oracle, num, depth, bucket_start);
+        // bucket 0 holds strings that ended, they are all equal
+        for (c = 1; c < 256; c++)
         {
-            if (p_priv_usch_stash_item->str[i - 1] == '\n')
+            if (bucket_start[c + 1] - bucket_start[c] > largest)
             {
-                p_priv_usch_stash_item->str[i - 1] = '\0';
+                largest = bucket_start[c + 1] - bucket_start[c];
+                largest_c = c;
             }
         }
-
-    }
-
-    // If it's the last command, nothing more needs to be read
-    if (last == 1)
-    {
-        close(pipettes[USCH_FD_READ]);
+        // Every other bucket holds at most half of num, recursing only
+        // into those keeps the stack log2(num) frames deep, e.g. for
+        // "x", "xx", "xxx", ...
+        for (c = 1; c < 256; c++)
+        {
+            size_t len = bucket_start[c + 1] - bucket_start[c];
+            if (c != largest_c && len > 1)
+                priv_usch_radixsort(&pp_strv[bucket_start[c]], &pp_tmp[bucket_start[c]], &p_oracle[bucket_start[c]], len, depth + 1);
+        }
+        if (largest <= 1)
+            return;
+        // continue with the largest bucket without recursing
+        pp_strv += bucket_start[largest_c];
+        pp_tmp += bucket_start[largest_c];
+        p_oracle += bucket_start[largest_c];
+        num = largest;
+        depth++;
     }
+}
 
-    *p_child_pid = pid;
+USCH_PRIV void *priv_usch_sort_worker(void *p_arg)
+{
+    struct priv_usch_sort_job *p_job = (struct priv_usch_sort_job*)p_arg;
+    int c;
 
-    if (pp_out)
+    while ((c = __atomic_fetch_add(&p_job->next_bucket, 1, __ATOMIC_RELAXED)) < 256)
     {
-        *pp_out = p_priv_usch_stash_item;
+        size_t start = p_job->bucket_start[c];
+        size_t len = p_job->bucket_start[c + 1] - start;
+        if (c > 0 && len > 1)
+            priv_usch_radixsort(&p_job->pp_strv[start], &p_job->pp_tmp[start], &p_job->p_oracle[start], len, p_job->depth + 1);
     }
-    p_priv_usch_stash_item = NULL;
-end:
-    free(p_priv_usch_stash_item);
-    return pipettes[USCH_FD_READ];
+    return NULL;
 }
 
-/* @brief priv_usch_waitforall
- *
- * Wait for processes to terminate.
- *
- * @param  child_pid.
- * @return child error status.
- */
-static int priv_usch_waitforall(int child_pid)
+USCH_API char **usort(char **pp_strv)
 {
-    pid_t wpid;
-    int status;
-    int child_status;
-    do {
-        wpid = waitpid(child_pid, &status, WUNTRACED
-#ifdef WCONTINUED       /* Not all implementations support this */
-                | WCONTINUED
-#endif
-                );
-        if (wpid == -1) {
-            perror("waitpid");
-            exit(EXIT_FAILURE);
-        }
-
-        if (WIFEXITED(status)) {
-            child_status = WEXITSTATUS(status);
+    char **pp_tmp = NULL;
+    unsigned char *p_oracle = NULL;
+    size_t num = 0;
 
-        } else if (WIFSIGNALED(status)) {
-            child_status = -1;
+    if (pp_strv == NULL)
+        return pp_strv;
 
-        } else if (WIFSTOPPED(status)) {
-            child_status = -1;
-
-
-#ifdef WIFCONTINUED
-        } else if (WIFCONTINUED(status)) {
-            child_status = -1;
-#endif
-        } else {
-            child_status = -1;
-        }
-    } while (!WIFEXITED(status) && !WIFSIGNALED(status));
-    return child_status;
-}
-
-static int priv_usch_run(const char **pp_argv,
-                         int input,
-                         int first,
-                         int last,
-                         int *p_child_pid,
-                         struct priv_usch_stash_item **pp_out,
-                         int *p_num_calls)
-{
-    if (pp_argv[0] != NULL) {
-        *p_num_calls += 1;
-        return priv_usch_command(pp_argv, input, first, last, p_child_pid, pp_out);
+    while (pp_strv[num] != NULL)
+        num++;
+    if (num <= USCH_SORT_INSERTION_MAX)
+    {
+        priv_usch_insertionsort(pp_strv, num, 0);
+        return pp_strv;
     }
-    return 0;
-}
-
-static inline char **ufiletostrv(ustash *p_ustash, const char *p_filename, char *p_delims)
-{
-    FILE *p_file = NULL;
-    static char *p_strv[1] = {NULL};
-    char **pp_strv = NULL;
-    char *p_str = NULL;
-    size_t len = 0;
-    struct stat st;
-    size_t i, j;
-    size_t delims_len = 0;
-    size_t num_delims = 0;
-    size_t vpos = 0;
-    if (!p_filename || !p_ustash || !p_delims)
-        goto cleanup;
-    if (stat(p_filename, &st) == 0)
-        len = st.st_size;
-    else
-        goto cleanup;
 
-    p_file = fopen(p_filename, "rb");
-    if (!p_file)
-        goto cleanup;
-    p_str = (char*)malloc(len+1);
-    if (!p_str) goto cleanup;
+    pp_tmp = (char**)malloc(num * sizeof(char*));
+    p_oracle = (unsigned char*)malloc(num);
+    if (pp_tmp == NULL || p_oracle == NULL)
+    {
+        // no memory for the radix sort
+        qsort(pp_strv, num, sizeof(char*), priv_usch_strcmp_qsort);
+        goto end;
+    }
 
-    if (fread(p_str, 1, len, p_file) != len) goto cleanup;
-    delims_len = strlen(p_delims);
-    for (i = 0; i < len; i++)
+    if (num >= USCH_SORT_PARALLEL_MIN)
     {
-        for (j = 0; j < delims_len; j++)
+        struct priv_usch_sort_job job;
+        pthread_t threads[16];
+        long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+        long i;
+        long started = 0;
+
+        if (num_threads > 16)
+            num_threads = 16;
+
+        memset(&job, 0, sizeof(job));
+        job.pp_strv = pp_strv;
+        job.pp_tmp = pp_tmp;
+        job.p_oracle = p_oracle;
+        // skip common prefixes, e.g. "/home/user/" of a glob result
+        for (;;)
         {
-            if (p_str[i] == p_delims[j])
+            int c;
+            priv_usch_radixpass(pp_strv, pp_tmp, p_oracle, num, job.depth, job.bucket_start);
+            for (c = 1; c < 256; c++)
             {
-                p_str[i] = '\0';
-                num_delims++;
+                if (job.bucket_start[c + 1] - job.bucket_start[c] == num)
+                    break;
             }
+            if (c == 256)
+                break;
+            job.depth++;
         }
-    }
-    pp_strv = (char**)malloc((num_delims+1)*sizeof(char*));
-    if (!pp_strv) goto cleanup;
-
-    pp_strv[vpos++] = p_str;
-    for (i = 0; i < len; i++)
-    {
-        if (p_str[i] == '\0' && i + 1 != len)
+        for (i = 1; i < num_threads; i++)
         {
-            pp_strv[vpos++] = &p_str[i+1];
+            if (pthread_create(&threads[started], NULL, priv_usch_sort_worker, &job) != 0)
+                break;
+            started++;
         }
+        priv_usch_sort_worker(&job);
+        for (i = 0; i < started; i++)
+            pthread_join(threads[i], NULL);
     }
-    pp_strv[vpos] = NULL;
-cleanup:
-    if (p_file) fclose(p_file);
-    if (!pp_strv)
-        pp_strv = p_strv;
+    else
+    {
+        priv_usch_radixsort(pp_strv, pp_tmp, p_oracle, num, 0);
+    }
+end:
+    free(pp_tmp);
+    free(p_oracle);
     return pp_strv;
 }
 
-static inline int ustrvtofile(const char **pp_strv, const char *p_filename, const char *p_delim)
+USCH_API char **uuniq(char **pp_strv)
 {
-    int i = 0;
-    int res = 0;
-    FILE *p_file = NULL;
-    if (!pp_strv || !p_filename || !p_delim)
-        return -1;
-    
-    size_t delim_len = strlen(p_delim);
+    size_t i;
+    size_t pos = 0;
 
-    p_file = fopen(p_filename, "w");
-    if (!p_file)
-    {
-        res = -1;
-        goto cleanup;
-    }
+    if (pp_strv == NULL || pp_strv[0] == NULL)
+        return pp_strv;
 
-    while (pp_strv[i] != NULL)
+    for (i = 1; pp_strv[i] != NULL; i++)
     {
-        size_t bytes_to_write = strlen(pp_strv[i]);
-        size_t bytes_written = fwrite(pp_strv[i], sizeof(char), bytes_to_write, p_file);
-
-        if (bytes_to_write != bytes_written)
-        {
-            res = -1;
-            goto cleanup;
-        }
-        bytes_written = fwrite(p_delim, sizeof(char), delim_len, p_file);
-        if (delim_len != bytes_written)
-        {
-            res = -1;
-            goto cleanup;
-        }
-        i++;
+        if (strcmp(pp_strv[i], pp_strv[pos]) != 0)
+            pp_strv[++pos] = pp_strv[i];
     }
-cleanup:
-    if (p_file)
-        fclose(p_file);
-    return res;
+    pp_strv[pos + 1] = NULL;
+    return pp_strv;
 }
 
-static inline USCH_BOOL ustreq(const char *p_a, const char *p_b)
+USCH_API USCH_BOOL ustreq(const char *p_a, const char *p_b)
 {
     if (p_a == NULL ||
         p_b == NULL)
@@ -1124,7 +7045,7 @@ static inline USCH_BOOL ustreq(const char *p_a, const char *p_b)
     return !strcmp(p_a, p_b);
 }
 
-static inline USCH_BOOL ustrneq(const char *p_a, const char *p_b, size_t len)
+USCH_API USCH_BOOL ustrneq(const char *p_a, const char *p_b, size_t len)
 {
     if (p_a == NULL ||
         p_b == NULL ||
@@ -1149,6 +7070,7 @@ static inline USCH_BOOL ustrneq(const char *p_a, const char *p_b, size_t len)
     return equal;
 }
 
+#endif // !USCH_DECLARATIONS_ONLY || USCH_IMPLEMENTATION
 
 #if NEED_VIM_WORKAROUND
 {
@@ -0,0 +1,287 @@
+/*
+ * USCH - The (permutated) tcsh successor
+ * Copyright (c) 2014 Thomas Eriksson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * uschrepl - interactive usch.h REPL
+ *
+ * Every line entered is compiled into a small shared object and run in
+ * this process, so ustash contents, the working directory and the
+ * environment carry over from line to line. The driver holds the only
+ * copy of the usch.h functions (USCH_IMPLEMENTATION); lines see just the
+ * declarations, precompiled once at startup, and call into the driver,
+ * sharing its fork server and environment snapshot.
+ *
+ * Build:
+ *   cc -O2 -rdynamic -DUSCH_INCLUDE_DIR="\"$PWD\"" -o uschrepl uschrepl.c -ldl -pthread
+ *
+ * -rdynamic exports "stash" and the usch.h functions to the compiled
+ * lines. USCH_INCLUDE_DIR, or the environment variable of the same name,
+ * is the directory of usch.h. The compiler is $CC, or cc. Lines are
+ * compiled in a new directory below $TMPDIR, or /tmp.
+ *
+ * Usage:
+ *   usch> ucmd("ls", "-l");
+ *   usch> char *p_rev = ustrout(&stash, "git", "rev-parse", "HEAD");
+ *   usch> #include <math.h>
+ *   usch> :q
+ *
+ * Lines starting with '#' are added to the precompiled prelude. Other
+ * lines are the body of a function, so variables declared on one line
+ * are gone on the next; keep results in "stash", or in non-static globals
+ * defined by a header the prelude includes. End a line with '\' to
+ * continue it.
+ *
+ * The prelude is also compiled into a shared object of its own, loaded
+ * RTLD_GLOBAL before any line that includes it. The dynamic linker looks
+ * up globals there before in the line itself, so every line uses the
+ * prelude's copy of a global instead of its own.
+ */
+#define USCH_IMPLEMENTATION
+#include "usch.h"
+
+#include <dlfcn.h>    // for dlopen, dlsym, dlerror
+
+#ifndef USCH_INCLUDE_DIR
+#define USCH_INCLUDE_DIR "."
+#endif // USCH_INCLUDE_DIR
+
+/* the stash shared by all lines */
+ustash stash = {NULL};
+
+struct repl
+{
+    ustash *p_ustash;
+    const char *p_cc;
+    const char *p_include_dir;
+    char *p_workdir;
+    char *p_prelude;
+    USCH_BOOL clang;
+    int num_lines;
+    int num_preludes;
+};
+
+static int repl_write(const char *p_filename, const char *p_str)
+{
+    const char *strv[2];
+    strv[0] = p_str;
+    strv[1] = NULL;
+    return ustrvtofile(strv, p_filename, "");
+}
+
+static int repl_build_prelude(struct repl *p_repl)
+{
+    ustash tmp = {NULL};
+    char *p_header = upathjoin(&tmp, p_repl->p_workdir, "prelude.h");
+    char *p_pch = ustrjoin(&tmp, p_header, p_repl->clang ? ".pch" : ".gch");
+    char *p_include = ustrjoin(&tmp, "-I", p_repl->p_include_dir);
+    int status;
+
+    status = repl_write(p_header, p_repl->p_prelude);
+    if (status == 0)
+        status = ucmd(p_repl->p_cc, "-std=gnu99", "-O0", "-fPIC", "-fsemantic-interposition", "-pthread", p_include, "-x", "c-header", p_header, "-o", p_pch);
+    uclear(&tmp);
+    return status;
+}
+
+/*
+ * Compile the definitions of the current prelude into a new shared object
+ * and load it RTLD_GLOBAL. Globals of an earlier prelude object are found
+ * first, so they keep their values.
+ */
+static int repl_load_prelude(struct repl *p_repl)
+{
+    ustash tmp = {NULL};
+    char *p_source = ustrfmt(&tmp, "%s/prelude%d.c", p_repl->p_workdir, p_repl->num_preludes);
+    char *p_object = ustrfmt(&tmp, "%s/prelude%d.so", p_repl->p_workdir, p_repl->num_preludes);
+    char *p_include = ustrjoin(&tmp, "-I", p_repl->p_include_dir);
+    char *p_pch = ustrfmt(&tmp, "%s/prelude.h.pch", p_repl->p_workdir);
+    int status;
+
+    p_repl->num_preludes++;
+    status = repl_write(p_source, "#include \"prelude.h\"\n");
+    if (status != 0)
+        goto end;
+    if (p_repl->clang)
+        status = ucmd(p_repl->p_cc, "-std=gnu99", "-O0", "-fPIC", "-fsemantic-interposition", "-pthread", "-shared", p_include, "-include-pch", p_pch, p_source, "-o", p_object);
+    else
+        status = ucmd(p_repl->p_cc, "-std=gnu99", "-O0", "-fPIC", "-fsemantic-interposition", "-pthread", "-shared", p_include, p_source, "-o", p_object);
+    if (status != 0)
+        goto end;
+    // never closed, lines refer to its globals
+    if (dlopen(p_object, RTLD_NOW | RTLD_GLOBAL) == NULL)
+    {
+        fprintf(stderr, "uschrepl: %s\n", dlerror());
+        status = -1;
+    }
+end:
+    uclear(&tmp);
+    return status;
+}
+
+static void repl_add_prelude(struct repl *p_repl, const char *p_line)
+{
+    char *p_old = p_repl->p_prelude;
+
+    p_repl->p_prelude = ustrfmt(p_repl->p_ustash, "%s%s\n", p_old, p_line);
+    if (repl_build_prelude(p_repl) != 0 || repl_load_prelude(p_repl) != 0)
+    {
+        // keep the last prelude that compiled
+        p_repl->p_prelude = p_old;
+        (void)repl_build_prelude(p_repl);
+    }
+}
+
+static void repl_run_line(struct repl *p_repl, const char *p_line)
+{
+    ustash tmp = {NULL};
+    char *p_source = ustrfmt(&tmp, "%s/line%d.c", p_repl->p_workdir, p_repl->num_lines);
+    char *p_object = ustrfmt(&tmp, "%s/line%d.so", p_repl->p_workdir, p_repl->num_lines);
+    char *p_include = ustrjoin(&tmp, "-I", p_repl->p_include_dir);
+    char *p_pch = ustrfmt(&tmp, "%s/prelude.h.pch", p_repl->p_workdir);
+    void *p_handle;
+    void (*p_func)(void);
+    int status;
+
+    p_repl->num_lines++;
+    if (repl_write(p_source, ustrfmt(&tmp,
+            "#include \"prelude.h\"\n"
+            "void uschrepl_line(void)\n"
+            "{\n"
+            "#line 1 \"<usch>\"\n"
+            "%s\n"
+            "}\n", p_line)) != 0)
+        goto end;
+
+    if (p_repl->clang)
+        status = ucmd(p_repl->p_cc, "-std=gnu99", "-O0", "-fPIC", "-fsemantic-interposition", "-pthread", "-shared", p_include, "-include-pch", p_pch, p_source, "-o", p_object);
+    else
+        status = ucmd(p_repl->p_cc, "-std=gnu99", "-O0", "-fPIC", "-fsemantic-interposition", "-pthread", "-shared", p_include, p_source, "-o", p_object);
+    if (status != 0)
+        goto end;
+
+    // never closed, strings in the stash may point into the object
+    p_handle = dlopen(p_object, RTLD_NOW | RTLD_LOCAL);
+    if (p_handle == NULL)
+    {
+        fprintf(stderr, "uschrepl: %s\n", dlerror());
+        goto end;
+    }
+    *(void**)&p_func = dlsym(p_handle, "uschrepl_line");
+    if (p_func == NULL)
+    {
+        fprintf(stderr, "uschrepl: %s\n", dlerror());
+        goto end;
+    }
+    p_func();
+    fflush(stdout);
+end:
+    uclear(&tmp);
+}
+
+int main(int argc, char **argv)
+{
+    struct repl repl;
+    const char *p_tmpdir = uenvget("TMPDIR");
+    char *workdir;
+    char *line = NULL;
+    size_t line_size = 0;
+    char *p_pending = NULL;
+    USCH_BOOL tty = isatty(STDIN_FILENO);
+    (void)argc;
+    (void)argv;
+
+    memset(&repl, 0, sizeof(repl));
+    repl.p_ustash = &stash;
+    repl.p_cc = uenvget("CC") ? uenvget("CC") : "cc";
+    repl.clang = strstr(ubasename(&stash, repl.p_cc), "clang") != NULL;
+    repl.p_include_dir = uenvget("USCH_INCLUDE_DIR") ? uenvget("USCH_INCLUDE_DIR") : USCH_INCLUDE_DIR;
+    repl.p_include_dir = urealpath(&stash, repl.p_include_dir);
+    workdir = ustrfmt(&stash, "%s/uschrepl.XXXXXX", p_tmpdir != NULL && p_tmpdir[0] != '\0' ? p_tmpdir : "/tmp");
+    if (mkdtemp(workdir) == NULL)
+    {
+        perror("uschrepl: mkdtemp");
+        return 1;
+    }
+    // absolute, lines may "cd" elsewhere
+    workdir = urealpath(&stash, workdir);
+    repl.p_workdir = workdir;
+    repl.p_prelude = ustrjoin(&stash,
+            "#define USCH_DECLARATIONS_ONLY\n"
+            "#include \"usch.h\"\n"
+            "extern ustash stash;\n");
+    if (repl_build_prelude(&repl) != 0 || repl_load_prelude(&repl) != 0)
+    {
+        fprintf(stderr, "uschrepl: can not compile %s/usch.h, set USCH_INCLUDE_DIR\n", repl.p_include_dir);
+        ucmd("rm", "-rf", "--", workdir);
+        return 1;
+    }
+    (void)uforkserver();
+
+    for (;;)
+    {
+        ssize_t res;
+        size_t len;
+
+        if (tty)
+        {
+            fputs(p_pending ? "....> " : "usch> ", stdout);
+            fflush(stdout);
+        }
+        res = getline(&line, &line_size, stdin);
+        if (res < 0)
+            break;
+        len = (size_t)res;
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+
+        if (len > 0 && line[len - 1] == '\\')
+        {
+            line[len - 1] = '\0';
+            p_pending = ustrfmt(&stash, "%s%s\n", p_pending ? p_pending : "", line);
+            continue;
+        }
+        if (p_pending != NULL)
+        {
+            p_pending = ustrjoin(&stash, p_pending, line);
+            len = strlen(p_pending);
+        }
+        else
+        {
+            p_pending = line;
+        }
+
+        if (len > 0 && ustreq(ustrtrim(&stash, p_pending), ":q"))
+            break;
+        if (p_pending[0] == '#')
+            repl_add_prelude(&repl, p_pending);
+        else if (len > 0)
+            repl_run_line(&repl, p_pending);
+        p_pending = NULL;
+    }
+
+    uforkserverstop();
+    ucmd("rm", "-rf", "--", workdir);
+    free(line);
+    uclear(&stash);
+    return 0;
+}